@@ -1,20 +1,40 @@
+#define _POSIX_C_SOURCE 200809L
+// MAP_ANONYMOUS for the JIT
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
-#include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAS_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 typedef uint8_t byte;
 typedef double f64;
 typedef uint64_t u64;
 
 #define MAX(x, y) ((x) >= (y) ? (x) : (y))
+#define MIN(x, y) ((x) <= (y) ? (x) : (y))
 
 void *xrealloc(void *ptr, size_t new_size)
 {
@@ -26,6 +46,16 @@ void *xrealloc(void *ptr, size_t new_size)
     return ptr;
 }
 
+void *xcalloc(size_t num, size_t size)
+{
+    void *ptr = calloc(num, size);
+    if (!ptr) {
+        perror("calloc failed");
+        exit(1);
+    }
+    return ptr;
+}
+
 void *xmalloc(size_t size)
 {
     void *ptr = malloc(size);
@@ -36,10 +66,24 @@ void *xmalloc(size_t size)
     return ptr;
 }
 
+// Where fatal reports to instead of exiting, so a thread can give up on one
+// piece of work and go on with the next
+typedef struct FatalHandler {
+    jmp_buf jmp;
+    char message[256];
+} FatalHandler;
+
+static _Thread_local FatalHandler *fatal_handler;
+
 void fatal(const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
+    if (fatal_handler) {
+        vsnprintf(fatal_handler->message, sizeof(fatal_handler->message), fmt, args);
+        va_end(args);
+        longjmp(fatal_handler->jmp, 1);
+    }
     printf("FATAL: ");
     vprintf(fmt, args);
     printf("\n");
@@ -57,47 +101,387 @@ void syntax_error(const char *fmt, ...)
     va_end(args);
 }
 
+#define ALIGN_DOWN(n, a) ((n) & ~((a)-1))
+#define ALIGN_UP(n, a) ALIGN_DOWN((n) + (a)-1, (a))
+#define ALIGN_UP_PTR(p, a) ((void *)ALIGN_UP((uintptr_t)(p), (a)))
+
+f64 now_seconds()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    const char *start;
+    const char *end;
+} mapped_file_t;
+
+// Maps a file read-only into memory. Returns false with errno set on failure.
+bool map_file(const char *path, mapped_file_t *file)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        // mmap rejects empty mappings
+        close(fd);
+        *file = (mapped_file_t){ "", "" };
+        return true;
+    }
+    void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = errno;
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        errno = err;
+        return false;
+    }
+    posix_madvise(ptr, size, POSIX_MADV_SEQUENTIAL);
+    *file = (mapped_file_t){ ptr, (const char *)ptr + size };
+    return true;
+}
+
+void unmap_file(mapped_file_t *file)
+{
+    if (file->end != file->start) {
+        munmap((void *)file->start, file->end - file->start);
+    }
+    *file = (mapped_file_t){ 0 };
+}
+
+// Creates dir with mode 0700 if it's missing, then checks that it's a real
+// directory owned by this user that nobody else can write to. Returns false
+// with errno set if it can't be made or isn't.
+bool make_private_dir(const char *dir)
+{
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+    struct stat st;
+    if (lstat(dir, &st) != 0) {
+        return false;
+    }
+    bool shared = st.st_mode & (S_IWGRP | S_IWOTH);
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || shared) {
+        errno = EACCES;
+        return false;
+    }
+    return true;
+}
+
+// Finds the per-user directory for temporary files and builds,
+// $XDG_CACHE_HOME/tyrion or ~/.cache/tyrion, creating it if needed. Shared
+// objects in it get loaded into this process, so it must be private.
+bool cache_dir(char *path, size_t size)
+{
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char parent[PATH_MAX];
+    int len;
+    // The XDG spec says to ignore relative paths
+    if (base && base[0] == '/') {
+        len = snprintf(parent, sizeof(parent), "%s", base);
+    } else if (home && home[0] == '/') {
+        len = snprintf(parent, sizeof(parent), "%s/.cache", home);
+    } else {
+        errno = ENOENT;
+        return false;
+    }
+    if (len < 0 || (size_t)len >= sizeof(parent)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    mkdir(parent, 0700);
+    len = snprintf(path, size, "%s/tyrion", parent);
+    if (len < 0 || (size_t)len >= size) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return make_private_dir(path);
+}
+
+// Writes data to a new temporary file in cache_dir and returns its path
+char *write_temp_file(const void *data, size_t size)
+{
+    char dir[PATH_MAX];
+    if (!cache_dir(dir, sizeof(dir))) {
+        fatal("write_temp_file: no private cache directory: %s", strerror(errno));
+    }
+    char *path = xmalloc(strlen(dir) + sizeof("/tmp-XXXXXX"));
+    sprintf(path, "%s/tmp-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0 || write(fd, data, size) != (ssize_t)size) {
+        fatal("write_temp_file: %s", strerror(errno));
+    }
+    close(fd);
+    return path;
+}
+
+// Runs argv[0], found on PATH, and waits for it. Returns whether it exited
+// with status 0.
+bool run_command(char *const *argv)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// xorshift64*, for deterministic test and benchmark inputs
+u64 rng_state = 0x9e3779b97f4a7c15ull;
+
+u64 rng_next()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+typedef struct {
+    char *base;
+    size_t size;
+} arena_block_t;
+
+// Blocks are kept across arena_reset so that a reset arena refills the same
+// memory instead of going back to malloc.
+typedef struct {
+    char *ptr;
+    char *end;
+    arena_block_t *blocks;
+    size_t num_blocks;
+    size_t block;
+} arena_t;
+
+enum {
+    ARENA_ALIGNMENT = 8,
+    ARENA_BLOCK_SIZE = 1024 * 1024,
+};
+
+void arena_grow(arena_t *arena, size_t min_size)
+{
+    size_t next = arena->num_blocks ? arena->block + 1 : 0;
+    if (next == arena->num_blocks || arena->blocks[next].size < min_size) {
+        size_t size = ALIGN_UP(MAX(min_size, ARENA_BLOCK_SIZE), ARENA_ALIGNMENT);
+        arena->blocks =
+            xrealloc(arena->blocks, (arena->num_blocks + 1) * sizeof(arena_block_t));
+        memmove(
+            &arena->blocks[next + 1], &arena->blocks[next],
+            (arena->num_blocks - next) * sizeof(arena_block_t));
+        arena->blocks[next] = (arena_block_t){ xmalloc(size), size };
+        arena->num_blocks++;
+    }
+    arena->block = next;
+    arena->ptr = arena->blocks[next].base;
+    arena->end = arena->ptr + arena->blocks[next].size;
+}
+
+void *arena_alloc_aligned(arena_t *arena, size_t size, size_t align)
+{
+    char *ptr = ALIGN_UP_PTR(arena->ptr, align);
+    if (!arena->ptr || size > (size_t)(arena->end - ptr)) {
+        arena_grow(arena, size + align - 1);
+        ptr = ALIGN_UP_PTR(arena->ptr, align);
+    }
+    arena->ptr = ptr + size;
+    return ptr;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    return arena_alloc_aligned(arena, size, ARENA_ALIGNMENT);
+}
+
+char *arena_strdup_range(arena_t *arena, const char *start, const char *end)
+{
+    size_t len = end - start;
+    char *str = arena_alloc_aligned(arena, len + 1, 1);
+    memcpy(str, start, len);
+    str[len] = 0;
+    return str;
+}
+
+char *arena_strdup(arena_t *arena, const char *str)
+{
+    return arena_strdup_range(arena, str, str + strlen(str));
+}
+
+// Releases everything allocated from the arena in O(1). The blocks are
+// retained and reused by subsequent allocations.
+void arena_reset(arena_t *arena)
+{
+    if (arena->num_blocks) {
+        arena->block = 0;
+        arena->ptr = arena->blocks[0].base;
+        arena->end = arena->ptr + arena->blocks[0].size;
+    }
+}
+
+void arena_free(arena_t *arena)
+{
+    for (size_t i = 0; i < arena->num_blocks; i++) {
+        free(arena->blocks[i].base);
+    }
+    free(arena->blocks);
+    *arena = (arena_t){ 0 };
+}
+
+// A buffer grown from an arena remembers it in its header; later pushes keep
+// drawing from the same arena and buf_free just forgets the buffer.
 typedef struct {
     size_t len;
     size_t cap;
+    arena_t *arena;
     char buf[];
 } buf_hdr_t;
 
 // clang-format off
-#define buf__raw(b) ((size_t *)(b)-2)
-#define buf__len(b) buf__raw(b)[0]
-#define buf__cap(b) buf__raw(b)[1]
+#define buf__hdr(b) ((buf_hdr_t *)((char *)(b) - offsetof(buf_hdr_t, buf)))
+#define buf__len(b) buf__hdr(b)->len
+#define buf__cap(b) buf__hdr(b)->cap
 
 #define buf__fit(b, n)  (buf__fits(b, n) ? 0 : buf__grow(b, buf_len(b)+(n)))
 #define buf__fits(b, n) ((b) && buf__len(b)+(n) <= buf__cap(b))
-#define buf__grow(b, n) (*((void **)&(b)) = buf___grow((b), (n), sizeof(*(b))))
+#define buf__grow(b, n) (*((void **)&(b)) = buf___grow((b), (n), sizeof(*(b)), NULL))
+
+#define buf__fit_arena(b, a, n)  (buf__fits(b, n) ? 0 : buf__grow_arena(b, a, buf_len(b)+(n)))
+#define buf__grow_arena(b, a, n) (*((void **)&(b)) = buf___grow((b), (n), sizeof(*(b)), (a)))
 
 #define buf_cap(b)        ((b) ? buf__cap(b) : 0)
 #define buf_end(b)        ((b) + buf_len(b))
-#define buf_free(b)       ((b) ? (free(buf__raw(b)), (b) = NULL) : 0)
-#define buf_hdr(b)        ((buf_hdr_t *)buf__raw(b))
+#define buf_free(b)       ((b) ? (buf___free(b), (b) = NULL) : 0)
+#define buf_hdr(b)        ((b) ? buf__hdr(b) : NULL)
 #define buf_len(b)        ((b) ? buf__len(b) : 0)
 #define buf_push(b, x)    (buf__fit(b, 1), (b)[buf__len(b)++] = (x))
 #define buf_reserve(b, n) (buf__fit(b, n), (b)[buf__len(b)])
 
+#define buf_fit_arena(b, a, n)  buf__fit_arena(b, a, n)
+#define buf_push_arena(b, a, x) (buf__fit_arena(b, a, 1), (b)[buf__len(b)++] = (x))
+
 // for use in debugger
 size_t bufcap(const void *b) { return buf_cap(b); }
 size_t buflen(const void *b) { return buf_len(b); }
 buf_hdr_t *bufhdr(const void *b) { return buf_hdr(b); }
 
-void *buf___grow(const void *b, size_t len, size_t elem_size)
+void *buf___grow(const void *b, size_t len, size_t elem_size, arena_t *arena)
 {
     assert(buf_cap(b) <= (SIZE_MAX - 1)/2);
     size_t cap = MAX(2 * buf_cap(b), len);
     assert(len <= cap && cap <= (SIZE_MAX - offsetof(buf_hdr_t, buf))/elem_size);
     size_t size = offsetof(buf_hdr_t, buf) + elem_size * cap;
-    buf_hdr_t *hdr = (buf_hdr_t *)xrealloc(b ? buf__raw(b) : NULL, size);
+    buf_hdr_t *hdr;
+    if (b) arena = buf__hdr(b)->arena;
+    if (arena) {
+        hdr = arena_alloc(arena, size);
+        if (b) memcpy(hdr, buf__hdr(b), offsetof(buf_hdr_t, buf) + elem_size * buf__len(b));
+    } else {
+        hdr = xrealloc(b ? buf__hdr(b) : NULL, size);
+    }
     hdr->cap = cap;
+    hdr->arena = arena;
     if (!b) hdr->len = 0;
     return hdr->buf;
 }
+
+void buf___free(const void *b)
+{
+    if (!buf__hdr(b)->arena) free(buf__hdr(b));
+}
+
+#define buf_printf(b, ...) ((b) = buf___printf((b), __VA_ARGS__))
+
+// Appends formatted text to a char buffer, keeping it NUL-terminated
+char *buf___printf(char *b, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    size_t avail = buf_cap(b) - buf_len(b);
+    size_t n = 1 + vsnprintf(buf_end(b), avail, fmt, args);
+    va_end(args);
+    if (n > avail) {
+        buf__fit(b, n);
+        va_start(args, fmt);
+        vsnprintf(buf_end(b), buf_cap(b) - buf_len(b), fmt, args);
+        va_end(args);
+    }
+    buf__len(b) += n - 1;
+    return b;
+}
 // clang-format on
 
+void arena_test(void)
+{
+    arena_t arena = { 0 };
+
+    // allocations are aligned and don't overlap
+    char *a = arena_alloc(&arena, 1);
+    char *b = arena_alloc(&arena, 16);
+    assert((uintptr_t)a % ARENA_ALIGNMENT == 0);
+    assert((uintptr_t)b % ARENA_ALIGNMENT == 0);
+    assert(b >= a + 1);
+
+    // strings are packed without padding
+    char *s = arena_strdup(&arena, "hello");
+    char *t = arena_strdup(&arena, "world");
+    assert(strcmp(s, "hello") == 0 && strcmp(t, "world") == 0);
+    assert(t == s + 6);
+
+    // allocations spill into new blocks, including oversized ones
+    for (int i = 0; i < 3 * ARENA_BLOCK_SIZE / 1024; i++) {
+        memset(arena_alloc(&arena, 1024), i, 1024);
+    }
+    char *big = arena_alloc(&arena, 2 * ARENA_BLOCK_SIZE);
+    memset(big, 0, 2 * ARENA_BLOCK_SIZE);
+    size_t num_blocks = arena.num_blocks;
+    assert(num_blocks >= 4);
+
+    // reset rewinds to the first block and reuses the retained blocks
+    arena_reset(&arena);
+    assert(arena_alloc(&arena, 1) == a);
+    for (int i = 0; i < 3 * ARENA_BLOCK_SIZE / 1024; i++) {
+        arena_alloc(&arena, 1024);
+    }
+    assert(arena.num_blocks == num_blocks);
+
+    // buffers can be grown from an arena
+    arena_reset(&arena);
+    int *buf = NULL;
+    buf_fit_arena(buf, &arena, 1);
+    assert(buf_hdr(buf)->arena == &arena);
+    for (int i = 0; i < 1024; i++) {
+        buf_push(buf, i);
+    }
+    for (int i = 0; i < 1024; i++) {
+        assert(buf[i] == i);
+    }
+    assert(buf_hdr(buf)->arena == &arena);
+    buf_free(buf);
+    assert(buf == NULL);
+
+    arena_free(&arena);
+    assert(arena.num_blocks == 0);
+}
+
 void buf_test(void)
 {
     // setup
@@ -127,27 +511,127 @@ void buf_test(void)
     assert(!buf_len(b));
 }
 
+// An interned string, allocated once and never changed or moved
 typedef struct {
+    u64 hash;
     size_t len;
-    const char *str;
+    char str[];
 } intern_t;
 
-static intern_t *interns;
+// Open-addressed table of interned strings shared by every thread. Lookups
+// take no locks: a slot goes from empty to its entry with one CAS and never
+// changes after that, so a hit is a handful of loads. Growing is the only
+// locked path. The grower seals each empty slot of the old map with
+// intern_moved before copying, so an insert racing with the copy fails its
+// CAS and retries on the new map instead of getting lost.
+typedef struct {
+    size_t cap; // always a power of two
+    atomic_size_t len;
+    _Atomic(intern_t *) entries[];
+} intern_map_t;
+
+static _Atomic(intern_map_t *) interns;
+static pthread_mutex_t intern_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+static intern_t intern_moved;
+
+// Strings are carved from the arena of the thread that interned them first.
+// It's never freed, since the strings outlive the thread.
+static _Thread_local arena_t intern_arena;
+
+u64 str_hash_range(const char *start, const char *end)
+{
+    // FNV-1a
+    u64 hash = 0xcbf29ce484222325ull;
+    for (const char *it = start; it != end; it++) {
+        hash ^= (byte)*it;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Replaces map with one twice the size, unless another thread already did.
+// Readers may still be probing the old map, so it's never freed; all the old
+// maps together are smaller than the current one.
+void intern_map_grow(intern_map_t *map)
+{
+    pthread_mutex_lock(&intern_grow_lock);
+    if (atomic_load(&interns) == map) {
+        size_t cap = map ? 2 * map->cap : 64;
+        intern_map_t *grown = xcalloc(1, sizeof(intern_map_t) + cap * sizeof(intern_t *));
+        grown->cap = cap;
+        size_t len = 0;
+        for (size_t i = 0; map && i < map->cap; i++) {
+            intern_t *it = NULL;
+            if (atomic_compare_exchange_strong(&map->entries[i], &it, &intern_moved)) {
+                continue;
+            }
+            size_t j = it->hash & (cap - 1);
+            while (atomic_load_explicit(&grown->entries[j], memory_order_relaxed)) {
+                j = (j + 1) & (cap - 1);
+            }
+            atomic_store_explicit(&grown->entries[j], it, memory_order_relaxed);
+            len++;
+        }
+        atomic_store_explicit(&grown->len, len, memory_order_relaxed);
+        atomic_store_explicit(&interns, grown, memory_order_release);
+    }
+    pthread_mutex_unlock(&intern_grow_lock);
+}
 
 const char *str_intern_range(const char *restrict start, const char *restrict end)
 {
     size_t len = end - start;
-    for (intern_t *it = interns; it != buf_end(interns); it++) {
-        if (it->len == len && strncmp(it->str, start, len) == 0) {
-            return it->str;
+    u64 hash = str_hash_range(start, end);
+    intern_t *new_entry = NULL;
+    for (;;) {
+        intern_map_t *map = atomic_load_explicit(&interns, memory_order_acquire);
+        if (!map) {
+            intern_map_grow(map);
+            continue;
+        }
+        size_t mask = map->cap - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            intern_t *it = atomic_load_explicit(&map->entries[i], memory_order_acquire);
+            if (!it) {
+                // Only misses check the load, so hits never touch the counter
+                size_t map_len = atomic_load_explicit(&map->len, memory_order_relaxed);
+                if (2 * (map_len + 1) > map->cap) {
+                    intern_map_grow(map);
+                    break;
+                }
+                if (!new_entry) {
+                    new_entry = arena_alloc(&intern_arena, sizeof(intern_t) + len + 1);
+                    new_entry->hash = hash;
+                    new_entry->len = len;
+                    memcpy(new_entry->str, start, len);
+                    new_entry->str[len] = 0;
+                }
+                if (atomic_compare_exchange_strong_explicit(
+                        &map->entries[i], &it, new_entry, memory_order_acq_rel,
+                        memory_order_acquire)) {
+                    atomic_fetch_add_explicit(&map->len, 1, memory_order_relaxed);
+                    return new_entry->str;
+                }
+                // Lost the slot; it now holds the winner. If that's the same
+                // string, new_entry is left unused in the arena.
+            }
+            if (it == &intern_moved) {
+                // Wait for the grower to publish the new map, then retry there
+                intern_map_grow(map);
+                break;
+            }
+            if (it->hash == hash && it->len == len && memcmp(it->str, start, len) == 0) {
+                return it->str;
+            }
         }
     }
+}
 
-    char *str = xmalloc(len + 1);
-    memcpy(str, start, len);
-    str[len] = 0;
-    buf_push(interns, ((intern_t){ len, str }));
-    return str;
+// Number of distinct strings interned so far
+size_t intern_count()
+{
+    intern_map_t *map = atomic_load_explicit(&interns, memory_order_acquire);
+    return map ? atomic_load_explicit(&map->len, memory_order_relaxed) : 0;
 }
 
 const char *str_intern(const char *str)
@@ -162,15 +646,181 @@ void str_intern_test()
     assert(str_intern(a) == str_intern(a));
     assert(str_intern(str_intern(a)) == str_intern(a));
     char b[] = "hello";
-    assert(a != b);
+    assert((char *)a != (char *)b);
     assert(str_intern(a) == str_intern(b));
     char c[] = "hello!";
     assert(str_intern(a) != str_intern(c));
     char d[] = "hell";
     assert(str_intern(a) != str_intern(d));
+    char e[] = "";
+    assert(str_intern(e) == str_intern(""));
+    assert(str_intern(e) != str_intern(a));
+}
+
+void str_intern_stress_test()
+{
+    enum { N = 1000000 };
+    const char **strs = xmalloc(N * sizeof(*strs));
+    size_t len = intern_count();
+    char name[32];
+    for (int i = 0; i < N; i++) {
+        snprintf(name, sizeof(name), "name%d", i);
+        strs[i] = str_intern(name);
+        assert(strcmp(strs[i], name) == 0);
+    }
+    assert(intern_count() == len + N);
+    for (int i = 0; i < N; i++) {
+        snprintf(name, sizeof(name), "name%d", i);
+        assert(str_intern(name) == strs[i]);
+    }
+    assert(intern_count() == len + N);
+    free(strs);
+}
+
+enum { INTERN_THREADS = 8, INTERN_SHARED = 20000, INTERN_OWN = 5000 };
+
+typedef struct InternJob {
+    int id;
+    const char **shared; // what this thread got for each shared name
+} InternJob;
+
+void *intern_worker(void *arg)
+{
+    InternJob *job = arg;
+    char name[32];
+    for (int k = 0; k < INTERN_SHARED; k++) {
+        // Each thread walks the shared names from a different place, so they
+        // race to insert the same strings
+        int i = (k + job->id * INTERN_SHARED / INTERN_THREADS) % INTERN_SHARED;
+        snprintf(name, sizeof(name), "shared%d", i);
+        job->shared[i] = str_intern(name);
+        if (k % (INTERN_SHARED / INTERN_OWN) == 0) {
+            snprintf(name, sizeof(name), "own%d_%d", job->id, k);
+            assert(strcmp(str_intern(name), name) == 0);
+        }
+    }
+    return NULL;
+}
+
+// Threads interning at once, while the table grows under them, agree on one
+// pointer per string and lose no inserts
+void str_intern_threads_test()
+{
+    size_t len = intern_count();
+    InternJob jobs[INTERN_THREADS];
+    pthread_t threads[INTERN_THREADS];
+    for (int t = 0; t < INTERN_THREADS; t++) {
+        jobs[t] = (InternJob){ t, xmalloc(INTERN_SHARED * sizeof(const char *)) };
+        assert(pthread_create(&threads[t], NULL, intern_worker, &jobs[t]) == 0);
+    }
+    for (int t = 0; t < INTERN_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    char name[32];
+    for (int i = 0; i < INTERN_SHARED; i++) {
+        snprintf(name, sizeof(name), "shared%d", i);
+        const char *str = str_intern(name);
+        assert(strcmp(str, name) == 0);
+        for (int t = 0; t < INTERN_THREADS; t++) {
+            assert(jobs[t].shared[i] == str);
+        }
+    }
+    assert(intern_count() == len + INTERN_SHARED + INTERN_THREADS * INTERN_OWN);
+    for (int t = 0; t < INTERN_THREADS; t++) {
+        free(jobs[t].shared);
+    }
+}
+
+enum { INTERN_NAME_SIZE = 32 };
+
+typedef struct InternBenchJob {
+    char (*names)[INTERN_NAME_SIZE];
+    int num_names; // a power of two
+    int num_ops;
+    bool locked;
+} InternBenchJob;
+
+static pthread_mutex_t intern_bench_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *intern_bench_worker(void *arg)
+{
+    InternBenchJob *job = arg;
+    static volatile uintptr_t sink;
+    for (int i = 0; i < job->num_ops; i++) {
+        // An odd stride visits every name once per num_names ops
+        const char *name = job->names[(size_t)i * 7919 & (job->num_names - 1)];
+        if (job->locked) {
+            pthread_mutex_lock(&intern_bench_lock);
+        }
+        sink += (uintptr_t)str_intern(name);
+        if (job->locked) {
+            pthread_mutex_unlock(&intern_bench_lock);
+        }
+    }
+    return NULL;
+}
+
+// Millions of interns per second over all the threads
+f64 time_intern_threads(InternBenchJob *jobs, int num_threads)
+{
+    pthread_t *threads = xmalloc(num_threads * sizeof(pthread_t));
+    f64 start = now_seconds();
+    for (int t = 0; t < num_threads; t++) {
+        assert(pthread_create(&threads[t], NULL, intern_bench_worker, &jobs[t]) == 0);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    f64 elapsed = now_seconds() - start;
+    free(threads);
+    return (f64)num_threads * jobs[0].num_ops / elapsed / 1e6;
+}
+
+// Interning throughput from one thread up to one per CPU (at least 4): lookups
+// of names every thread shares, the same lookups serialized by a mutex as a
+// locked table would, and inserts of names each thread has to itself
+void intern_bench()
+{
+    enum { NUM_SHARED = 64 * 1024, NUM_HITS = 2 * 1024 * 1024, NUM_INSERTS = 256 * 1024 };
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = MAX(num_cpus, 4);
+    char(*shared)[INTERN_NAME_SIZE] = xmalloc(NUM_SHARED * INTERN_NAME_SIZE);
+    for (int i = 0; i < NUM_SHARED; i++) {
+        snprintf(shared[i], INTERN_NAME_SIZE, "shared%d", i);
+        str_intern(shared[i]);
+    }
+    char(*own)[INTERN_NAME_SIZE] =
+        xmalloc((size_t)max_threads * NUM_INSERTS * INTERN_NAME_SIZE);
+    InternBenchJob *jobs = xmalloc(max_threads * sizeof(InternBenchJob));
+    printf("intern (%ld CPUs):\n", num_cpus);
+    for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        for (int t = 0; t < num_threads; t++) {
+            jobs[t] = (InternBenchJob){ shared, NUM_SHARED, NUM_HITS, false };
+        }
+        f64 hits = time_intern_threads(jobs, num_threads);
+        for (int t = 0; t < num_threads; t++) {
+            jobs[t].locked = true;
+        }
+        f64 locked_hits = time_intern_threads(jobs, num_threads);
+        for (int t = 0; t < num_threads; t++) {
+            char(*names)[INTERN_NAME_SIZE] = own + (size_t)t * NUM_INSERTS;
+            for (int i = 0; i < NUM_INSERTS; i++) {
+                snprintf(names[i], INTERN_NAME_SIZE, "n%d_%d_%d", num_threads, t, i);
+            }
+            jobs[t] = (InternBenchJob){ names, NUM_INSERTS, NUM_INSERTS, false };
+        }
+        f64 inserts = time_intern_threads(jobs, num_threads);
+        printf(
+            "  %2d threads: %6.1f Mhits/s (%.1f with a mutex), %6.1f Minserts/s\n",
+            num_threads, hits, locked_hits, inserts);
+    }
+    free(shared);
+    free(own);
+    free(jobs);
 }
 
 typedef enum {
+    TOKEN_EOF,
     // Reserve first 128 values for one-char tokens
     TOKEN_LAST_CHAR = 127,
     TOKEN_INT,
@@ -191,8 +841,9 @@ typedef enum {
 
 const char *token_kind_names[] = {
     // clang-format off
-    [TOKEN_INT]  = "TOKEN_INT",
-    [TOKEN_NAME] = "TOKEN_NAME",
+    [TOKEN_INT]   = "TOKEN_INT",
+    [TOKEN_FLOAT] = "TOKEN_FLOAT",
+    [TOKEN_NAME]  = "TOKEN_NAME",
     // clang-format on
 };
 
@@ -210,15 +861,155 @@ typedef struct {
 
 const char *token_kind_name(TokenKind kind)
 {
+    if (kind == TOKEN_EOF) {
+        return "EOF";
+    }
     if (kind > TOKEN_LAST_CHAR) {
         return token_kind_names[kind];
     }
     return "ASCII";
 }
 
-Token token;
-const char *stream;
+// The type of a value. Either way a value is one 64-bit word, the int64_t
+// itself or the bits of the f64, so every backend keeps one word per stack
+// slot or register. The compiler knows the type of every value it emits
+// (inputs are ints and literals say what they are), so the words carry no tag.
+typedef enum Type {
+    TYPE_INT,
+    TYPE_FLOAT,
+} Type;
+
+static inline f64 f64_from_word(int64_t word)
+{
+    f64 val;
+    memcpy(&val, &word, sizeof(val));
+    return val;
+}
+
+static inline int64_t word_from_f64(f64 val)
+{
+    int64_t word;
+    memcpy(&word, &val, sizeof(word));
+    return word;
+}
+
+// The value of the word as a float, converting it if it's an int
+static inline f64 word_to_f64(int64_t word, bool is_int)
+{
+    return is_int ? (f64)word : f64_from_word(word);
+}
+
+typedef enum Backend {
+    BACKEND_STACK,
+    BACKEND_REGISTER,
+    BACKEND_C,
+} Backend;
+
+// Everything one compilation reads and writes: the lexer's position, the
+// parser's token source and the code being emitted. Contexts share nothing
+// but the intern table, so independent sources can be compiled concurrently,
+// one context per thread.
+typedef struct Context {
+    Token token;
+    const char *stream;
+    const char *stream_end;
+    // When set, the parser reads tokens from here instead of calling next_token
+    struct TokenStream *tokens;
+    size_t token_index;
+
+    // Which instruction set the parser emits
+    Backend backend;
+    // Whether emit_op folds ops whose arguments are all constant into a literal
+    bool fold_constants;
+    // Whether programs built by compile and write_image share repeated
+    // subexpressions, so they're computed once each time they're evaluated.
+    // Code that runs once, as it's parsed, isn't worth a lookup for each op.
+    bool cse_enabled;
+    // Whether the expression being parsed is for such a program; reset_code
+    // clears it
+    bool cse_active;
+    // Whether stack code uses the ops the parser's types select, rather than the
+    // generic ones that test their operands' types each time they run
+    bool typed_ops;
+    // Whether finish_code runs peephole_code over stack code
+    bool peephole_enabled;
+    // Whether exec_code runs stack code through the JIT
+    bool jit_enabled;
+
+    // Stack code, and the arena that holds it and the emitter's other buffers
+    // until reset_code
+    byte *code;
+    arena_t code_arena;
+    // The emitter's virtual operand stack
+    struct EmitSlot *emit_stack;
+    // The trees of the expressions parsed since reset_code, and the parser's
+    // pending operators, which it keeps off the C stack. They're on the heap
+    // rather than in code_arena, so they keep their capacity across resets.
+    struct Node *nodes;
+    struct ParseFrame *parse_stack;
+    // Open-addressed table of the nodes of the expression being parsed, for
+    // finding repeats. Entries from earlier expressions have an older gen and
+    // count as empty, so it's never cleared.
+    struct NodeEntry *node_table;
+    uint32_t node_table_cap;
+    uint32_t node_table_len;
+    uint32_t node_gen;
+    // Whether the expression being parsed is a plain tree in post order, with
+    // nothing shared and no conversion added after its operand's sibling, so
+    // lower_tree can emit its nodes in order
+    bool tree_in_order;
+    // lower_tree's DFS stack, and the virtual stack slot of each hoisted node
+    uint32_t *lower_stack;
+    int32_t *lower_slots;
+    // Names of the inputs referenced since reset_code, interned and indexed by
+    // slot
+    const char **input_names;
+    // Type of the value of the expression finish_code ended
+    Type result_type;
+
+    // Register code and constants. Temporaries are allocated like a stack: the
+    // value at virtual stack depth i lives in register i, so constants stay
+    // unmaterialized until used.
+    byte *reg_code;
+    int64_t *reg_consts;
+    int reg_num_regs;
+
+    // C code. Each expression becomes a function ion_expr_<n> in c_unit, with
+    // a single-assignment temporary for every op that isn't folded.
+    char *c_unit;
+    int c_num_fns;
+    Type *c_fn_types; // result type of each function
+    uint32_t c_num_temps;
+} Context;
+
+void reset_code(Context *ctx);
+
+Context *context_new()
+{
+    Context *ctx = xcalloc(1, sizeof(Context));
+    ctx->backend = BACKEND_STACK;
+    ctx->fold_constants = true;
+    ctx->cse_enabled = true;
+    ctx->typed_ops = true;
+    ctx->peephole_enabled = true;
+    reset_code(ctx);
+    return ctx;
+}
+
+void context_free(Context *ctx)
+{
+    arena_free(&ctx->code_arena);
+    buf_free(ctx->nodes);
+    buf_free(ctx->parse_stack);
+    free(ctx->node_table);
+    buf_free(ctx->lower_stack);
+    buf_free(ctx->lower_slots);
+    buf_free(ctx->c_unit);
+    buf_free(ctx->c_fn_types);
+    free(ctx);
+}
 
+// Interned once by init_lexer and only read after that, so they're shared
 const char *keyword_if;
 const char *keyword_for;
 const char *keyword_while;
@@ -231,194 +1022,1040 @@ void init_keywords()
     // ...
 }
 
-// clang format off
-u64 char_to_digit[256] = {
-    ['0'] = 0,  ['1'] = 1,  ['2'] = 2,  ['3'] = 3,  ['4'] = 4,  ['5'] = 5,
-    ['6'] = 6,  ['7'] = 7,  ['8'] = 8,  ['9'] = 9,  ['a'] = 10, ['b'] = 11,
-    ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15, ['A'] = 10, ['B'] = 11,
-    ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+// Character classes for the lexer. Unlike <ctype.h> these are locale-free and
+// cost a single load per byte.
+enum {
+    CHAR_SPACE = 1 << 0,
+    CHAR_DIGIT = 1 << 1,
+    CHAR_HEX = 1 << 2,
+    CHAR_IDENT_START = 1 << 3,
+    CHAR_IDENT = 1 << 4,
 };
-// clang format on
 
-char escape_to_char[256] = {
-    ['0'] = 0,
-    ['\''] = '\'',
-    ['"'] = '\"',
-    ['?'] = '\?',
-    ['\\'] = '\\',
-    ['a'] = '\a',
-    ['b'] = '\b',
-    ['f'] = '\f',
-    ['n'] = '\n',
-    ['r'] = '\r',
-    ['t'] = '\t',
-    ['v'] = '\v',
+// clang-format off
+#define N_ 0
+#define S_ CHAR_SPACE
+#define D_ (CHAR_DIGIT | CHAR_HEX | CHAR_IDENT)
+#define H_ (CHAR_HEX | CHAR_IDENT_START | CHAR_IDENT)
+#define L_ (CHAR_IDENT_START | CHAR_IDENT)
+const byte char_class[256] = {
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, S_, S_, S_, S_, S_, N_, N_, // 00
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, // 10
+    S_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, // 20
+    D_, D_, D_, D_, D_, D_, D_, D_, D_, D_, N_, N_, N_, N_, N_, N_, // 30
+    N_, H_, H_, H_, H_, H_, H_, L_, L_, L_, L_, L_, L_, L_, L_, L_, // 40
+    L_, L_, L_, L_, L_, L_, L_, L_, L_, L_, L_, N_, N_, N_, N_, L_, // 50
+    N_, H_, H_, H_, H_, H_, H_, L_, L_, L_, L_, L_, L_, L_, L_, L_, // 60
+    L_, L_, L_, L_, L_, L_, L_, L_, L_, L_, L_, N_, N_, N_, N_, N_, // 70
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, // 80
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, // 90
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, // A0
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, // B0
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, // C0
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, // D0
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, // E0
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, // F0
 };
+#undef N_
+#undef S_
+#undef D_
+#undef H_
+#undef L_
 
-void scan_char()
-{
-    assert(*stream == '\'');
-    stream++;
+enum { DIGIT_NONE = 0xFF };
 
-    char val = 0;
-    if (*stream == '\'') {
-        syntax_error("Char literal cannot be empty");
-        stream++;
-    } else if (*stream == '\n') {
-        syntax_error("Char literal cannot contain newline");
-        stream++;
-    } else if (*stream == '\\') {
-        stream++;
-        val = escape_to_char[(byte)*stream];
-        if (val == 0 && *stream != '0') {
-            syntax_error("Invalid char literal escape '\\%c'", *stream);
-        }
-        stream++;
-    } else {
-        val = *stream;
-        stream++;
-    }
-    if (*stream != '\'') {
-        syntax_error("Expected closing char quote, got '%c'", *stream);
-    } else {
-        stream++;
-    }
+#define X_ DIGIT_NONE
+const byte char_to_digit[256] = {
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // 00
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // 10
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // 20
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, X_, X_, X_, X_, X_, X_, // 30
+    X_, 10, 11, 12, 13, 14, 15, X_, X_, X_, X_, X_, X_, X_, X_, X_, // 40
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // 50
+    X_, 10, 11, 12, 13, 14, 15, X_, X_, X_, X_, X_, X_, X_, X_, X_, // 60
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // 70
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // 80
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // 90
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // A0
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // B0
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // C0
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // D0
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // E0
+    X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, X_, // F0
+};
+#undef X_
+// clang-format on
 
-    token.kind = TOKEN_INT;
-    token.mod = TOKENMOD_CHAR;
-    token.int_val = val;
+static inline bool is_char(char c, byte class)
+{
+    return char_class[(byte)c] & class;
 }
 
-void scan_float()
+static inline char to_lower(char c)
 {
-    const char *start = stream;
-    while (isdigit(*stream)) {
-        stream++;
-    }
-    if (*stream == '.') {
-        stream++;
-    }
-    while (isdigit(*stream)) {
-        stream++;
-    }
-    if (tolower(*stream) == 'e') {
-        stream++;
-        if (*stream == '-' || *stream == '+') {
-            stream++;
-        }
-        if (!isdigit(*stream)) {
-            syntax_error("Expected digit after float literal exponent, found '%c'", *stream);
-        }
-        while (isdigit(*stream)) {
-            stream++;
-        }
-    }
-    f64 val = strtod(start, NULL);
-    if (val == HUGE_VAL || val == -HUGE_VAL) {
-        syntax_error("Float literal out of range");
-    }
-    token.kind = TOKEN_FLOAT;
-    token.float_val = val;
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
 }
 
-void scan_int()
+// Run skippers return the first character in [p, end) that is not in the
+// class, or end. The vector kernels only issue aligned loads of blocks that
+// contain at least one byte before end. An aligned load can't cross a page
+// boundary, so they never touch memory past the page holding end[-1], and the
+// input needs neither padding nor a terminator.
+typedef const char *(*skip_fn)(const char *p, const char *end);
+
+const char *skip_space_scalar(const char *p, const char *end)
 {
-    u64 base = 10;
+    while (p < end && is_char(*p, CHAR_SPACE)) {
+        p++;
+    }
+    return p;
+}
+
+const char *skip_ident_scalar(const char *p, const char *end)
+{
+    while (p < end && is_char(*p, CHAR_IDENT)) {
+        p++;
+    }
+    return p;
+}
+
+const char *skip_digits_scalar(const char *p, const char *end)
+{
+    while (p < end && is_char(*p, CHAR_DIGIT)) {
+        p++;
+    }
+    return p;
+}
+
+#if HAS_X86_SIMD
+// Unsigned lo <= x <= hi per byte
+#define SSE2_IN_RANGE(x, lo, hi) \
+    _mm_cmpeq_epi8( \
+        _mm_min_epu8(_mm_sub_epi8((x), _mm_set1_epi8(lo)), _mm_set1_epi8((hi) - (lo))), \
+        _mm_sub_epi8((x), _mm_set1_epi8(lo)))
+#define AVX2_IN_RANGE(x, lo, hi) \
+    _mm256_cmpeq_epi8( \
+        _mm256_min_epu8( \
+            _mm256_sub_epi8((x), _mm256_set1_epi8(lo)), _mm256_set1_epi8((hi) - (lo))), \
+        _mm256_sub_epi8((x), _mm256_set1_epi8(lo)))
+
+static inline __m128i sse2_match(__m128i x, int class)
+{
+    switch (class) {
+        case CHAR_SPACE:
+            return _mm_or_si128(
+                _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), SSE2_IN_RANGE(x, '\t', '\r'));
+        case CHAR_IDENT:
+            // x | 0x20 folds A-Z onto a-z and nothing else onto a-z
+            return _mm_or_si128(
+                _mm_or_si128(
+                    SSE2_IN_RANGE(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z'),
+                    SSE2_IN_RANGE(x, '0', '9')),
+                _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+        default:
+            assert(class == CHAR_DIGIT);
+            return SSE2_IN_RANGE(x, '0', '9');
+    }
+}
+
+static inline const char *sse2_skip(const char *p, const char *end, int class)
+{
+    const char *block = (const char *)ALIGN_DOWN((uintptr_t)p, 16);
+    unsigned ignore = (1u << (p - block)) - 1;
+    for (; block < end; block += 16) {
+        __m128i x = _mm_load_si128((const __m128i *)block);
+        unsigned miss = ~(unsigned)_mm_movemask_epi8(sse2_match(x, class)) & 0xFFFF;
+        miss &= ~ignore;
+        if (miss) {
+            return MIN(block + __builtin_ctz(miss), end);
+        }
+        ignore = 0;
+    }
+    return end;
+}
+
+const char *skip_space_sse2(const char *p, const char *end)
+{
+    return sse2_skip(p, end, CHAR_SPACE);
+}
+
+const char *skip_ident_sse2(const char *p, const char *end)
+{
+    return sse2_skip(p, end, CHAR_IDENT);
+}
+
+const char *skip_digits_sse2(const char *p, const char *end)
+{
+    return sse2_skip(p, end, CHAR_DIGIT);
+}
+
+__attribute__((target("avx2"))) static inline __m256i avx2_match(__m256i x, int class)
+{
+    switch (class) {
+        case CHAR_SPACE:
+            return _mm256_or_si256(
+                _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), AVX2_IN_RANGE(x, '\t', '\r'));
+        case CHAR_IDENT:
+            return _mm256_or_si256(
+                _mm256_or_si256(
+                    AVX2_IN_RANGE(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'z'),
+                    AVX2_IN_RANGE(x, '0', '9')),
+                _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')));
+        default:
+            assert(class == CHAR_DIGIT);
+            return AVX2_IN_RANGE(x, '0', '9');
+    }
+}
+
+__attribute__((target("avx2"))) static inline const char *avx2_skip(
+    const char *p, const char *end, int class)
+{
+    const char *block = (const char *)ALIGN_DOWN((uintptr_t)p, 32);
+    u64 ignore = (1ull << (p - block)) - 1;
+    for (; block < end; block += 32) {
+        __m256i x = _mm256_load_si256((const __m256i *)block);
+        u64 miss = ~(u64)(uint32_t)_mm256_movemask_epi8(avx2_match(x, class)) & 0xFFFFFFFF;
+        miss &= ~ignore;
+        if (miss) {
+            return MIN(block + __builtin_ctzll(miss), end);
+        }
+        ignore = 0;
+    }
+    return end;
+}
+
+__attribute__((target("avx2"))) const char *skip_space_avx2(
+    const char *p, const char *end)
+{
+    return avx2_skip(p, end, CHAR_SPACE);
+}
+
+__attribute__((target("avx2"))) const char *skip_ident_avx2(
+    const char *p, const char *end)
+{
+    return avx2_skip(p, end, CHAR_IDENT);
+}
+
+__attribute__((target("avx2"))) const char *skip_digits_avx2(
+    const char *p, const char *end)
+{
+    return avx2_skip(p, end, CHAR_DIGIT);
+}
+
+#undef SSE2_IN_RANGE
+#undef AVX2_IN_RANGE
+#endif
+
+typedef enum {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+} SimdLevel;
+
+const char *simd_level_names[] = {
+    [SIMD_SCALAR] = "scalar",
+    [SIMD_SSE2] = "sse2",
+    [SIMD_AVX2] = "avx2",
+};
+
+static const struct {
+    skip_fn space;
+    skip_fn ident;
+    skip_fn digits;
+} skip_fns[] = {
+    [SIMD_SCALAR] = { skip_space_scalar, skip_ident_scalar, skip_digits_scalar },
+#if HAS_X86_SIMD
+    [SIMD_SSE2] = { skip_space_sse2, skip_ident_sse2, skip_digits_sse2 },
+    [SIMD_AVX2] = { skip_space_avx2, skip_ident_avx2, skip_digits_avx2 },
+#endif
+};
+
+SimdLevel simd_level;
+skip_fn skip_space = skip_space_scalar;
+skip_fn skip_ident = skip_ident_scalar;
+skip_fn skip_digits = skip_digits_scalar;
+
+SimdLevel simd_max_level()
+{
+#if HAS_X86_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+void set_simd_level(SimdLevel level)
+{
+    assert(level <= simd_max_level());
+    simd_level = level;
+    skip_space = skip_fns[level].space;
+    skip_ident = skip_fns[level].ident;
+    skip_digits = skip_fns[level].digits;
+}
+
+void skip_test()
+{
+    // Each run is placed at every offset within a 64-byte aligned window so the
+    // kernels see every alignment of the run start, its terminator and the end
+    // of the input.
+    static const struct {
+        skip_fn *fn;
+        char fill;
+        char stop;
+    } cases[] = {
+        { &skip_space, '\t', 'x' },
+        { &skip_space, ' ', 0 },
+        { &skip_ident, 'Z', ' ' },
+        { &skip_ident, '_', 0 },
+        { &skip_ident, '9', '\x80' },
+        { &skip_digits, '5', 'a' },
+        { &skip_digits, '0', 0 },
+    };
+    char *buf = aligned_alloc(64, 256);
+    SimdLevel max_level = simd_max_level();
+    for (SimdLevel level = SIMD_SCALAR; level <= max_level; level++) {
+        set_simd_level(level);
+        for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+            skip_fn fn = *cases[i].fn;
+            for (int start = 0; start < 64; start++) {
+                for (int len = 0; len < 100; len++) {
+                    char *end = buf + start + len;
+                    memset(buf, cases[i].fill, 256);
+                    assert(fn(buf + start, end) == end);
+                    *end = cases[i].stop;
+                    assert(fn(buf + start, buf + 256) == end);
+                    assert(fn(buf + start, end + 1) == end);
+                }
+            }
+        }
+        // Every byte value is classified the same as char_class
+        for (int c = 0; c < 256; c++) {
+            memset(buf, c, 64);
+            assert((skip_ident(buf, buf + 64) == buf + 64) == is_char(c, CHAR_IDENT));
+            assert((skip_space(buf, buf + 64) == buf + 64) == is_char(c, CHAR_SPACE));
+            assert((skip_digits(buf, buf + 64) == buf + 64) == is_char(c, CHAR_DIGIT));
+        }
+    }
+    set_simd_level(max_level);
+    free(buf);
+}
+
+char escape_to_char[256] = {
+    ['0'] = 0,
+    ['\''] = '\'',
+    ['"'] = '\"',
+    ['?'] = '\?',
+    ['\\'] = '\\',
+    ['a'] = '\a',
+    ['b'] = '\b',
+    ['f'] = '\f',
+    ['n'] = '\n',
+    ['r'] = '\r',
+    ['t'] = '\t',
+    ['v'] = '\v',
+};
+
+// The character at stream, or 0 at the end of the input
+static inline char cur_char(Context *ctx)
+{
+    return ctx->stream < ctx->stream_end ? *ctx->stream : 0;
+}
+
+void scan_char(Context *ctx)
+{
+    assert(cur_char(ctx) == '\'');
+    ctx->stream++;
+
+    char val = 0;
+    if (ctx->stream == ctx->stream_end) {
+        syntax_error("Unterminated char literal");
+        goto done;
+    } else if (cur_char(ctx) == '\'') {
+        syntax_error("Char literal cannot be empty");
+        ctx->stream++;
+        goto done;
+    } else if (cur_char(ctx) == '\n') {
+        syntax_error("Char literal cannot contain newline");
+        ctx->stream++;
+    } else if (cur_char(ctx) == '\\') {
+        ctx->stream++;
+        if (ctx->stream == ctx->stream_end) {
+            syntax_error("Unterminated char literal");
+            goto done;
+        }
+        val = escape_to_char[(byte)cur_char(ctx)];
+        if (val == 0 && cur_char(ctx) != '0') {
+            syntax_error("Invalid char literal escape '\\%c'", cur_char(ctx));
+        }
+        ctx->stream++;
+    } else {
+        val = cur_char(ctx);
+        ctx->stream++;
+    }
+    if (cur_char(ctx) != '\'') {
+        syntax_error("Expected closing char quote, got '%c'", cur_char(ctx));
+    } else {
+        ctx->stream++;
+    }
+
+done:
+    ctx->token.kind = TOKEN_INT;
+    ctx->token.mod = TOKENMOD_CHAR;
+    ctx->token.int_val = val;
+}
+
+// Decimal to double conversion. Exact cases take Clinger's fast path, the rest
+// go through Eisel-Lemire, which decides almost every input with one or two
+// 64x128-bit multiplications. What it can't decide is left to strtod.
+
+enum {
+    POW5_MIN_EXP = -342,
+    POW5_MAX_EXP = 308,
+};
+
+// 128-bit truncated significands of 5^q for q in [POW5_MIN_EXP, POW5_MAX_EXP]
+// clang-format off
+static const u64 pow5_128[][2] = {
+    { 0xeef453d6923bd65a, 0x113faa2906a13b3f }, { 0x9558b4661b6565f8, 0x4ac7ca59a424c507 },
+    { 0xbaaee17fa23ebf76, 0x5d79bcf00d2df649 }, { 0xe95a99df8ace6f53, 0xf4d82c2c107973dc },
+    { 0x91d8a02bb6c10594, 0x79071b9b8a4be869 }, { 0xb64ec836a47146f9, 0x9748e2826cdee284 },
+    { 0xe3e27a444d8d98b7, 0xfd1b1b2308169b25 }, { 0x8e6d8c6ab0787f72, 0xfe30f0f5e50e20f7 },
+    { 0xb208ef855c969f4f, 0xbdbd2d335e51a935 }, { 0xde8b2b66b3bc4723, 0xad2c788035e61382 },
+    { 0x8b16fb203055ac76, 0x4c3bcb5021afcc31 }, { 0xaddcb9e83c6b1793, 0xdf4abe242a1bbf3d },
+    { 0xd953e8624b85dd78, 0xd71d6dad34a2af0d }, { 0x87d4713d6f33aa6b, 0x8672648c40e5ad68 },
+    { 0xa9c98d8ccb009506, 0x680efdaf511f18c2 }, { 0xd43bf0effdc0ba48, 0x0212bd1b2566def2 },
+    { 0x84a57695fe98746d, 0x014bb630f7604b57 }, { 0xa5ced43b7e3e9188, 0x419ea3bd35385e2d },
+    { 0xcf42894a5dce35ea, 0x52064cac828675b9 }, { 0x818995ce7aa0e1b2, 0x7343efebd1940993 },
+    { 0xa1ebfb4219491a1f, 0x1014ebe6c5f90bf8 }, { 0xca66fa129f9b60a6, 0xd41a26e077774ef6 },
+    { 0xfd00b897478238d0, 0x8920b098955522b4 }, { 0x9e20735e8cb16382, 0x55b46e5f5d5535b0 },
+    { 0xc5a890362fddbc62, 0xeb2189f734aa831d }, { 0xf712b443bbd52b7b, 0xa5e9ec7501d523e4 },
+    { 0x9a6bb0aa55653b2d, 0x47b233c92125366e }, { 0xc1069cd4eabe89f8, 0x999ec0bb696e840a },
+    { 0xf148440a256e2c76, 0xc00670ea43ca250d }, { 0x96cd2a865764dbca, 0x380406926a5e5728 },
+    { 0xbc807527ed3e12bc, 0xc605083704f5ecf2 }, { 0xeba09271e88d976b, 0xf7864a44c633682e },
+    { 0x93445b8731587ea3, 0x7ab3ee6afbe0211d }, { 0xb8157268fdae9e4c, 0x5960ea05bad82964 },
+    { 0xe61acf033d1a45df, 0x6fb92487298e33bd }, { 0x8fd0c16206306bab, 0xa5d3b6d479f8e056 },
+    { 0xb3c4f1ba87bc8696, 0x8f48a4899877186c }, { 0xe0b62e2929aba83c, 0x331acdabfe94de87 },
+    { 0x8c71dcd9ba0b4925, 0x9ff0c08b7f1d0b14 }, { 0xaf8e5410288e1b6f, 0x07ecf0ae5ee44dd9 },
+    { 0xdb71e91432b1a24a, 0xc9e82cd9f69d6150 }, { 0x892731ac9faf056e, 0xbe311c083a225cd2 },
+    { 0xab70fe17c79ac6ca, 0x6dbd630a48aaf406 }, { 0xd64d3d9db981787d, 0x092cbbccdad5b108 },
+    { 0x85f0468293f0eb4e, 0x25bbf56008c58ea5 }, { 0xa76c582338ed2621, 0xaf2af2b80af6f24e },
+    { 0xd1476e2c07286faa, 0x1af5af660db4aee1 }, { 0x82cca4db847945ca, 0x50d98d9fc890ed4d },
+    { 0xa37fce126597973c, 0xe50ff107bab528a0 }, { 0xcc5fc196fefd7d0c, 0x1e53ed49a96272c8 },
+    { 0xff77b1fcbebcdc4f, 0x25e8e89c13bb0f7a }, { 0x9faacf3df73609b1, 0x77b191618c54e9ac },
+    { 0xc795830d75038c1d, 0xd59df5b9ef6a2417 }, { 0xf97ae3d0d2446f25, 0x4b0573286b44ad1d },
+    { 0x9becce62836ac577, 0x4ee367f9430aec32 }, { 0xc2e801fb244576d5, 0x229c41f793cda73f },
+    { 0xf3a20279ed56d48a, 0x6b43527578c1110f }, { 0x9845418c345644d6, 0x830a13896b78aaa9 },
+    { 0xbe5691ef416bd60c, 0x23cc986bc656d553 }, { 0xedec366b11c6cb8f, 0x2cbfbe86b7ec8aa8 },
+    { 0x94b3a202eb1c3f39, 0x7bf7d71432f3d6a9 }, { 0xb9e08a83a5e34f07, 0xdaf5ccd93fb0cc53 },
+    { 0xe858ad248f5c22c9, 0xd1b3400f8f9cff68 }, { 0x91376c36d99995be, 0x23100809b9c21fa1 },
+    { 0xb58547448ffffb2d, 0xabd40a0c2832a78a }, { 0xe2e69915b3fff9f9, 0x16c90c8f323f516c },
+    { 0x8dd01fad907ffc3b, 0xae3da7d97f6792e3 }, { 0xb1442798f49ffb4a, 0x99cd11cfdf41779c },
+    { 0xdd95317f31c7fa1d, 0x40405643d711d583 }, { 0x8a7d3eef7f1cfc52, 0x482835ea666b2572 },
+    { 0xad1c8eab5ee43b66, 0xda3243650005eecf }, { 0xd863b256369d4a40, 0x90bed43e40076a82 },
+    { 0x873e4f75e2224e68, 0x5a7744a6e804a291 }, { 0xa90de3535aaae202, 0x711515d0a205cb36 },
+    { 0xd3515c2831559a83, 0x0d5a5b44ca873e03 }, { 0x8412d9991ed58091, 0xe858790afe9486c2 },
+    { 0xa5178fff668ae0b6, 0x626e974dbe39a872 }, { 0xce5d73ff402d98e3, 0xfb0a3d212dc8128f },
+    { 0x80fa687f881c7f8e, 0x7ce66634bc9d0b99 }, { 0xa139029f6a239f72, 0x1c1fffc1ebc44e80 },
+    { 0xc987434744ac874e, 0xa327ffb266b56220 }, { 0xfbe9141915d7a922, 0x4bf1ff9f0062baa8 },
+    { 0x9d71ac8fada6c9b5, 0x6f773fc3603db4a9 }, { 0xc4ce17b399107c22, 0xcb550fb4384d21d3 },
+    { 0xf6019da07f549b2b, 0x7e2a53a146606a48 }, { 0x99c102844f94e0fb, 0x2eda7444cbfc426d },
+    { 0xc0314325637a1939, 0xfa911155fefb5308 }, { 0xf03d93eebc589f88, 0x793555ab7eba27ca },
+    { 0x96267c7535b763b5, 0x4bc1558b2f3458de }, { 0xbbb01b9283253ca2, 0x9eb1aaedfb016f16 },
+    { 0xea9c227723ee8bcb, 0x465e15a979c1cadc }, { 0x92a1958a7675175f, 0x0bfacd89ec191ec9 },
+    { 0xb749faed14125d36, 0xcef980ec671f667b }, { 0xe51c79a85916f484, 0x82b7e12780e7401a },
+    { 0x8f31cc0937ae58d2, 0xd1b2ecb8b0908810 }, { 0xb2fe3f0b8599ef07, 0x861fa7e6dcb4aa15 },
+    { 0xdfbdcece67006ac9, 0x67a791e093e1d49a }, { 0x8bd6a141006042bd, 0xe0c8bb2c5c6d24e0 },
+    { 0xaecc49914078536d, 0x58fae9f773886e18 }, { 0xda7f5bf590966848, 0xaf39a475506a899e },
+    { 0x888f99797a5e012d, 0x6d8406c952429603 }, { 0xaab37fd7d8f58178, 0xc8e5087ba6d33b83 },
+    { 0xd5605fcdcf32e1d6, 0xfb1e4a9a90880a64 }, { 0x855c3be0a17fcd26, 0x5cf2eea09a55067f },
+    { 0xa6b34ad8c9dfc06f, 0xf42faa48c0ea481e }, { 0xd0601d8efc57b08b, 0xf13b94daf124da26 },
+    { 0x823c12795db6ce57, 0x76c53d08d6b70858 }, { 0xa2cb1717b52481ed, 0x54768c4b0c64ca6e },
+    { 0xcb7ddcdda26da268, 0xa9942f5dcf7dfd09 }, { 0xfe5d54150b090b02, 0xd3f93b35435d7c4c },
+    { 0x9efa548d26e5a6e1, 0xc47bc5014a1a6daf }, { 0xc6b8e9b0709f109a, 0x359ab6419ca1091b },
+    { 0xf867241c8cc6d4c0, 0xc30163d203c94b62 }, { 0x9b407691d7fc44f8, 0x79e0de63425dcf1d },
+    { 0xc21094364dfb5636, 0x985915fc12f542e4 }, { 0xf294b943e17a2bc4, 0x3e6f5b7b17b2939d },
+    { 0x979cf3ca6cec5b5a, 0xa705992ceecf9c42 }, { 0xbd8430bd08277231, 0x50c6ff782a838353 },
+    { 0xece53cec4a314ebd, 0xa4f8bf5635246428 }, { 0x940f4613ae5ed136, 0x871b7795e136be99 },
+    { 0xb913179899f68584, 0x28e2557b59846e3f }, { 0xe757dd7ec07426e5, 0x331aeada2fe589cf },
+    { 0x9096ea6f3848984f, 0x3ff0d2c85def7621 }, { 0xb4bca50b065abe63, 0x0fed077a756b53a9 },
+    { 0xe1ebce4dc7f16dfb, 0xd3e8495912c62894 }, { 0x8d3360f09cf6e4bd, 0x64712dd7abbbd95c },
+    { 0xb080392cc4349dec, 0xbd8d794d96aacfb3 }, { 0xdca04777f541c567, 0xecf0d7a0fc5583a0 },
+    { 0x89e42caaf9491b60, 0xf41686c49db57244 }, { 0xac5d37d5b79b6239, 0x311c2875c522ced5 },
+    { 0xd77485cb25823ac7, 0x7d633293366b828b }, { 0x86a8d39ef77164bc, 0xae5dff9c02033197 },
+    { 0xa8530886b54dbdeb, 0xd9f57f830283fdfc }, { 0xd267caa862a12d66, 0xd072df63c324fd7b },
+    { 0x8380dea93da4bc60, 0x4247cb9e59f71e6d }, { 0xa46116538d0deb78, 0x52d9be85f074e608 },
+    { 0xcd795be870516656, 0x67902e276c921f8b }, { 0x806bd9714632dff6, 0x00ba1cd8a3db53b6 },
+    { 0xa086cfcd97bf97f3, 0x80e8a40eccd228a4 }, { 0xc8a883c0fdaf7df0, 0x6122cd128006b2cd },
+    { 0xfad2a4b13d1b5d6c, 0x796b805720085f81 }, { 0x9cc3a6eec6311a63, 0xcbe3303674053bb0 },
+    { 0xc3f490aa77bd60fc, 0xbedbfc4411068a9c }, { 0xf4f1b4d515acb93b, 0xee92fb5515482d44 },
+    { 0x991711052d8bf3c5, 0x751bdd152d4d1c4a }, { 0xbf5cd54678eef0b6, 0xd262d45a78a0635d },
+    { 0xef340a98172aace4, 0x86fb897116c87c34 }, { 0x9580869f0e7aac0e, 0xd45d35e6ae3d4da0 },
+    { 0xbae0a846d2195712, 0x8974836059cca109 }, { 0xe998d258869facd7, 0x2bd1a438703fc94b },
+    { 0x91ff83775423cc06, 0x7b6306a34627ddcf }, { 0xb67f6455292cbf08, 0x1a3bc84c17b1d542 },
+    { 0xe41f3d6a7377eeca, 0x20caba5f1d9e4a93 }, { 0x8e938662882af53e, 0x547eb47b7282ee9c },
+    { 0xb23867fb2a35b28d, 0xe99e619a4f23aa43 }, { 0xdec681f9f4c31f31, 0x6405fa00e2ec94d4 },
+    { 0x8b3c113c38f9f37e, 0xde83bc408dd3dd04 }, { 0xae0b158b4738705e, 0x9624ab50b148d445 },
+    { 0xd98ddaee19068c76, 0x3badd624dd9b0957 }, { 0x87f8a8d4cfa417c9, 0xe54ca5d70a80e5d6 },
+    { 0xa9f6d30a038d1dbc, 0x5e9fcf4ccd211f4c }, { 0xd47487cc8470652b, 0x7647c3200069671f },
+    { 0x84c8d4dfd2c63f3b, 0x29ecd9f40041e073 }, { 0xa5fb0a17c777cf09, 0xf468107100525890 },
+    { 0xcf79cc9db955c2cc, 0x7182148d4066eeb4 }, { 0x81ac1fe293d599bf, 0xc6f14cd848405530 },
+    { 0xa21727db38cb002f, 0xb8ada00e5a506a7c }, { 0xca9cf1d206fdc03b, 0xa6d90811f0e4851c },
+    { 0xfd442e4688bd304a, 0x908f4a166d1da663 }, { 0x9e4a9cec15763e2e, 0x9a598e4e043287fe },
+    { 0xc5dd44271ad3cdba, 0x40eff1e1853f29fd }, { 0xf7549530e188c128, 0xd12bee59e68ef47c },
+    { 0x9a94dd3e8cf578b9, 0x82bb74f8301958ce }, { 0xc13a148e3032d6e7, 0xe36a52363c1faf01 },
+    { 0xf18899b1bc3f8ca1, 0xdc44e6c3cb279ac1 }, { 0x96f5600f15a7b7e5, 0x29ab103a5ef8c0b9 },
+    { 0xbcb2b812db11a5de, 0x7415d448f6b6f0e7 }, { 0xebdf661791d60f56, 0x111b495b3464ad21 },
+    { 0x936b9fcebb25c995, 0xcab10dd900beec34 }, { 0xb84687c269ef3bfb, 0x3d5d514f40eea742 },
+    { 0xe65829b3046b0afa, 0x0cb4a5a3112a5112 }, { 0x8ff71a0fe2c2e6dc, 0x47f0e785eaba72ab },
+    { 0xb3f4e093db73a093, 0x59ed216765690f56 }, { 0xe0f218b8d25088b8, 0x306869c13ec3532c },
+    { 0x8c974f7383725573, 0x1e414218c73a13fb }, { 0xafbd2350644eeacf, 0xe5d1929ef90898fa },
+    { 0xdbac6c247d62a583, 0xdf45f746b74abf39 }, { 0x894bc396ce5da772, 0x6b8bba8c328eb783 },
+    { 0xab9eb47c81f5114f, 0x066ea92f3f326564 }, { 0xd686619ba27255a2, 0xc80a537b0efefebd },
+    { 0x8613fd0145877585, 0xbd06742ce95f5f36 }, { 0xa798fc4196e952e7, 0x2c48113823b73704 },
+    { 0xd17f3b51fca3a7a0, 0xf75a15862ca504c5 }, { 0x82ef85133de648c4, 0x9a984d73dbe722fb },
+    { 0xa3ab66580d5fdaf5, 0xc13e60d0d2e0ebba }, { 0xcc963fee10b7d1b3, 0x318df905079926a8 },
+    { 0xffbbcfe994e5c61f, 0xfdf17746497f7052 }, { 0x9fd561f1fd0f9bd3, 0xfeb6ea8bedefa633 },
+    { 0xc7caba6e7c5382c8, 0xfe64a52ee96b8fc0 }, { 0xf9bd690a1b68637b, 0x3dfdce7aa3c673b0 },
+    { 0x9c1661a651213e2d, 0x06bea10ca65c084e }, { 0xc31bfa0fe5698db8, 0x486e494fcff30a62 },
+    { 0xf3e2f893dec3f126, 0x5a89dba3c3efccfa }, { 0x986ddb5c6b3a76b7, 0xf89629465a75e01c },
+    { 0xbe89523386091465, 0xf6bbb397f1135823 }, { 0xee2ba6c0678b597f, 0x746aa07ded582e2c },
+    { 0x94db483840b717ef, 0xa8c2a44eb4571cdc }, { 0xba121a4650e4ddeb, 0x92f34d62616ce413 },
+    { 0xe896a0d7e51e1566, 0x77b020baf9c81d17 }, { 0x915e2486ef32cd60, 0x0ace1474dc1d122e },
+    { 0xb5b5ada8aaff80b8, 0x0d819992132456ba }, { 0xe3231912d5bf60e6, 0x10e1fff697ed6c69 },
+    { 0x8df5efabc5979c8f, 0xca8d3ffa1ef463c1 }, { 0xb1736b96b6fd83b3, 0xbd308ff8a6b17cb2 },
+    { 0xddd0467c64bce4a0, 0xac7cb3f6d05ddbde }, { 0x8aa22c0dbef60ee4, 0x6bcdf07a423aa96b },
+    { 0xad4ab7112eb3929d, 0x86c16c98d2c953c6 }, { 0xd89d64d57a607744, 0xe871c7bf077ba8b7 },
+    { 0x87625f056c7c4a8b, 0x11471cd764ad4972 }, { 0xa93af6c6c79b5d2d, 0xd598e40d3dd89bcf },
+    { 0xd389b47879823479, 0x4aff1d108d4ec2c3 }, { 0x843610cb4bf160cb, 0xcedf722a585139ba },
+    { 0xa54394fe1eedb8fe, 0xc2974eb4ee658828 }, { 0xce947a3da6a9273e, 0x733d226229feea32 },
+    { 0x811ccc668829b887, 0x0806357d5a3f525f }, { 0xa163ff802a3426a8, 0xca07c2dcb0cf26f7 },
+    { 0xc9bcff6034c13052, 0xfc89b393dd02f0b5 }, { 0xfc2c3f3841f17c67, 0xbbac2078d443ace2 },
+    { 0x9d9ba7832936edc0, 0xd54b944b84aa4c0d }, { 0xc5029163f384a931, 0x0a9e795e65d4df11 },
+    { 0xf64335bcf065d37d, 0x4d4617b5ff4a16d5 }, { 0x99ea0196163fa42e, 0x504bced1bf8e4e45 },
+    { 0xc06481fb9bcf8d39, 0xe45ec2862f71e1d6 }, { 0xf07da27a82c37088, 0x5d767327bb4e5a4c },
+    { 0x964e858c91ba2655, 0x3a6a07f8d510f86f }, { 0xbbe226efb628afea, 0x890489f70a55368b },
+    { 0xeadab0aba3b2dbe5, 0x2b45ac74ccea842e }, { 0x92c8ae6b464fc96f, 0x3b0b8bc90012929d },
+    { 0xb77ada0617e3bbcb, 0x09ce6ebb40173744 }, { 0xe55990879ddcaabd, 0xcc420a6a101d0515 },
+    { 0x8f57fa54c2a9eab6, 0x9fa946824a12232d }, { 0xb32df8e9f3546564, 0x47939822dc96abf9 },
+    { 0xdff9772470297ebd, 0x59787e2b93bc56f7 }, { 0x8bfbea76c619ef36, 0x57eb4edb3c55b65a },
+    { 0xaefae51477a06b03, 0xede622920b6b23f1 }, { 0xdab99e59958885c4, 0xe95fab368e45eced },
+    { 0x88b402f7fd75539b, 0x11dbcb0218ebb414 }, { 0xaae103b5fcd2a881, 0xd652bdc29f26a119 },
+    { 0xd59944a37c0752a2, 0x4be76d3346f0495f }, { 0x857fcae62d8493a5, 0x6f70a4400c562ddb },
+    { 0xa6dfbd9fb8e5b88e, 0xcb4ccd500f6bb952 }, { 0xd097ad07a71f26b2, 0x7e2000a41346a7a7 },
+    { 0x825ecc24c873782f, 0x8ed400668c0c28c8 }, { 0xa2f67f2dfa90563b, 0x728900802f0f32fa },
+    { 0xcbb41ef979346bca, 0x4f2b40a03ad2ffb9 }, { 0xfea126b7d78186bc, 0xe2f610c84987bfa8 },
+    { 0x9f24b832e6b0f436, 0x0dd9ca7d2df4d7c9 }, { 0xc6ede63fa05d3143, 0x91503d1c79720dbb },
+    { 0xf8a95fcf88747d94, 0x75a44c6397ce912a }, { 0x9b69dbe1b548ce7c, 0xc986afbe3ee11aba },
+    { 0xc24452da229b021b, 0xfbe85badce996168 }, { 0xf2d56790ab41c2a2, 0xfae27299423fb9c3 },
+    { 0x97c560ba6b0919a5, 0xdccd879fc967d41a }, { 0xbdb6b8e905cb600f, 0x5400e987bbc1c920 },
+    { 0xed246723473e3813, 0x290123e9aab23b68 }, { 0x9436c0760c86e30b, 0xf9a0b6720aaf6521 },
+    { 0xb94470938fa89bce, 0xf808e40e8d5b3e69 }, { 0xe7958cb87392c2c2, 0xb60b1d1230b20e04 },
+    { 0x90bd77f3483bb9b9, 0xb1c6f22b5e6f48c2 }, { 0xb4ecd5f01a4aa828, 0x1e38aeb6360b1af3 },
+    { 0xe2280b6c20dd5232, 0x25c6da63c38de1b0 }, { 0x8d590723948a535f, 0x579c487e5a38ad0e },
+    { 0xb0af48ec79ace837, 0x2d835a9df0c6d851 }, { 0xdcdb1b2798182244, 0xf8e431456cf88e65 },
+    { 0x8a08f0f8bf0f156b, 0x1b8e9ecb641b58ff }, { 0xac8b2d36eed2dac5, 0xe272467e3d222f3f },
+    { 0xd7adf884aa879177, 0x5b0ed81dcc6abb0f }, { 0x86ccbb52ea94baea, 0x98e947129fc2b4e9 },
+    { 0xa87fea27a539e9a5, 0x3f2398d747b36224 }, { 0xd29fe4b18e88640e, 0x8eec7f0d19a03aad },
+    { 0x83a3eeeef9153e89, 0x1953cf68300424ac }, { 0xa48ceaaab75a8e2b, 0x5fa8c3423c052dd7 },
+    { 0xcdb02555653131b6, 0x3792f412cb06794d }, { 0x808e17555f3ebf11, 0xe2bbd88bbee40bd0 },
+    { 0xa0b19d2ab70e6ed6, 0x5b6aceaeae9d0ec4 }, { 0xc8de047564d20a8b, 0xf245825a5a445275 },
+    { 0xfb158592be068d2e, 0xeed6e2f0f0d56712 }, { 0x9ced737bb6c4183d, 0x55464dd69685606b },
+    { 0xc428d05aa4751e4c, 0xaa97e14c3c26b886 }, { 0xf53304714d9265df, 0xd53dd99f4b3066a8 },
+    { 0x993fe2c6d07b7fab, 0xe546a8038efe4029 }, { 0xbf8fdb78849a5f96, 0xde98520472bdd033 },
+    { 0xef73d256a5c0f77c, 0x963e66858f6d4440 }, { 0x95a8637627989aad, 0xdde7001379a44aa8 },
+    { 0xbb127c53b17ec159, 0x5560c018580d5d52 }, { 0xe9d71b689dde71af, 0xaab8f01e6e10b4a6 },
+    { 0x9226712162ab070d, 0xcab3961304ca70e8 }, { 0xb6b00d69bb55c8d1, 0x3d607b97c5fd0d22 },
+    { 0xe45c10c42a2b3b05, 0x8cb89a7db77c506a }, { 0x8eb98a7a9a5b04e3, 0x77f3608e92adb242 },
+    { 0xb267ed1940f1c61c, 0x55f038b237591ed3 }, { 0xdf01e85f912e37a3, 0x6b6c46dec52f6688 },
+    { 0x8b61313bbabce2c6, 0x2323ac4b3b3da015 }, { 0xae397d8aa96c1b77, 0xabec975e0a0d081a },
+    { 0xd9c7dced53c72255, 0x96e7bd358c904a21 }, { 0x881cea14545c7575, 0x7e50d64177da2e54 },
+    { 0xaa242499697392d2, 0xdde50bd1d5d0b9e9 }, { 0xd4ad2dbfc3d07787, 0x955e4ec64b44e864 },
+    { 0x84ec3c97da624ab4, 0xbd5af13bef0b113e }, { 0xa6274bbdd0fadd61, 0xecb1ad8aeacdd58e },
+    { 0xcfb11ead453994ba, 0x67de18eda5814af2 }, { 0x81ceb32c4b43fcf4, 0x80eacf948770ced7 },
+    { 0xa2425ff75e14fc31, 0xa1258379a94d028d }, { 0xcad2f7f5359a3b3e, 0x096ee45813a04330 },
+    { 0xfd87b5f28300ca0d, 0x8bca9d6e188853fc }, { 0x9e74d1b791e07e48, 0x775ea264cf55347e },
+    { 0xc612062576589dda, 0x95364afe032a819e }, { 0xf79687aed3eec551, 0x3a83ddbd83f52205 },
+    { 0x9abe14cd44753b52, 0xc4926a9672793543 }, { 0xc16d9a0095928a27, 0x75b7053c0f178294 },
+    { 0xf1c90080baf72cb1, 0x5324c68b12dd6339 }, { 0x971da05074da7bee, 0xd3f6fc16ebca5e04 },
+    { 0xbce5086492111aea, 0x88f4bb1ca6bcf585 }, { 0xec1e4a7db69561a5, 0x2b31e9e3d06c32e6 },
+    { 0x9392ee8e921d5d07, 0x3aff322e62439fd0 }, { 0xb877aa3236a4b449, 0x09befeb9fad487c3 },
+    { 0xe69594bec44de15b, 0x4c2ebe687989a9b4 }, { 0x901d7cf73ab0acd9, 0x0f9d37014bf60a11 },
+    { 0xb424dc35095cd80f, 0x538484c19ef38c95 }, { 0xe12e13424bb40e13, 0x2865a5f206b06fba },
+    { 0x8cbccc096f5088cb, 0xf93f87b7442e45d4 }, { 0xafebff0bcb24aafe, 0xf78f69a51539d749 },
+    { 0xdbe6fecebdedd5be, 0xb573440e5a884d1c }, { 0x89705f4136b4a597, 0x31680a88f8953031 },
+    { 0xabcc77118461cefc, 0xfdc20d2b36ba7c3e }, { 0xd6bf94d5e57a42bc, 0x3d32907604691b4d },
+    { 0x8637bd05af6c69b5, 0xa63f9a49c2c1b110 }, { 0xa7c5ac471b478423, 0x0fcf80dc33721d54 },
+    { 0xd1b71758e219652b, 0xd3c36113404ea4a9 }, { 0x83126e978d4fdf3b, 0x645a1cac083126ea },
+    { 0xa3d70a3d70a3d70a, 0x3d70a3d70a3d70a4 }, { 0xcccccccccccccccc, 0xcccccccccccccccd },
+    { 0x8000000000000000, 0x0000000000000000 }, { 0xa000000000000000, 0x0000000000000000 },
+    { 0xc800000000000000, 0x0000000000000000 }, { 0xfa00000000000000, 0x0000000000000000 },
+    { 0x9c40000000000000, 0x0000000000000000 }, { 0xc350000000000000, 0x0000000000000000 },
+    { 0xf424000000000000, 0x0000000000000000 }, { 0x9896800000000000, 0x0000000000000000 },
+    { 0xbebc200000000000, 0x0000000000000000 }, { 0xee6b280000000000, 0x0000000000000000 },
+    { 0x9502f90000000000, 0x0000000000000000 }, { 0xba43b74000000000, 0x0000000000000000 },
+    { 0xe8d4a51000000000, 0x0000000000000000 }, { 0x9184e72a00000000, 0x0000000000000000 },
+    { 0xb5e620f480000000, 0x0000000000000000 }, { 0xe35fa931a0000000, 0x0000000000000000 },
+    { 0x8e1bc9bf04000000, 0x0000000000000000 }, { 0xb1a2bc2ec5000000, 0x0000000000000000 },
+    { 0xde0b6b3a76400000, 0x0000000000000000 }, { 0x8ac7230489e80000, 0x0000000000000000 },
+    { 0xad78ebc5ac620000, 0x0000000000000000 }, { 0xd8d726b7177a8000, 0x0000000000000000 },
+    { 0x878678326eac9000, 0x0000000000000000 }, { 0xa968163f0a57b400, 0x0000000000000000 },
+    { 0xd3c21bcecceda100, 0x0000000000000000 }, { 0x84595161401484a0, 0x0000000000000000 },
+    { 0xa56fa5b99019a5c8, 0x0000000000000000 }, { 0xcecb8f27f4200f3a, 0x0000000000000000 },
+    { 0x813f3978f8940984, 0x4000000000000000 }, { 0xa18f07d736b90be5, 0x5000000000000000 },
+    { 0xc9f2c9cd04674ede, 0xa400000000000000 }, { 0xfc6f7c4045812296, 0x4d00000000000000 },
+    { 0x9dc5ada82b70b59d, 0xf020000000000000 }, { 0xc5371912364ce305, 0x6c28000000000000 },
+    { 0xf684df56c3e01bc6, 0xc732000000000000 }, { 0x9a130b963a6c115c, 0x3c7f400000000000 },
+    { 0xc097ce7bc90715b3, 0x4b9f100000000000 }, { 0xf0bdc21abb48db20, 0x1e86d40000000000 },
+    { 0x96769950b50d88f4, 0x1314448000000000 }, { 0xbc143fa4e250eb31, 0x17d955a000000000 },
+    { 0xeb194f8e1ae525fd, 0x5dcfab0800000000 }, { 0x92efd1b8d0cf37be, 0x5aa1cae500000000 },
+    { 0xb7abc627050305ad, 0xf14a3d9e40000000 }, { 0xe596b7b0c643c719, 0x6d9ccd05d0000000 },
+    { 0x8f7e32ce7bea5c6f, 0xe4820023a2000000 }, { 0xb35dbf821ae4f38b, 0xdda2802c8a800000 },
+    { 0xe0352f62a19e306e, 0xd50b2037ad200000 }, { 0x8c213d9da502de45, 0x4526f422cc340000 },
+    { 0xaf298d050e4395d6, 0x9670b12b7f410000 }, { 0xdaf3f04651d47b4c, 0x3c0cdd765f114000 },
+    { 0x88d8762bf324cd0f, 0xa5880a69fb6ac800 }, { 0xab0e93b6efee0053, 0x8eea0d047a457a00 },
+    { 0xd5d238a4abe98068, 0x72a4904598d6d880 }, { 0x85a36366eb71f041, 0x47a6da2b7f864750 },
+    { 0xa70c3c40a64e6c51, 0x999090b65f67d924 }, { 0xd0cf4b50cfe20765, 0xfff4b4e3f741cf6d },
+    { 0x82818f1281ed449f, 0xbff8f10e7a8921a4 }, { 0xa321f2d7226895c7, 0xaff72d52192b6a0d },
+    { 0xcbea6f8ceb02bb39, 0x9bf4f8a69f764490 }, { 0xfee50b7025c36a08, 0x02f236d04753d5b4 },
+    { 0x9f4f2726179a2245, 0x01d762422c946590 }, { 0xc722f0ef9d80aad6, 0x424d3ad2b7b97ef5 },
+    { 0xf8ebad2b84e0d58b, 0xd2e0898765a7deb2 }, { 0x9b934c3b330c8577, 0x63cc55f49f88eb2f },
+    { 0xc2781f49ffcfa6d5, 0x3cbf6b71c76b25fb }, { 0xf316271c7fc3908a, 0x8bef464e3945ef7a },
+    { 0x97edd871cfda3a56, 0x97758bf0e3cbb5ac }, { 0xbde94e8e43d0c8ec, 0x3d52eeed1cbea317 },
+    { 0xed63a231d4c4fb27, 0x4ca7aaa863ee4bdd }, { 0x945e455f24fb1cf8, 0x8fe8caa93e74ef6a },
+    { 0xb975d6b6ee39e436, 0xb3e2fd538e122b44 }, { 0xe7d34c64a9c85d44, 0x60dbbca87196b616 },
+    { 0x90e40fbeea1d3a4a, 0xbc8955e946fe31cd }, { 0xb51d13aea4a488dd, 0x6babab6398bdbe41 },
+    { 0xe264589a4dcdab14, 0xc696963c7eed2dd1 }, { 0x8d7eb76070a08aec, 0xfc1e1de5cf543ca2 },
+    { 0xb0de65388cc8ada8, 0x3b25a55f43294bcb }, { 0xdd15fe86affad912, 0x49ef0eb713f39ebe },
+    { 0x8a2dbf142dfcc7ab, 0x6e3569326c784337 }, { 0xacb92ed9397bf996, 0x49c2c37f07965404 },
+    { 0xd7e77a8f87daf7fb, 0xdc33745ec97be906 }, { 0x86f0ac99b4e8dafd, 0x69a028bb3ded71a3 },
+    { 0xa8acd7c0222311bc, 0xc40832ea0d68ce0c }, { 0xd2d80db02aabd62b, 0xf50a3fa490c30190 },
+    { 0x83c7088e1aab65db, 0x792667c6da79e0fa }, { 0xa4b8cab1a1563f52, 0x577001b891185938 },
+    { 0xcde6fd5e09abcf26, 0xed4c0226b55e6f86 }, { 0x80b05e5ac60b6178, 0x544f8158315b05b4 },
+    { 0xa0dc75f1778e39d6, 0x696361ae3db1c721 }, { 0xc913936dd571c84c, 0x03bc3a19cd1e38e9 },
+    { 0xfb5878494ace3a5f, 0x04ab48a04065c723 }, { 0x9d174b2dcec0e47b, 0x62eb0d64283f9c76 },
+    { 0xc45d1df942711d9a, 0x3ba5d0bd324f8394 }, { 0xf5746577930d6500, 0xca8f44ec7ee36479 },
+    { 0x9968bf6abbe85f20, 0x7e998b13cf4e1ecb }, { 0xbfc2ef456ae276e8, 0x9e3fedd8c321a67e },
+    { 0xefb3ab16c59b14a2, 0xc5cfe94ef3ea101e }, { 0x95d04aee3b80ece5, 0xbba1f1d158724a12 },
+    { 0xbb445da9ca61281f, 0x2a8a6e45ae8edc97 }, { 0xea1575143cf97226, 0xf52d09d71a3293bd },
+    { 0x924d692ca61be758, 0x593c2626705f9c56 }, { 0xb6e0c377cfa2e12e, 0x6f8b2fb00c77836c },
+    { 0xe498f455c38b997a, 0x0b6dfb9c0f956447 }, { 0x8edf98b59a373fec, 0x4724bd4189bd5eac },
+    { 0xb2977ee300c50fe7, 0x58edec91ec2cb657 }, { 0xdf3d5e9bc0f653e1, 0x2f2967b66737e3ed },
+    { 0x8b865b215899f46c, 0xbd79e0d20082ee74 }, { 0xae67f1e9aec07187, 0xecd8590680a3aa11 },
+    { 0xda01ee641a708de9, 0xe80e6f4820cc9495 }, { 0x884134fe908658b2, 0x3109058d147fdcdd },
+    { 0xaa51823e34a7eede, 0xbd4b46f0599fd415 }, { 0xd4e5e2cdc1d1ea96, 0x6c9e18ac7007c91a },
+    { 0x850fadc09923329e, 0x03e2cf6bc604ddb0 }, { 0xa6539930bf6bff45, 0x84db8346b786151c },
+    { 0xcfe87f7cef46ff16, 0xe612641865679a63 }, { 0x81f14fae158c5f6e, 0x4fcb7e8f3f60c07e },
+    { 0xa26da3999aef7749, 0xe3be5e330f38f09d }, { 0xcb090c8001ab551c, 0x5cadf5bfd3072cc5 },
+    { 0xfdcb4fa002162a63, 0x73d9732fc7c8f7f6 }, { 0x9e9f11c4014dda7e, 0x2867e7fddcdd9afa },
+    { 0xc646d63501a1511d, 0xb281e1fd541501b8 }, { 0xf7d88bc24209a565, 0x1f225a7ca91a4226 },
+    { 0x9ae757596946075f, 0x3375788de9b06958 }, { 0xc1a12d2fc3978937, 0x0052d6b1641c83ae },
+    { 0xf209787bb47d6b84, 0xc0678c5dbd23a49a }, { 0x9745eb4d50ce6332, 0xf840b7ba963646e0 },
+    { 0xbd176620a501fbff, 0xb650e5a93bc3d898 }, { 0xec5d3fa8ce427aff, 0xa3e51f138ab4cebe },
+    { 0x93ba47c980e98cdf, 0xc66f336c36b10137 }, { 0xb8a8d9bbe123f017, 0xb80b0047445d4184 },
+    { 0xe6d3102ad96cec1d, 0xa60dc059157491e5 }, { 0x9043ea1ac7e41392, 0x87c89837ad68db2f },
+    { 0xb454e4a179dd1877, 0x29babe4598c311fb }, { 0xe16a1dc9d8545e94, 0xf4296dd6fef3d67a },
+    { 0x8ce2529e2734bb1d, 0x1899e4a65f58660c }, { 0xb01ae745b101e9e4, 0x5ec05dcff72e7f8f },
+    { 0xdc21a1171d42645d, 0x76707543f4fa1f73 }, { 0x899504ae72497eba, 0x6a06494a791c53a8 },
+    { 0xabfa45da0edbde69, 0x0487db9d17636892 }, { 0xd6f8d7509292d603, 0x45a9d2845d3c42b6 },
+    { 0x865b86925b9bc5c2, 0x0b8a2392ba45a9b2 }, { 0xa7f26836f282b732, 0x8e6cac7768d7141e },
+    { 0xd1ef0244af2364ff, 0x3207d795430cd926 }, { 0x8335616aed761f1f, 0x7f44e6bd49e807b8 },
+    { 0xa402b9c5a8d3a6e7, 0x5f16206c9c6209a6 }, { 0xcd036837130890a1, 0x36dba887c37a8c0f },
+    { 0x802221226be55a64, 0xc2494954da2c9789 }, { 0xa02aa96b06deb0fd, 0xf2db9baa10b7bd6c },
+    { 0xc83553c5c8965d3d, 0x6f92829494e5acc7 }, { 0xfa42a8b73abbf48c, 0xcb772339ba1f17f9 },
+    { 0x9c69a97284b578d7, 0xff2a760414536efb }, { 0xc38413cf25e2d70d, 0xfef5138519684aba },
+    { 0xf46518c2ef5b8cd1, 0x7eb258665fc25d69 }, { 0x98bf2f79d5993802, 0xef2f773ffbd97a61 },
+    { 0xbeeefb584aff8603, 0xaafb550ffacfd8fa }, { 0xeeaaba2e5dbf6784, 0x95ba2a53f983cf38 },
+    { 0x952ab45cfa97a0b2, 0xdd945a747bf26183 }, { 0xba756174393d88df, 0x94f971119aeef9e4 },
+    { 0xe912b9d1478ceb17, 0x7a37cd5601aab85d }, { 0x91abb422ccb812ee, 0xac62e055c10ab33a },
+    { 0xb616a12b7fe617aa, 0x577b986b314d6009 }, { 0xe39c49765fdf9d94, 0xed5a7e85fda0b80b },
+    { 0x8e41ade9fbebc27d, 0x14588f13be847307 }, { 0xb1d219647ae6b31c, 0x596eb2d8ae258fc8 },
+    { 0xde469fbd99a05fe3, 0x6fca5f8ed9aef3bb }, { 0x8aec23d680043bee, 0x25de7bb9480d5854 },
+    { 0xada72ccc20054ae9, 0xaf561aa79a10ae6a }, { 0xd910f7ff28069da4, 0x1b2ba1518094da04 },
+    { 0x87aa9aff79042286, 0x90fb44d2f05d0842 }, { 0xa99541bf57452b28, 0x353a1607ac744a53 },
+    { 0xd3fa922f2d1675f2, 0x42889b8997915ce8 }, { 0x847c9b5d7c2e09b7, 0x69956135febada11 },
+    { 0xa59bc234db398c25, 0x43fab9837e699095 }, { 0xcf02b2c21207ef2e, 0x94f967e45e03f4bb },
+    { 0x8161afb94b44f57d, 0x1d1be0eebac278f5 }, { 0xa1ba1ba79e1632dc, 0x6462d92a69731732 },
+    { 0xca28a291859bbf93, 0x7d7b8f7503cfdcfe }, { 0xfcb2cb35e702af78, 0x5cda735244c3d43e },
+    { 0x9defbf01b061adab, 0x3a0888136afa64a7 }, { 0xc56baec21c7a1916, 0x088aaa1845b8fdd0 },
+    { 0xf6c69a72a3989f5b, 0x8aad549e57273d45 }, { 0x9a3c2087a63f6399, 0x36ac54e2f678864b },
+    { 0xc0cb28a98fcf3c7f, 0x84576a1bb416a7dd }, { 0xf0fdf2d3f3c30b9f, 0x656d44a2a11c51d5 },
+    { 0x969eb7c47859e743, 0x9f644ae5a4b1b325 }, { 0xbc4665b596706114, 0x873d5d9f0dde1fee },
+    { 0xeb57ff22fc0c7959, 0xa90cb506d155a7ea }, { 0x9316ff75dd87cbd8, 0x09a7f12442d588f2 },
+    { 0xb7dcbf5354e9bece, 0x0c11ed6d538aeb2f }, { 0xe5d3ef282a242e81, 0x8f1668c8a86da5fa },
+    { 0x8fa475791a569d10, 0xf96e017d694487bc }, { 0xb38d92d760ec4455, 0x37c981dcc395a9ac },
+    { 0xe070f78d3927556a, 0x85bbe253f47b1417 }, { 0x8c469ab843b89562, 0x93956d7478ccec8e },
+    { 0xaf58416654a6babb, 0x387ac8d1970027b2 }, { 0xdb2e51bfe9d0696a, 0x06997b05fcc0319e },
+    { 0x88fcf317f22241e2, 0x441fece3bdf81f03 }, { 0xab3c2fddeeaad25a, 0xd527e81cad7626c3 },
+    { 0xd60b3bd56a5586f1, 0x8a71e223d8d3b074 }, { 0x85c7056562757456, 0xf6872d5667844e49 },
+    { 0xa738c6bebb12d16c, 0xb428f8ac016561db }, { 0xd106f86e69d785c7, 0xe13336d701beba52 },
+    { 0x82a45b450226b39c, 0xecc0024661173473 }, { 0xa34d721642b06084, 0x27f002d7f95d0190 },
+    { 0xcc20ce9bd35c78a5, 0x31ec038df7b441f4 }, { 0xff290242c83396ce, 0x7e67047175a15271 },
+    { 0x9f79a169bd203e41, 0x0f0062c6e984d386 }, { 0xc75809c42c684dd1, 0x52c07b78a3e60868 },
+    { 0xf92e0c3537826145, 0xa7709a56ccdf8a82 }, { 0x9bbcc7a142b17ccb, 0x88a66076400bb691 },
+    { 0xc2abf989935ddbfe, 0x6acff893d00ea435 }, { 0xf356f7ebf83552fe, 0x0583f6b8c4124d43 },
+    { 0x98165af37b2153de, 0xc3727a337a8b704a }, { 0xbe1bf1b059e9a8d6, 0x744f18c0592e4c5c },
+    { 0xeda2ee1c7064130c, 0x1162def06f79df73 }, { 0x9485d4d1c63e8be7, 0x8addcb5645ac2ba8 },
+    { 0xb9a74a0637ce2ee1, 0x6d953e2bd7173692 }, { 0xe8111c87c5c1ba99, 0xc8fa8db6ccdd0437 },
+    { 0x910ab1d4db9914a0, 0x1d9c9892400a22a2 }, { 0xb54d5e4a127f59c8, 0x2503beb6d00cab4b },
+    { 0xe2a0b5dc971f303a, 0x2e44ae64840fd61d }, { 0x8da471a9de737e24, 0x5ceaecfed289e5d2 },
+    { 0xb10d8e1456105dad, 0x7425a83e872c5f47 }, { 0xdd50f1996b947518, 0xd12f124e28f77719 },
+    { 0x8a5296ffe33cc92f, 0x82bd6b70d99aaa6f }, { 0xace73cbfdc0bfb7b, 0x636cc64d1001550b },
+    { 0xd8210befd30efa5a, 0x3c47f7e05401aa4e }, { 0x8714a775e3e95c78, 0x65acfaec34810a71 },
+    { 0xa8d9d1535ce3b396, 0x7f1839a741a14d0d }, { 0xd31045a8341ca07c, 0x1ede48111209a050 },
+    { 0x83ea2b892091e44d, 0x934aed0aab460432 }, { 0xa4e4b66b68b65d60, 0xf81da84d5617853f },
+    { 0xce1de40642e3f4b9, 0x36251260ab9d668e }, { 0x80d2ae83e9ce78f3, 0xc1d72b7c6b426019 },
+    { 0xa1075a24e4421730, 0xb24cf65b8612f81f }, { 0xc94930ae1d529cfc, 0xdee033f26797b627 },
+    { 0xfb9b7cd9a4a7443c, 0x169840ef017da3b1 }, { 0x9d412e0806e88aa5, 0x8e1f289560ee864e },
+    { 0xc491798a08a2ad4e, 0xf1a6f2bab92a27e2 }, { 0xf5b5d7ec8acb58a2, 0xae10af696774b1db },
+    { 0x9991a6f3d6bf1765, 0xacca6da1e0a8ef29 }, { 0xbff610b0cc6edd3f, 0x17fd090a58d32af3 },
+    { 0xeff394dcff8a948e, 0xddfc4b4cef07f5b0 }, { 0x95f83d0a1fb69cd9, 0x4abdaf101564f98e },
+    { 0xbb764c4ca7a4440f, 0x9d6d1ad41abe37f1 }, { 0xea53df5fd18d5513, 0x84c86189216dc5ed },
+    { 0x92746b9be2f8552c, 0x32fd3cf5b4e49bb4 }, { 0xb7118682dbb66a77, 0x3fbc8c33221dc2a1 },
+    { 0xe4d5e82392a40515, 0x0fabaf3feaa5334a }, { 0x8f05b1163ba6832d, 0x29cb4d87f2a7400e },
+    { 0xb2c71d5bca9023f8, 0x743e20e9ef511012 }, { 0xdf78e4b2bd342cf6, 0x914da9246b255416 },
+    { 0x8bab8eefb6409c1a, 0x1ad089b6c2f7548e }, { 0xae9672aba3d0c320, 0xa184ac2473b529b1 },
+    { 0xda3c0f568cc4f3e8, 0xc9e5d72d90a2741e }, { 0x8865899617fb1871, 0x7e2fa67c7a658892 },
+    { 0xaa7eebfb9df9de8d, 0xddbb901b98feeab7 }, { 0xd51ea6fa85785631, 0x552a74227f3ea565 },
+    { 0x8533285c936b35de, 0xd53a88958f87275f }, { 0xa67ff273b8460356, 0x8a892abaf368f137 },
+    { 0xd01fef10a657842c, 0x2d2b7569b0432d85 }, { 0x8213f56a67f6b29b, 0x9c3b29620e29fc73 },
+    { 0xa298f2c501f45f42, 0x8349f3ba91b47b8f }, { 0xcb3f2f7642717713, 0x241c70a936219a73 },
+    { 0xfe0efb53d30dd4d7, 0xed238cd383aa0110 }, { 0x9ec95d1463e8a506, 0xf4363804324a40aa },
+    { 0xc67bb4597ce2ce48, 0xb143c6053edcd0d5 }, { 0xf81aa16fdc1b81da, 0xdd94b7868e94050a },
+    { 0x9b10a4e5e9913128, 0xca7cf2b4191c8326 }, { 0xc1d4ce1f63f57d72, 0xfd1c2f611f63a3f0 },
+    { 0xf24a01a73cf2dccf, 0xbc633b39673c8cec }, { 0x976e41088617ca01, 0xd5be0503e085d813 },
+    { 0xbd49d14aa79dbc82, 0x4b2d8644d8a74e18 }, { 0xec9c459d51852ba2, 0xddf8e7d60ed1219e },
+    { 0x93e1ab8252f33b45, 0xcabb90e5c942b503 }, { 0xb8da1662e7b00a17, 0x3d6a751f3b936243 },
+    { 0xe7109bfba19c0c9d, 0x0cc512670a783ad4 }, { 0x906a617d450187e2, 0x27fb2b80668b24c5 },
+    { 0xb484f9dc9641e9da, 0xb1f9f660802dedf6 }, { 0xe1a63853bbd26451, 0x5e7873f8a0396973 },
+    { 0x8d07e33455637eb2, 0xdb0b487b6423e1e8 }, { 0xb049dc016abc5e5f, 0x91ce1a9a3d2cda62 },
+    { 0xdc5c5301c56b75f7, 0x7641a140cc7810fb }, { 0x89b9b3e11b6329ba, 0xa9e904c87fcb0a9d },
+    { 0xac2820d9623bf429, 0x546345fa9fbdcd44 }, { 0xd732290fbacaf133, 0xa97c177947ad4095 },
+    { 0x867f59a9d4bed6c0, 0x49ed8eabcccc485d }, { 0xa81f301449ee8c70, 0x5c68f256bfff5a74 },
+    { 0xd226fc195c6a2f8c, 0x73832eec6fff3111 }, { 0x83585d8fd9c25db7, 0xc831fd53c5ff7eab },
+    { 0xa42e74f3d032f525, 0xba3e7ca8b77f5e55 }, { 0xcd3a1230c43fb26f, 0x28ce1bd2e55f35eb },
+    { 0x80444b5e7aa7cf85, 0x7980d163cf5b81b3 }, { 0xa0555e361951c366, 0xd7e105bcc332621f },
+    { 0xc86ab5c39fa63440, 0x8dd9472bf3fefaa7 }, { 0xfa856334878fc150, 0xb14f98f6f0feb951 },
+    { 0x9c935e00d4b9d8d2, 0x6ed1bf9a569f33d3 }, { 0xc3b8358109e84f07, 0x0a862f80ec4700c8 },
+    { 0xf4a642e14c6262c8, 0xcd27bb612758c0fa }, { 0x98e7e9cccfbd7dbd, 0x8038d51cb897789c },
+    { 0xbf21e44003acdd2c, 0xe0470a63e6bd56c3 }, { 0xeeea5d5004981478, 0x1858ccfce06cac74 },
+    { 0x95527a5202df0ccb, 0x0f37801e0c43ebc8 }, { 0xbaa718e68396cffd, 0xd30560258f54e6ba },
+    { 0xe950df20247c83fd, 0x47c6b82ef32a2069 }, { 0x91d28b7416cdd27e, 0x4cdc331d57fa5441 },
+    { 0xb6472e511c81471d, 0xe0133fe4adf8e952 }, { 0xe3d8f9e563a198e5, 0x58180fddd97723a6 },
+    { 0x8e679c2f5e44ff8f, 0x570f09eaa7ea7648 },
+};
+// clang-format on
+
+static const f64 exact_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+typedef struct {
+    u64 lo;
+    u64 hi;
+} u128_t;
+
+static inline u128_t mul_64x64(u64 a, u64 b)
+{
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 u128;
+    u128 p = (u128)a * b;
+    return (u128_t){ (u64)p, (u64)(p >> 64) };
+#else
+    u64 a_lo = (uint32_t)a, a_hi = a >> 32;
+    u64 b_lo = (uint32_t)b, b_hi = b >> 32;
+    u64 lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+    u64 cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+    u64 hi = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    return (u128_t){ (cross << 32) | (uint32_t)lo_lo, hi };
+#endif
+}
+
+// Computes w * 10^q rounded to nearest-even. Returns false if the result is
+// too close to a rounding boundary to decide with 128 bits of 5^q.
+bool eisel_lemire(u64 w, int64_t q, f64 *out)
+{
+    enum {
+        MANTISSA_BITS = 52,
+        MIN_EXPONENT = -1023,
+        INFINITE_POWER = 0x7FF,
+    };
+    u64 bits;
+    if (w == 0 || q < POW5_MIN_EXP) {
+        bits = 0;
+        goto done;
+    }
+    if (q > POW5_MAX_EXP) {
+        bits = (u64)INFINITE_POWER << MANTISSA_BITS;
+        goto done;
+    }
+
+    int lz = __builtin_clzll(w);
+    w <<= lz;
+    const u64 *pow5 = pow5_128[q - POW5_MIN_EXP];
+    u128_t product = mul_64x64(w, pow5[0]);
+    const u64 precision_mask = UINT64_MAX >> (MANTISSA_BITS + 3);
+    if ((product.hi & precision_mask) == precision_mask) {
+        // The low bits are all ones, so the truncated tail of 5^q may carry
+        u128_t second = mul_64x64(w, pow5[1]);
+        product.lo += second.hi;
+        if (second.hi > product.lo) {
+            product.hi++;
+        }
+        if (product.lo == UINT64_MAX && (q < -27 || q > 55)) {
+            return false;
+        }
+    }
+
+    int upperbit = product.hi >> 63;
+    int shift = upperbit + 64 - MANTISSA_BITS - 3;
+    u64 mantissa = product.hi >> shift;
+    // floor(log2(10^q)) + 63, valid for |q| <= 2620
+    int64_t power2 = (((152170 + 65536) * q) >> 16) + 63 + upperbit - lz - MIN_EXPONENT;
+
+    if (power2 <= 0) {
+        // Subnormal
+        if (-power2 + 1 >= 64) {
+            bits = 0;
+            goto done;
+        }
+        mantissa >>= -power2 + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        power2 = mantissa < (1ull << MANTISSA_BITS) ? 0 : 1;
+        bits = (mantissa & ((1ull << MANTISSA_BITS) - 1)) | ((u64)power2 << MANTISSA_BITS);
+        goto done;
+    }
+
+    // Exactly halfway between two doubles: round to even instead of up. Only
+    // small exponents can produce an exact product.
+    if (product.lo <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 &&
+        (mantissa << shift) == product.hi) {
+        mantissa &= ~1ull;
+    }
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (2ull << MANTISSA_BITS)) {
+        mantissa = 1ull << MANTISSA_BITS;
+        power2++;
+    }
+    mantissa &= ~(1ull << MANTISSA_BITS);
+    if (power2 >= INFINITE_POWER) {
+        power2 = INFINITE_POWER;
+        mantissa = 0;
+    }
+    bits = mantissa | ((u64)power2 << MANTISSA_BITS);
+
+done:
+    memcpy(out, &bits, sizeof(bits));
+    return true;
+}
+
+// Converts w * 10^q to the nearest double. If truncated is set, w holds only
+// the leading digits and the true mantissa lies in (w, w + 1). Returns false
+// if the caller needs to fall back to a slow exact conversion.
+bool decimal_to_f64(u64 w, int64_t q, bool truncated, f64 *out)
+{
+    if (!truncated && w <= (1ull << 53) && q >= -22 && q <= 22) {
+        // Both w and 10^|q| are exact doubles, so one IEEE operation rounds
+        // correctly.
+        f64 val = (f64)w;
+        *out = q < 0 ? val / exact_pow10[-q] : val * exact_pow10[q];
+        return true;
+    }
+    if (!eisel_lemire(w, q, out)) {
+        return false;
+    }
+    if (truncated) {
+        f64 upper;
+        if (!eisel_lemire(w + 1, q, &upper) || upper != *out) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Slow path for literals decimal_to_f64 can't decide
+f64 strtod_range(const char *start, const char *end)
+{
+    // strtod needs a terminator and no digit separators
+    char buf[64];
+    size_t len = end - start;
+    char *str = len < sizeof(buf) ? buf : xmalloc(len + 1);
+    char *ptr = str;
+    for (const char *it = start; it != end; it++) {
+        if (*it != '_') {
+            *ptr++ = *it;
+        }
+    }
+    *ptr = 0;
+    f64 val = strtod(str, NULL);
+    if (str != buf) {
+        free(str);
+    }
+    return val;
+}
+
+void scan_float(Context *ctx)
+{
+    const char *start = ctx->stream;
+    // The first 19 significant digits fit in a u64; later ones only move the
+    // decimal exponent and are remembered as truncated.
+    u64 mantissa = 0;
+    int64_t exp10 = 0;
+    int digits = 0;
+    bool truncated = false;
+    bool fraction = false;
+    for (;;) {
+        char c = cur_char(ctx);
+        byte digit = char_to_digit[(byte)c];
+        if (digit < 10) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + digit;
+                digits += mantissa != 0;
+                exp10 -= fraction;
+            } else {
+                truncated |= digit != 0;
+                exp10 += !fraction;
+            }
+            ctx->stream++;
+        } else if (c == '_') {
+            ctx->stream++;
+        } else if (c == '.' && !fraction) {
+            fraction = true;
+            ctx->stream++;
+        } else {
+            break;
+        }
+    }
+    if (to_lower(cur_char(ctx)) == 'e') {
+        ctx->stream++;
+        bool negative = cur_char(ctx) == '-';
+        if (cur_char(ctx) == '-' || cur_char(ctx) == '+') {
+            ctx->stream++;
+        }
+        if (!is_char(cur_char(ctx), CHAR_DIGIT)) {
+            syntax_error(
+                "Expected digit after float literal exponent, found '%c'", cur_char(ctx));
+        }
+        int64_t exp = 0;
+        while (is_char(cur_char(ctx), CHAR_DIGIT) || cur_char(ctx) == '_') {
+            if (cur_char(ctx) != '_' && exp < 100000) {
+                exp = exp * 10 + char_to_digit[(byte)cur_char(ctx)];
+            }
+            ctx->stream++;
+        }
+        exp10 += negative ? -exp : exp;
+    }
+    f64 val;
+    if (!decimal_to_f64(mantissa, exp10, truncated, &val)) {
+        val = strtod_range(start, ctx->stream);
+    }
+    if (val == HUGE_VAL) {
+        syntax_error("Float literal out of range");
+    }
+    ctx->token.kind = TOKEN_FLOAT;
+    ctx->token.float_val = val;
+}
+
+void scan_int(Context *ctx)
+{
+    u64 base = 10;
     // TokenMod mod;
-    if (*stream == '0') {
-        stream++;
-        if (tolower(*stream) == 'x') {
+    if (cur_char(ctx) == '0') {
+        ctx->stream++;
+        if (to_lower(cur_char(ctx)) == 'x') {
             // Hexadecimal
             base = 16;
-            stream++;
-        } else if (isdigit(*stream)) {
+            ctx->stream++;
+        } else if (is_char(cur_char(ctx), CHAR_DIGIT)) {
             // Octal
             // TODO ensure trailing digits are 0, 1, 2, 3, 4, 5, 6, 7
             base = 8;
-        } else if (tolower(*stream) == 'b') {
+        } else if (to_lower(cur_char(ctx)) == 'b') {
             // Binary
             // TODO ensure trailing digits are 0, 1
             base = 2;
-            stream++;
-        } else {
-            syntax_error("Invalid integer literal prefix '%.*s'", 2, stream - 1);
-            stream++;
+            ctx->stream++;
+        } else if (is_char(cur_char(ctx), CHAR_IDENT)) {
+            syntax_error("Invalid integer literal prefix '0%c'", cur_char(ctx));
+            ctx->stream++;
         }
     }
 
     u64 val = 0;
     for (;;) {
-        u64 digit = char_to_digit[(byte)*stream];
-        if (digit == 0 && *stream != '0') {
-            if (*stream == '_') {
-                stream++;
+        u64 digit = char_to_digit[(byte)cur_char(ctx)];
+        if (digit == DIGIT_NONE) {
+            if (cur_char(ctx) == '_') {
+                ctx->stream++;
                 continue;
             }
             break;
         }
         if (digit >= base) {
-            syntax_error("Digit '%c' out of range for base %llu", *stream, base);
+            syntax_error(
+                "Digit '%c' out of range for base %llu", cur_char(ctx),
+                (unsigned long long)base);
         }
         if (val > (UINT64_MAX - digit) / base) {
             syntax_error("Integer literal overflow");
-            while (isdigit(*stream)) {
-                stream++;
-            }
+            ctx->stream = skip_digits(ctx->stream, ctx->stream_end);
             val = 0;
             break;
         }
         val = val * base + digit;
-        stream++;
+        ctx->stream++;
     }
-    token.kind = TOKEN_INT;
-    token.int_val = val;
+    ctx->token.kind = TOKEN_INT;
+    ctx->token.int_val = val;
 }
 
-void scan_str()
+void scan_str(Context *ctx)
 {
     assert(0);
-    token.kind = TOKEN_NAME;
+    ctx->token.kind = TOKEN_NAME;
     // token.mod = TOKENMOD_NONE;
 }
 
-void next_token()
+void next_token(Context *ctx)
 {
 repeat:
-    token.start = stream;
-    token.mod = 0;
-    switch (*stream) {
+    ctx->token.start = ctx->stream;
+    ctx->token.mod = 0;
+    switch (cur_char(ctx)) {
         // clang-format off
         case ' ': case '\t': case '\r': case '\n': case '\v': case '\f': { // clang-format on
-            while (isspace(*stream)) {
-                stream++;
-            }
+            ctx->stream = skip_space(ctx->stream, ctx->stream_end);
             goto repeat;
             break;
         }
         case '\'': {
-            scan_char();
+            scan_char(ctx);
             break;
         }
         case '"': {
-            scan_str();
+            scan_str(ctx);
             break;
         }
         case '.': {
-            scan_float();
+            scan_float(ctx);
             break;
         }
         // clang-format off
         case '0': case '1': case '2': case '3': case '4': case '5': case '6':
         case '7': case '8': case '9': { // clang-format on
-            while (isdigit(*stream)) {
-                stream++;
+            ctx->stream = skip_digits(ctx->stream, ctx->stream_end);
+            while (cur_char(ctx) == '_') {
+                ctx->stream = skip_digits(ctx->stream + 1, ctx->stream_end);
             }
-            if (*stream == '.' || tolower(*stream) == 'e') {
-                stream = token.start;
-                scan_float();
+            if (cur_char(ctx) == '.' || to_lower(cur_char(ctx)) == 'e') {
+                ctx->stream = ctx->token.start;
+                scan_float(ctx);
             } else {
-                stream = token.start;
-                scan_int();
+                ctx->stream = ctx->token.start;
+                scan_int(ctx);
             }
             break;
         }
@@ -432,25 +2069,44 @@ repeat:
         case 'O': case 'P': case 'Q': case 'R': case 'S': case 'T': case 'U':
         case 'V': case 'W': case 'X': case 'Y': case 'Z':
         case '_': { // clang-format on
-            while (isalnum(*stream) || *stream == '_') {
-                stream++;
-            }
-            token.kind = TOKEN_NAME;
-            token.name = str_intern_range(token.start, stream);
+            ctx->stream = skip_ident(ctx->stream, ctx->stream_end);
+            ctx->token.kind = TOKEN_NAME;
+            ctx->token.name = str_intern_range(ctx->token.start, ctx->stream);
             break;
         }
         default: {
-            token.kind = *stream++;
+            if (ctx->stream == ctx->stream_end) {
+                ctx->token.kind = TOKEN_EOF;
+                break;
+            }
+            if (*ctx->stream == 0) {
+                syntax_error("Unexpected NUL character");
+                ctx->stream++;
+                goto repeat;
+            }
+            ctx->token.kind = *ctx->stream++;
             break;
         }
     }
-    token.end = stream;
+    ctx->token.end = ctx->stream;
+}
+
+void init_lexer()
+{
+    init_keywords();
+    set_simd_level(simd_max_level());
+}
+
+void init_stream_range(Context *ctx, const char *start, const char *end)
+{
+    ctx->stream = start;
+    ctx->stream_end = end;
+    next_token(ctx);
 }
 
-void init_stream(const char *str)
+void init_stream(Context *ctx, const char *str)
 {
-    stream = str;
-    next_token();
+    init_stream_range(ctx, str, str + strlen(str));
 }
 
 void print_token(Token token)
@@ -462,7 +2118,7 @@ void print_token(Token token)
             printf(" %f", token.float_val);
             break;
         case TOKEN_INT:
-            printf(" %llu", token.int_val);
+            printf(" %llu", (unsigned long long)token.int_val);
             break;
         case TOKEN_NAME:
             break;
@@ -475,56 +2131,172 @@ void print_token(Token token)
     printf("\n");
 }
 
+typedef union {
+    u64 int_val;
+    f64 float_val;
+    const char *name;
+} TokenVal;
+
+// The whole input lexed up front, as structure-of-arrays. Offsets are relative
+// to base, so a token takes 17 bytes instead of sizeof(Token), and the parser
+// can look any number of tokens ahead. The last token is always TOKEN_EOF.
+typedef struct TokenStream {
+    const char *base;
+    byte *kinds;
+    uint32_t *starts;
+    uint32_t *ends;
+    TokenVal *vals;
+} TokenStream;
+
+void lex_tokens(Context *ctx, TokenStream *ts, const char *start, const char *end)
+{
+    if ((u64)(end - start) > UINT32_MAX) {
+        fatal("input too large to pre-lex (%llu bytes)", (unsigned long long)(end - start));
+    }
+    *ts = (TokenStream){ .base = start };
+    init_stream_range(ctx, start, end);
+    for (;;) {
+        TokenVal val = { 0 };
+        switch (ctx->token.kind) {
+            case TOKEN_INT:
+                val.int_val = ctx->token.int_val;
+                break;
+            case TOKEN_FLOAT:
+                val.float_val = ctx->token.float_val;
+                break;
+            case TOKEN_NAME:
+                val.name = ctx->token.name;
+                break;
+            default:
+                break;
+        }
+        buf_push(ts->kinds, ctx->token.kind);
+        buf_push(ts->starts, ctx->token.start - start);
+        buf_push(ts->ends, ctx->token.end - start);
+        buf_push(ts->vals, val);
+        if (ctx->token.kind == TOKEN_EOF) {
+            break;
+        }
+        next_token(ctx);
+    }
+}
+
+void free_tokens(TokenStream *ts)
+{
+    buf_free(ts->kinds);
+    buf_free(ts->starts);
+    buf_free(ts->ends);
+    buf_free(ts->vals);
+}
+
+static inline void load_token(Context *ctx, size_t i)
+{
+    ctx->token_index = i;
+    ctx->token.kind = ctx->tokens->kinds[i];
+    ctx->token.mod = 0;
+    ctx->token.start = ctx->tokens->base + ctx->tokens->starts[i];
+    ctx->token.end = ctx->tokens->base + ctx->tokens->ends[i];
+    ctx->token.int_val = ctx->tokens->vals[i].int_val;
+}
+
+// Points the parser at a pre-lexed stream, or back at the lexer if ts is NULL
+void init_tokens(Context *ctx, TokenStream *ts)
+{
+    ctx->tokens = ts;
+    if (ctx->tokens) {
+        load_token(ctx, 0);
+    }
+}
+
+static inline void advance_token(Context *ctx)
+{
+    if (ctx->tokens) {
+        load_token(ctx, MIN(ctx->token_index + 1, buf_len(ctx->tokens->kinds) - 1));
+    } else {
+        next_token(ctx);
+    }
+}
+
+// Kind of the token k positions after the current one
+TokenKind peek_token(Context *ctx, size_t k)
+{
+    if (ctx->tokens) {
+        TokenStream *ts = ctx->tokens;
+        return ts->kinds[MIN(ctx->token_index + k, buf_len(ts->kinds) - 1)];
+    }
+    Token saved_token = ctx->token;
+    const char *saved_stream = ctx->stream;
+    for (size_t i = 0; i < k; i++) {
+        next_token(ctx);
+    }
+    TokenKind kind = ctx->token.kind;
+    ctx->token = saved_token;
+    ctx->stream = saved_stream;
+    return kind;
+}
+
 // static inline bool is_token_name(const char *name)
 // {
 //     return token.kind == TOKEN_NAME && token.name == name;
 // }
 
-static inline bool is_token(TokenKind kind)
+static inline bool is_token(Context *ctx, TokenKind kind)
 {
-    return token.kind == kind;
+    return ctx->token.kind == kind;
 }
 
-static inline bool match_token(TokenKind kind)
+static inline bool match_token(Context *ctx, TokenKind kind)
 {
-    if (is_token(kind)) {
-        next_token();
+    if (is_token(ctx, kind)) {
+        advance_token(ctx);
         return true;
     }
     return false;
 }
 
-static inline bool expect_token(TokenKind kind)
+static inline bool expect_token(Context *ctx, TokenKind kind)
 {
-    if (is_token(kind)) {
-        next_token();
+    if (is_token(ctx, kind)) {
+        advance_token(ctx);
         return true;
     }
-    fatal("expected token %s, got %s", token_kind_name(kind), token_kind_name(token.kind));
+    const char *got = token_kind_name(ctx->token.kind);
+    fatal("expected token %s, got %s", token_kind_name(kind), got);
     return false;
 }
 
-#define assert_token(x) assert(match_token(x))
-#define assert_token_eof() assert(is_token(0))
-#define assert_token_float(x) assert(token.float_val == (x) && match_token(TOKEN_FLOAT))
-#define assert_token_int(x) assert(token.int_val == (x) && match_token(TOKEN_INT))
-#define assert_token_name(x) assert(token.name == str_intern(x) && match_token(TOKEN_NAME))
+#define assert_token(x) assert(match_token(ctx, x))
+#define assert_token_eof() assert(is_token(ctx, TOKEN_EOF))
+#define assert_token_float(x) \
+    assert(ctx->token.float_val == (x) && match_token(ctx, TOKEN_FLOAT))
+#define assert_token_int(x) assert(ctx->token.int_val == (x) && match_token(ctx, TOKEN_INT))
+#define assert_token_name(x) \
+    assert(ctx->token.name == str_intern(x) && match_token(ctx, TOKEN_NAME))
 
 void lex_test(void)
 {
+    Context *ctx = context_new();
     // Ensure UINT64_MAX doesn't trigger overflow
     // init_stream("0x10000000000000000");
 
     // Integer literal tests
-    init_stream("18446744073709551615 0xffff_ffff_ffff_ffff 0b1111 042");
+    init_stream(ctx, "18446744073709551615 0xffff_ffff_ffff_ffff 0b1111 042");
     assert_token_int(18446744073709551615ull);
     assert_token_int(0xffffffffffffffffull);
     assert_token_int(0xf);
     assert_token_int(042);
     assert_token_eof();
 
+    init_stream(ctx, "0 0x0 00 1_000 0xA_b");
+    assert_token_int(0);
+    assert_token_int(0);
+    assert_token_int(0);
+    assert_token_int(1000);
+    assert_token_int(0xab);
+    assert_token_eof();
+
     // Float literal tests
-    init_stream("3.14 .123 42. 3e10");
+    init_stream(ctx, "3.14 .123 42. 3e10");
     assert_token_float(3.14);
     assert_token_float(.123);
     assert_token_float(42.);
@@ -532,14 +2304,28 @@ void lex_test(void)
     assert_token_eof();
 
     // Char literal tests
-    init_stream("'a' '\\n' '\\r'");
+    init_stream(ctx, "'a' '\\n' '\\r'");
     assert_token_int('a');
     assert_token_int('\n');
     assert_token_int('\r');
     assert_token_eof();
 
+    // Whitespace tests
+    init_stream(ctx, " \t\r\n\v\fx\n");
+    assert_token_name("x");
+    assert_token_eof();
+
+    // Ranges end wherever the caller says, not at a NUL
+    const char *src = "abcdef 12345";
+    init_stream_range(ctx, src, src + 3);
+    assert_token_name("abc");
+    assert_token_eof();
+    init_stream_range(ctx, src + 7, src + 10);
+    assert_token_int(123);
+    assert_token_eof();
+
     // Misc tests
-    init_stream("XY+(XY)_HELLO1,234+994");
+    init_stream(ctx, "XY+(XY)_HELLO1,234+994");
     assert_token_name("XY");
     assert_token('+');
     assert_token('(');
@@ -551,311 +2337,5066 @@ void lex_test(void)
     assert_token('+');
     assert_token_int(994);
     assert_token_eof();
+    context_free(ctx);
 }
 
-#undef assert_token
-#undef assert_token_eof
-#undef assert_token_int
-#undef assert_token_name
-
-//
-// Grammar
-//
-// expr3 = INT | '(' expr ')'
-// expr2 = '-' expr2 | expr3
-// expr1 = expr2 ([*/] expr2)*
-// expr0 = expr1 ([+-] expr1)*
-// expr  = expr0
+f64 lex_float(Context *ctx, const char *str)
+{
+    init_stream(ctx, str);
+    assert(is_token(ctx, TOKEN_FLOAT) && ctx->token.end == str + strlen(str));
+    return ctx->token.float_val;
+}
 
-static byte *code;
+// Checks that the lexer reads str to the same double as strtod, bit for bit
+void assert_float_matches_strtod(Context *ctx, const char *str)
+{
+    f64 expected = strtod(str, NULL);
+    f64 actual = lex_float(ctx, str);
+    if (memcmp(&expected, &actual, sizeof(f64)) != 0) {
+        fatal("float literal %s: got %.17g, strtod gives %.17g", str, actual, expected);
+    }
+}
 
-enum {
-    ADD,
-    SUB,
-    MUL,
-    DIV,
-    NEG,
-    LIT,
-    HALT,
-};
+// Formats val with printf precision prec, as a literal the lexer reads as a float
+void format_float_literal(char *buf, int prec, f64 val)
+{
+    sprintf(buf, "%.*g", prec, val);
+    if (!strpbrk(buf, ".e")) {
+        strcat(buf, ".");
+    }
+}
 
-static const struct {
-    const char name[4];
+void float_test()
+{
+    Context *ctx = context_new();
+    static const char *cases[] = {
+        "0.0",
+        "0.",
+        ".0",
+        "1.",
+        "1e0",
+        "1e-0",
+        "0e999999",
+        "0.1",
+        "0.2",
+        "0.3",
+        "1e23",
+        "1e308",
+        "1e-400",
+        "5e-324",
+        "9.5e-325",
+        "3.0540412e5",
+        "1448997445238699.",
+        "7.3177701707893310e15",
+        "8.98846567431158e307",
+        "1.7976931348623157e308",
+        "1.7976931348623158e308",
+        "2.2250738585072011e-308",
+        "2.2250738585072014e-308",
+        "2.22507385850720138309e-308",
+        "4.9406564584124654e-324",
+        "2.4703282292062327e-324",
+        "2.4703282292062328e-324",
+        "9007199254740992.5",
+        "9007199254740993.",
+        "123456789012345678901234567890.",
+        "1.00000000000000011102230246251565",
+        "1.00000000000000011102230246251566",
+        "0.000000000000000000000000000000000000000000001e45",
+        // just below the point where rounding overflows to infinity
+        "179769313486231580793728971405303415079934132710037826936173778980444968292764750"
+        "946649017977587207096330286416692887910946555547851940402630657488671505820681908"
+        "902000708383676273854845817711531764475730270069855571366959622842914819860834936"
+        "475292719074168444365510704342711559699508093042880177904174497791.99999999999999",
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+        assert_float_matches_strtod(ctx, cases[i]);
+    }
+
+    // Digit separators are skipped like in integer literals
+    assert(lex_float(ctx, "1_000.000_5") == 1000.0005);
+    assert(lex_float(ctx, "1_0e1_0") == 10e10);
+    assert(lex_float(ctx, "3_.1_4") == 3.14);
+
+    char buf[1024];
+    // Every short mantissa at every exponent
+    for (int mantissa = 1; mantissa < 1000; mantissa += 7) {
+        for (int exp = -345; exp <= 305; exp++) {
+            sprintf(buf, "%de%d", mantissa, exp);
+            assert_float_matches_strtod(ctx, buf);
+        }
+    }
+
+    // Random doubles across the whole range, printed at several precisions
+    for (int i = 0; i < 100000; i++) {
+        u64 bits = rng_next() & ~(1ull << 63);
+        f64 val;
+        memcpy(&val, &bits, sizeof(val));
+        if (!isfinite(val)) {
+            continue;
+        }
+        static const int precs[] = { 17, 16, 15, 6, 1 };
+        for (size_t j = 0; j < sizeof(precs) / sizeof(*precs); j++) {
+            format_float_literal(buf, precs[j], val);
+            if (isinf(strtod(buf, NULL))) {
+                // rounded up past DBL_MAX
+                continue;
+            }
+            assert_float_matches_strtod(ctx, buf);
+            // the shortest round trip representation must come back exactly
+            if (precs[j] == 17) {
+                assert(lex_float(ctx, buf) == val);
+            }
+        }
+    }
+
+    // Long mantissas, which are truncated to 19 digits
+    for (int i = 0; i < 20000; i++) {
+        int len = 20 + rng_next() % 40;
+        int point = rng_next() % len;
+        char *ptr = buf;
+        for (int j = 0; j < len; j++) {
+            if (j == point) {
+                *ptr++ = '.';
+            }
+            *ptr++ = '0' + (j == 0 ? 1 + rng_next() % 9 : rng_next() % 10);
+        }
+        sprintf(ptr, "e%d", (int)(rng_next() % 600) - 350);
+        assert_float_matches_strtod(ctx, buf);
+    }
+
+    // Exact halfway points between neighbouring doubles, and just either side
+    // of them, need every digit to round correctly
+    for (int i = 0; i < 2000; i++) {
+        u64 bits = rng_next() % (0x7FEull << 52);
+        f64 lo, hi;
+        memcpy(&lo, &bits, sizeof(lo));
+        bits++;
+        memcpy(&hi, &bits, sizeof(hi));
+        long double mid = (long double)lo + ((long double)hi - lo) / 2;
+        sprintf(buf, "%.780Le", mid);
+        assert_float_matches_strtod(ctx, buf);
+        char *e = strchr(buf, 'e');
+        char exp[16];
+        strcpy(exp, e);
+        sprintf(e, "1%s", exp);
+        assert_float_matches_strtod(ctx, buf);
+    }
+    context_free(ctx);
+}
+
+void token_stream_test()
+{
+    Context *ctx = context_new();
+    const char *src = "x + 42 * (2.5)";
+    TokenStream ts;
+    lex_tokens(ctx, &ts, src, src + strlen(src));
+    assert(buf_len(ts.kinds) == 8);
+    assert(ts.kinds[0] == TOKEN_NAME && ts.vals[0].name == str_intern("x"));
+    assert(ts.kinds[2] == TOKEN_INT && ts.vals[2].int_val == 42);
+    assert(ts.starts[2] == 4 && ts.ends[2] == 6);
+    assert(ts.kinds[5] == TOKEN_FLOAT && ts.vals[5].float_val == 2.5);
+    assert(ts.kinds[7] == TOKEN_EOF);
+
+    // The parser walks the stream and can look arbitrarily far ahead
+    init_tokens(ctx, &ts);
+    assert(peek_token(ctx, 0) == TOKEN_NAME);
+    assert(peek_token(ctx, 3) == '*');
+    assert(peek_token(ctx, 100) == TOKEN_EOF);
+    assert_token_name("x");
+    assert_token('+');
+    assert(ctx->token.start == src + 4 && ctx->token.end == src + 6);
+    assert_token_int(42);
+    assert(peek_token(ctx, 2) == TOKEN_FLOAT);
+    assert_token('*');
+    assert_token('(');
+    assert_token_float(2.5);
+    assert_token(')');
+    assert_token_eof();
+    advance_token(ctx);
+    assert_token_eof();
+    init_tokens(ctx, NULL);
+
+    // Streaming lookahead leaves the lexer where it was
+    init_stream(ctx, src);
+    assert(peek_token(ctx, 2) == TOKEN_INT);
+    assert_token_name("x");
+    assert_token('+');
+    free_tokens(&ts);
+    context_free(ctx);
+}
+
+// Builds a NUL-terminated source mixing names, numbers, operators and
+// whitespace in roughly the proportions of our generated inputs. With
+// long_runs, names and indentation are as long as in machine-generated code.
+char *gen_lex_corpus(size_t size, bool long_runs)
+{
+    static const char *ops[] = { "+", "-", "*", "/", "(", ")", ",", "=" };
+    static const char *spaces[] = { " ", " ", " ", "  ", "\n", "\n    ", "\t" };
+    int max_name = long_runs ? 64 : 16;
+    char *buf = xmalloc(size + 256);
+    char *ptr = buf;
+    while (ptr < buf + size) {
+        switch (rng_next() % 8) {
+            case 0:
+            case 1:
+            case 2: {
+                int len = 1 + rng_next() % max_name;
+                static const char first[] =
+                    "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+                static const char rest[] = "_0123456789abcdefghijklmnopqrstuvwxyz";
+                *ptr++ = first[rng_next() % (sizeof(first) - 1)];
+                for (int i = 1; i < len; i++) {
+                    *ptr++ = rest[rng_next() % (sizeof(rest) - 1)];
+                }
+                break;
+            }
+            case 3:
+                ptr += sprintf(ptr, "%llu", (unsigned long long)(rng_next() % 1000000));
+                break;
+            case 4:
+                ptr += sprintf(ptr, "0x%llx", (unsigned long long)(rng_next() >> 16));
+                break;
+            case 5:
+                ptr += sprintf(ptr, "%.6g", (rng_next() % 1000000) / 1000.0 + 0.5);
+                break;
+            default:
+                ptr += sprintf(ptr, "%s", ops[rng_next() % 8]);
+                break;
+        }
+        if (long_runs && rng_next() % 4 == 0) {
+            ptr += sprintf(ptr, "\n%*s", (int)(rng_next() % 48), "");
+        } else {
+            ptr += sprintf(ptr, "%s", spaces[rng_next() % 7]);
+        }
+    }
+    *ptr = 0;
+    return buf;
+}
+
+void lex_bench()
+{
+    enum { SIZE = 16 * 1024 * 1024, RUNS = 5 };
+    Context *ctx = context_new();
+    for (int long_runs = 0; long_runs <= 1; long_runs++) {
+        char *src = gen_lex_corpus(SIZE, long_runs);
+        size_t len = strlen(src);
+        for (SimdLevel level = SIMD_SCALAR; level <= simd_max_level(); level++) {
+            set_simd_level(level);
+            size_t tokens = 0;
+            f64 best = INFINITY;
+            for (int run = 0; run < RUNS; run++) {
+                f64 start = now_seconds();
+                init_stream(ctx, src);
+                while (!is_token(ctx, TOKEN_EOF)) {
+                    next_token(ctx);
+                    tokens++;
+                }
+                best = MIN(best, now_seconds() - start);
+            }
+            printf(
+                "lex %-6s %-6s: %.1f MB/s, %.1f Mtokens/s\n", long_runs ? "long" : "mixed",
+                simd_level_names[level], len / best / 1e6, tokens / RUNS / best / 1e6);
+        }
+        free(src);
+    }
+    set_simd_level(simd_max_level());
+    context_free(ctx);
+}
+
+void float_bench()
+{
+    enum { SIZE = 16 * 1024 * 1024, RUNS = 5 };
+    Context *ctx = context_new();
+    char *src = xmalloc(SIZE + 64);
+    char *ptr = src;
+    while (ptr < src + SIZE) {
+        u64 bits = rng_next() % (0x7FEull << 52);
+        f64 val;
+        memcpy(&val, &bits, sizeof(val));
+        // Mostly short human-scale numbers, some full precision ones
+        if (rng_next() % 4) {
+            val = (rng_next() % 100000000) / 1000.0;
+        }
+        format_float_literal(ptr, rng_next() % 2 ? 17 : 6, val);
+        ptr += strlen(ptr);
+        *ptr++ = ' ';
+    }
+    *ptr = 0;
+
+    TokenStream ts;
+    lex_tokens(ctx, &ts, src, ptr);
+    size_t num_floats = buf_len(ts.kinds) - 1;
+    f64 lex_best = INFINITY, strtod_best = INFINITY;
+    // keeps the conversions from being optimized away
+    static volatile f64 sum;
+    for (int run = 0; run < RUNS; run++) {
+        f64 t0 = now_seconds();
+        init_stream_range(ctx, src, ptr);
+        while (!is_token(ctx, TOKEN_EOF)) {
+            sum += ctx->token.float_val;
+            next_token(ctx);
+        }
+        f64 t1 = now_seconds();
+        for (size_t i = 0; i < num_floats; i++) {
+            sum += strtod_range(src + ts.starts[i], src + ts.ends[i]);
+        }
+        f64 t2 = now_seconds();
+        lex_best = MIN(lex_best, t1 - t0);
+        strtod_best = MIN(strtod_best, t2 - t1);
+    }
+    printf(
+        "float lex: %.1f MB/s, %.1f Mfloats/s (strtod alone: %.1f Mfloats/s)\n",
+        (ptr - src) / lex_best / 1e6, num_floats / lex_best / 1e6,
+        num_floats / strtod_best / 1e6);
+    free_tokens(&ts);
+    free(src);
+    context_free(ctx);
+}
+
+#undef assert_token
+#undef assert_token_eof
+#undef assert_token_int
+#undef assert_token_name
+
+//
+enum {
+    // Int arithmetic, wrapping on overflow
+    ADDI,
+    SUBI,
+    MULI,
+    DIVI,
+    NEGI,
+    // Float arithmetic on two floats
+    ADDF,
+    SUBF,
+    MULF,
+    DIVF, // by zero gives an infinity or NaN rather than failing
+    NEGF,
+    I2F, // convert the int on top to a float
+    // Generic arithmetic, for code compiled without ctx->typed_ops. Bit 0 of the
+    // immediate is set if the left operand is a float, bit 1 if the right one
+    // is, and each run of the instruction branches on them: two ints give the
+    // int op, otherwise the ints are converted and it's the float op.
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    NEG,
+    LOAD,  // push inputs[slot]
+    PICK,  // push a copy of the value imm slots below the top
+    SLIDE, // drop the imm values below the top
+    // Literals take the smallest little-endian, sign-extended immediate that
+    // holds them, and 0 and 1 take none
+    LIT0,
+    LIT1,
+    LIT8,
+    LIT16,
+    LIT32,
+    LIT64,
+    LITF, // push the float whose bits are the 8-byte immediate
+    // Superinstructions produced by peephole_code, with 8-bit immediates
+    ADDK, // top += imm
+    MULK, // top *= imm
+    DIVK, // top /= imm, imm not 0 or -1
+    HALT,
+    NUM_OPS,
+};
+
+// size is in bytes including operands; pops and pushes are stack effects
+static const struct {
+    const char *name;
     int size;
+    int pops;
+    int pushes;
 } instr_info[] = {
-    [ADD] = { "ADD ", 1 },  [SUB] = { "SUB ", 1 }, [MUL] = { "MUL ", 1 },
-    [DIV] = { "DIV ", 1 },  [NEG] = { "NEG ", 1 }, [LIT] = { "LIT ", 5 },
-    [HALT] = { "HALT", 1 },
+    [ADDI] = { "ADDI", 1, 2, 1 },     [SUBI] = { "SUBI", 1, 2, 1 },
+    [MULI] = { "MULI", 1, 2, 1 },     [DIVI] = { "DIVI", 1, 2, 1 },
+    [NEGI] = { "NEGI", 1, 1, 1 },     [ADDF] = { "ADDF", 1, 2, 1 },
+    [SUBF] = { "SUBF", 1, 2, 1 },     [MULF] = { "MULF", 1, 2, 1 },
+    [DIVF] = { "DIVF", 1, 2, 1 },     [NEGF] = { "NEGF", 1, 1, 1 },
+    [I2F] = { "I2F", 1, 1, 1 },       [ADD] = { "ADD", 2, 2, 1 },
+    [SUB] = { "SUB", 2, 2, 1 },       [MUL] = { "MUL", 2, 2, 1 },
+    [DIV] = { "DIV", 2, 2, 1 },       [NEG] = { "NEG", 2, 1, 1 },
+    [LOAD] = { "LOAD", 2, 0, 1 },     [PICK] = { "PICK", 2, 0, 1 },
+    [SLIDE] = { "SLIDE", 2, 1, 1 }, // and pops imm more
+    [LIT0] = { "LIT0", 1, 0, 1 },     [LIT1] = { "LIT1", 1, 0, 1 },
+    [LIT8] = { "LIT8", 2, 0, 1 },     [LIT16] = { "LIT16", 3, 0, 1 },
+    [LIT32] = { "LIT32", 5, 0, 1 },   [LIT64] = { "LIT64", 9, 0, 1 },
+    [LITF] = { "LITF", 9, 0, 1 },     [ADDK] = { "ADDK", 2, 1, 1 },
+    [MULK] = { "MULK", 2, 1, 1 },     [DIVK] = { "DIVK", 2, 1, 1 },
+    [HALT] = { "HALT", 1, 1, 0 },
+};
+
+bool is_generic_op(byte op)
+{
+    return op >= ADD && op <= NEG;
+}
+
+// The typed op that a generic op runs as, given its immediate
+byte typed_op(byte op, byte floats)
+{
+    static const byte int_ops[] = {
+        [ADD] = ADDI, [SUB] = SUBI, [MUL] = MULI, [DIV] = DIVI, [NEG] = NEGI,
+    };
+    static const byte float_ops[] = {
+        [ADD] = ADDF, [SUB] = SUBF, [MUL] = MULF, [DIV] = DIVF, [NEG] = NEGF,
+    };
+    return floats ? float_ops[op] : int_ops[op];
+}
+
+// Reads a little-endian immediate of size bytes and sign-extends it
+int64_t read_imm(const byte *p, int size)
+{
+    uint64_t val = 0;
+    for (int i = 0; i < size; i++) {
+        val |= (uint64_t)p[i] << (8 * i);
+    }
+    uint64_t sign = 1ull << (8 * size - 1);
+    return (int64_t)((val ^ sign) - sign);
+}
+
+void push_imm(byte **buf, uint64_t imm, int size)
+{
+    for (int i = 0; i < size; i++) {
+        buf_push(*buf, imm >> (8 * i));
+    }
+}
+
+void push_bytes(byte **buf, const byte *bytes, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        buf_push(*buf, bytes[i]);
+    }
+}
+
+void push_instr_imm(byte **buf, byte op, uint64_t imm, int size)
+{
+    buf_push(*buf, op);
+    push_imm(buf, imm, size);
+}
+
+bool fits_int8(int64_t val)
+{
+    return val >= INT8_MIN && val <= INT8_MAX;
+}
+
+// Pushes val with the shortest literal instruction that holds it
+void push_lit(byte **buf, int64_t val)
+{
+    if (val == 0 || val == 1) {
+        buf_push(*buf, val ? LIT1 : LIT0);
+    } else if (fits_int8(val)) {
+        push_instr_imm(buf, LIT8, val, 1);
+    } else if (val >= INT16_MIN && val <= INT16_MAX) {
+        push_instr_imm(buf, LIT16, val, 2);
+    } else if (val >= INT32_MIN && val <= INT32_MAX) {
+        push_instr_imm(buf, LIT32, val, 4);
+    } else {
+        push_instr_imm(buf, LIT64, val, 8);
+    }
+}
+
+// Register machine: three-address instructions over a frame of 64-bit words.
+// Each operand is a little-endian int16. Non-negative operands name registers
+// and negative operands name constants, so constant k lives at frame[-1 - k]
+// and no instruction is needed to load it (Lua's RK operands).
+enum {
+    REG_ADDI, // a = b + c
+    REG_SUBI,
+    REG_MULI,
+    REG_DIVI,
+    REG_NEGI, // a = -b
+    // The same on floats
+    REG_ADDF,
+    REG_SUBF,
+    REG_MULF,
+    REG_DIVF,
+    REG_NEGF,
+    REG_I2F,  // a = (f64)b
+    REG_LOAD, // a = inputs[b]
+    REG_RET,  // return b
+    NUM_REG_OPS,
+};
+
+static const struct {
+    const char *name;
+    int size;
+    int num_operands;
+} reg_info[] = {
+    [REG_ADDI] = { "ADDI", 7, 3 }, [REG_SUBI] = { "SUBI", 7, 3 },
+    [REG_MULI] = { "MULI", 7, 3 }, [REG_DIVI] = { "DIVI", 7, 3 },
+    [REG_NEGI] = { "NEGI", 5, 2 }, [REG_ADDF] = { "ADDF", 7, 3 },
+    [REG_SUBF] = { "SUBF", 7, 3 }, [REG_MULF] = { "MULF", 7, 3 },
+    [REG_DIVF] = { "DIVF", 7, 3 }, [REG_NEGF] = { "NEGF", 5, 2 },
+    [REG_I2F] = { "I2F", 5, 2 },   [REG_LOAD] = { "LOAD", 5, 2 },
+    [REG_RET] = { "RET", 3, 1 },
+};
+
+enum { REG_MAX_OPERAND = INT16_MAX };
+
+// Expressions are parsed into a tree of nodes, which lower_tree then compiles.
+// Nodes live in ctx->nodes until reset_code and refer to each other by index.
+// The parser stores them in post order: a node's operands come before it, and
+// the whole left operand before the right one. With ctx->cse_active a repeated
+// subexpression is the same node, so the tree becomes a DAG, still ordered so
+// that operands come first.
+//
+// Each node is typed as it's added, which is all the type inference there is:
+// ints and floats are told apart by their literals, and inputs are ints. An op
+// with a float operand is the float op, and its int operands are converted by
+// I2F nodes, so the ops in a tree are the typed ones (ADDI, ADDF, ...).
+typedef uint32_t NodeId;
+
+typedef struct Node {
+    byte op;     // LIT64 or LITF for a literal, LOAD for an input, or the op computing it
+    bool shared; // whether parse_tree found it more than once
+    Type type;   // of its value
+    union {
+        int64_t val;     // LIT64, or the bits of LITF's f64
+        int slot;        // LOAD
+        NodeId args[2]; // the operands, as many as the op pops
+    };
+} Node;
+
+// Binding powers. An operator's right operand extends up to the next infix
+// operator that binds no tighter than it, which makes infix operators left
+// associative. A new precedence level is a new value and table entries, not
+// another function.
+// Grammar
+//
+// An operand is an INT, FLOAT or NAME, or a parenthesized expression, after
+// any number of prefix '-' and '+'. Operators are looked up by token in
+// prefix_ops and infix_ops, and bind by their binding power: prefix operators
+// tightest, then '*' and '/', then '+' and '-', all infix ones to the left.
+// parse_tree keeps the operators and '(' still waiting for an operand on
+// ctx->parse_stack rather than recursing.
+enum { BP_NONE, BP_SUM, BP_PRODUCT, BP_PREFIX };
+
+typedef struct ParseOp {
+    byte op; // the int op, or NUM_OPS if the operator emits nothing
+    byte bp; // BP_NONE if the token isn't this kind of operator
+} ParseOp;
+
+static const ParseOp prefix_ops[TOKEN_LAST_CHAR + 1] = {
+    ['-'] = { NEGI, BP_PREFIX },
+    ['+'] = { NUM_OPS, BP_PREFIX },
+};
+
+static const ParseOp infix_ops[TOKEN_LAST_CHAR + 1] = {
+    ['+'] = { ADDI, BP_SUM },
+    ['-'] = { SUBI, BP_SUM },
+    ['*'] = { MULI, BP_PRODUCT },
+    ['/'] = { DIVI, BP_PRODUCT },
+};
+
+ParseOp token_op(Context *ctx, const ParseOp *table)
+{
+    TokenKind kind = ctx->token.kind;
+    return kind <= TOKEN_LAST_CHAR ? table[kind] : (ParseOp){ 0 };
+}
+
+typedef enum { FRAME_PAREN, FRAME_PREFIX, FRAME_INFIX } FrameKind;
+
+// An open parenthesis or an operator waiting for its right operand
+typedef struct ParseFrame {
+    FrameKind kind;
+    ParseOp op;
+    NodeId left; // an infix operator's left operand
+} ParseFrame;
+
+// What the emitter knows about each value on the virtual operand stack
+typedef struct EmitSlot {
+    Type type;
+    bool is_const;
+    int64_t val;     // if is_const
+    uint32_t start;  // offset in code where the stack code computing it starts
+    int16_t operand; // register or constant holding it in register code
+    uint32_t temp;   // C variable holding it in C code
+} EmitSlot;
+
+static const char c_prelude[] =
+    "// Generated by tyrion; built with cc -O2 -shared -fPIC\n"
+    "#include <stdint.h>\n"
+    "\n"
+    "void (*ion_div_zero)(void);\n"
+    "\n"
+    "static int64_t ion_add(int64_t a, int64_t b) { return (uint64_t)a + (uint64_t)b; }\n"
+    "static int64_t ion_sub(int64_t a, int64_t b) { return (uint64_t)a - (uint64_t)b; }\n"
+    "static int64_t ion_mul(int64_t a, int64_t b) { return (uint64_t)a * (uint64_t)b; }\n"
+    "static int64_t ion_neg(int64_t a) { return 0 - (uint64_t)a; }\n"
+    "\n"
+    "static double ion_f64(int64_t w)\n"
+    "{\n"
+    "    union { int64_t w; double f; } u = { w };\n"
+    "    return u.f;\n"
+    "}\n"
+    "\n"
+    "static int64_t ion_word(double f)\n"
+    "{\n"
+    "    union { double f; int64_t w; } u = { f };\n"
+    "    return u.w;\n"
+    "}\n"
+    "\n"
+    "static int64_t ion_div(int64_t a, int64_t b)\n"
+    "{\n"
+    "    if (b == 0) {\n"
+    "        ion_div_zero();\n"
+    "    }\n"
+    "    return b == -1 ? (int64_t)(0 - (uint64_t)a) : a / b;\n"
+    "}\n";
+
+// Starts a new C translation unit
+void c_begin_unit(Context *ctx)
+{
+    if (ctx->c_unit) {
+        buf__len(ctx->c_unit) = 0;
+    }
+    buf_printf(ctx->c_unit, "%s", c_prelude);
+    ctx->c_num_fns = 0;
+    if (ctx->c_fn_types) {
+        buf__len(ctx->c_fn_types) = 0;
+    }
+}
+
+// Starts a new compilation. Everything emitted into code since the last reset
+// is released at once. The C backend starts a new function instead.
+void reset_code(Context *ctx)
+{
+    buf_free(ctx->code);
+    buf_free(ctx->reg_code);
+    buf_free(ctx->reg_consts);
+    buf_free(ctx->emit_stack);
+    buf_free(ctx->input_names);
+    arena_reset(&ctx->code_arena);
+    buf_fit_arena(ctx->code, &ctx->code_arena, 256);
+    buf_fit_arena(ctx->reg_code, &ctx->code_arena, 256);
+    buf_fit_arena(ctx->reg_consts, &ctx->code_arena, 64);
+    buf_fit_arena(ctx->emit_stack, &ctx->code_arena, 64);
+    if (ctx->nodes) {
+        buf__len(ctx->nodes) = 0;
+    }
+    buf_fit_arena(ctx->input_names, &ctx->code_arena, 8);
+    ctx->reg_num_regs = 0;
+    ctx->cse_active = false;
+    if (ctx->backend == BACKEND_C) {
+        buf_printf(
+            ctx->c_unit, "\nint64_t ion_expr_%d(const int64_t *in)\n{\n", ctx->c_num_fns++);
+        ctx->c_num_temps = 0;
+    }
+}
+
+// Writes the value of slot
+void c_push_operand(Context *ctx, EmitSlot slot)
+{
+    if (!slot.is_const) {
+        buf_printf(ctx->c_unit, "t%u", slot.temp);
+    } else if (slot.type == TYPE_FLOAT) {
+        f64 val = f64_from_word(slot.val);
+        if (isfinite(val)) {
+            buf_printf(ctx->c_unit, "%a", val);
+        } else {
+            buf_printf(ctx->c_unit, "ion_f64(INT64_C(%lld))", (long long)slot.val);
+        }
+    } else if (slot.val == INT64_MIN) {
+        buf_printf(ctx->c_unit, "INT64_MIN");
+    } else {
+        buf_printf(ctx->c_unit, "INT64_C(%lld)", (long long)slot.val);
+    }
+}
+
+// Int ops call the prelude's wrapping functions, and float ops are plain C
+// arithmetic on doubles
+void c_emit_op(Context *ctx, byte op, const EmitSlot *args, EmitSlot *result)
+{
+    static const char *names[] = {
+        [ADDI] = "ion_add", [SUBI] = "ion_sub", [MULI] = "ion_mul",
+        [DIVI] = "ion_div", [NEGI] = "ion_neg",
+    };
+    static const char *float_ops[] = {
+        [ADDF] = "+", [SUBF] = "-", [MULF] = "*", [DIVF] = "/",
+        [NEGF] = "-", [I2F] = "(double)",
+    };
+    if (op == HALT) {
+        bool is_float = args[0].type == TYPE_FLOAT;
+        buf_printf(ctx->c_unit, "    return %s", is_float ? "ion_word(" : "");
+        c_push_operand(ctx, args[0]);
+        buf_printf(ctx->c_unit, "%s;\n}\n", is_float ? ")" : "");
+        buf_push(ctx->c_fn_types, args[0].type);
+        return;
+    }
+    result->temp = ctx->c_num_temps++;
+    if (result->type == TYPE_INT) {
+        buf_printf(ctx->c_unit, "    int64_t t%u = %s(", result->temp, names[op]);
+        for (int i = 0; i < instr_info[op].pops; i++) {
+            buf_printf(ctx->c_unit, i ? ", " : "");
+            c_push_operand(ctx, args[i]);
+        }
+        buf_printf(ctx->c_unit, ");\n");
+    } else if (instr_info[op].pops == 1) {
+        buf_printf(ctx->c_unit, "    double t%u = %s", result->temp, float_ops[op]);
+        c_push_operand(ctx, args[0]);
+        buf_printf(ctx->c_unit, ";\n");
+    } else {
+        buf_printf(ctx->c_unit, "    double t%u = ", result->temp);
+        c_push_operand(ctx, args[0]);
+        buf_printf(ctx->c_unit, " %s ", float_ops[op]);
+        c_push_operand(ctx, args[1]);
+        buf_printf(ctx->c_unit, ";\n");
+    }
+}
+
+void reg_push_operand(Context *ctx, int16_t operand)
+{
+    buf_push(ctx->reg_code, (byte)operand);
+    buf_push(ctx->reg_code, (byte)((uint16_t)operand >> 8));
+}
+
+// Type of the value a typed op pushes
+Type op_type(byte op)
+{
+    switch (op) {
+        case ADDF:
+        case SUBF:
+        case MULF:
+        case DIVF:
+        case NEGF:
+        case I2F:
+        case LITF:
+            return TYPE_FLOAT;
+        default:
+            return TYPE_INT;
+    }
+}
+
+// Evaluates a typed op on constant arguments of the given types exactly as
+// vm_run would: ints wrap on overflow, and float ops convert any int argument,
+// which only the generic ops get. Returns false for integer division by zero,
+// which is left to fail at run time.
+bool eval_op(byte op, const int64_t *args, const Type *types, int64_t *result)
+{
+    if (op_type(op) == TYPE_FLOAT) {
+        f64 left = word_to_f64(args[0], types[0] == TYPE_INT);
+        f64 right = 0;
+        if (instr_info[op].pops == 2) {
+            right = word_to_f64(args[1], types[1] == TYPE_INT);
+        }
+        f64 val;
+        switch (op) {
+            case ADDF:
+                val = left + right;
+                break;
+            case SUBF:
+                val = left - right;
+                break;
+            case MULF:
+                val = left * right;
+                break;
+            case DIVF:
+                val = left / right;
+                break;
+            case NEGF:
+                val = -left;
+                break;
+            case I2F:
+                val = left;
+                break;
+            default:
+                return false;
+        }
+        *result = word_from_f64(val);
+        return true;
+    }
+    uint64_t left = args[0], right = instr_info[op].pops == 2 ? args[1] : 0;
+    switch (op) {
+        case ADDI:
+            *result = (int64_t)(left + right);
+            return true;
+        case SUBI:
+            *result = (int64_t)(left - right);
+            return true;
+        case MULI:
+            *result = (int64_t)(left * right);
+            return true;
+        case DIVI:
+            if (right == 0) {
+                return false;
+            }
+            *result = args[1] == -1 ? (int64_t)(0 - left) : args[0] / args[1];
+            return true;
+        case NEGI:
+            *result = (int64_t)(0 - left);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Pushes a literal, val being the bits of an f64 if type is TYPE_FLOAT
+void emit_lit(Context *ctx, uint64_t val, Type type)
+{
+    EmitSlot slot = {
+        .type = type, .is_const = true, .val = val, .start = buf_len(ctx->code),
+    };
+    if (ctx->backend == BACKEND_STACK && type == TYPE_FLOAT) {
+        push_instr_imm(&ctx->code, LITF, val, 8);
+    } else if (ctx->backend == BACKEND_STACK) {
+        push_lit(&ctx->code, val);
+    } else if (ctx->backend == BACKEND_REGISTER) {
+        if (buf_len(ctx->reg_consts) > REG_MAX_OPERAND) {
+            fatal("expression has too many constants");
+        }
+        slot.operand = -1 - (int)buf_len(ctx->reg_consts);
+        buf_push(ctx->reg_consts, val);
+    }
+    buf_push(ctx->emit_stack, slot);
+}
+
+// Slot of the input with the given interned name, allocating the next one the
+// first time it's used
+int input_slot(Context *ctx, const char *name)
+{
+    for (size_t i = 0; i < buf_len(ctx->input_names); i++) {
+        if (ctx->input_names[i] == name) {
+            return i;
+        }
+    }
+    if (buf_len(ctx->input_names) > UINT8_MAX) {
+        fatal("expression has too many inputs");
+    }
+    buf_push(ctx->input_names, name);
+    return buf_len(ctx->input_names) - 1;
+}
+
+void emit_load(Context *ctx, int slot)
+{
+    int dest = buf_len(ctx->emit_stack);
+    EmitSlot result = { .start = buf_len(ctx->code), .operand = dest };
+    if (ctx->backend == BACKEND_STACK) {
+        buf_push(ctx->code, LOAD);
+        buf_push(ctx->code, slot);
+    } else if (ctx->backend == BACKEND_REGISTER) {
+        if (dest >= REG_MAX_OPERAND) {
+            fatal("expression needs too many registers");
+        }
+        buf_push(ctx->reg_code, REG_LOAD);
+        reg_push_operand(ctx, dest);
+        reg_push_operand(ctx, slot);
+        ctx->reg_num_regs = MAX(ctx->reg_num_regs, dest + 1);
+    } else {
+        result.temp = ctx->c_num_temps++;
+        buf_printf(ctx->c_unit, "    int64_t t%u = in[%d];\n", result.temp, slot);
+    }
+    buf_push(ctx->emit_stack, result);
+}
+
+// Replaces the constant arguments of op on top of the virtual stack with
+// their folded value, if it has one
+bool fold_op(Context *ctx, byte op)
+{
+    int num_args = instr_info[op].pops;
+    EmitSlot *args = ctx->emit_stack + buf_len(ctx->emit_stack) - num_args;
+    int64_t vals[2], result;
+    Type types[2];
+    for (int i = 0; i < num_args; i++) {
+        if (!args[i].is_const) {
+            return false;
+        }
+        vals[i] = args[i].val;
+        types[i] = args[i].type;
+    }
+    if (!eval_op(op, vals, types, &result)) {
+        return false;
+    }
+    if (ctx->backend == BACKEND_STACK) {
+        buf__len(ctx->code) = args[0].start;
+    } else if (ctx->backend == BACKEND_REGISTER) {
+        // Constants are added in order, so the arguments' are usually last
+        for (int i = num_args - 1; i >= 0; i--) {
+            if (args[i].operand == -(int)buf_len(ctx->reg_consts)) {
+                buf__len(ctx->reg_consts)--;
+            }
+        }
+    }
+    buf__len(ctx->emit_stack) -= num_args;
+    emit_lit(ctx, result, op_type(op));
+    return true;
+}
+
+// Emits a typed op, translating it to the current backend. Without
+// ctx->typed_ops, stack code gets the generic op instead and no I2F, since the
+// generic ops convert int operands themselves.
+void emit_op(Context *ctx, byte op)
+{
+    int num_args = instr_info[op].pops;
+    assert(buf_len(ctx->emit_stack) >= num_args);
+    if (ctx->fold_constants && op != HALT && fold_op(ctx, op)) {
+        return;
+    }
+    bool is_generic = ctx->backend == BACKEND_STACK && !ctx->typed_ops && op != HALT;
+    if (is_generic && op == I2F) {
+        return;
+    }
+    buf__len(ctx->emit_stack) -= num_args;
+    int dest = buf_len(ctx->emit_stack);
+    EmitSlot *args = ctx->emit_stack + dest;
+    EmitSlot slot = {
+        .type = op_type(op),
+        .start = num_args ? args[0].start : buf_len(ctx->code),
+        .operand = dest,
+    };
+    if (is_generic) {
+        static const byte generic_ops[] = {
+            [ADDI] = ADD, [SUBI] = SUB, [MULI] = MUL, [DIVI] = DIV, [NEGI] = NEG,
+            [ADDF] = ADD, [SUBF] = SUB, [MULF] = MUL, [DIVF] = DIV, [NEGF] = NEG,
+        };
+        byte float_operands = 0;
+        for (int i = 0; i < num_args; i++) {
+            float_operands |= (args[i].type == TYPE_FLOAT) << i;
+        }
+        push_instr_imm(&ctx->code, generic_ops[op], float_operands, 1);
+    } else if (ctx->backend == BACKEND_STACK) {
+        buf_push(ctx->code, op);
+    } else if (ctx->backend == BACKEND_C) {
+        c_emit_op(ctx, op, args, &slot);
+    } else if (op == HALT) {
+        buf_push(ctx->reg_code, REG_RET);
+        reg_push_operand(ctx, args[0].operand);
+    } else {
+        if (dest >= REG_MAX_OPERAND) {
+            fatal("expression needs too many registers");
+        }
+        static const byte reg_ops[] = {
+            [ADDI] = REG_ADDI, [SUBI] = REG_SUBI, [MULI] = REG_MULI, [DIVI] = REG_DIVI,
+            [NEGI] = REG_NEGI, [ADDF] = REG_ADDF, [SUBF] = REG_SUBF, [MULF] = REG_MULF,
+            [DIVF] = REG_DIVF, [NEGF] = REG_NEGF, [I2F] = REG_I2F,
+        };
+        buf_push(ctx->reg_code, reg_ops[op]);
+        reg_push_operand(ctx, dest);
+        for (int i = 0; i < num_args; i++) {
+            reg_push_operand(ctx, args[i].operand);
+        }
+        ctx->reg_num_regs = MAX(ctx->reg_num_regs, dest + 1);
+    }
+    if (instr_info[op].pushes) {
+        buf_push(ctx->emit_stack, slot);
+    }
+}
+
+// Pushes a copy of emit_stack[index], a value further down the virtual stack.
+// Register and C code use the copied value where it is.
+void emit_pick(Context *ctx, int index)
+{
+    EmitSlot slot = ctx->emit_stack[index];
+    slot.start = buf_len(ctx->code);
+    if (ctx->backend == BACKEND_STACK) {
+        push_instr_imm(&ctx->code, PICK, buf_len(ctx->emit_stack) - 1 - index, 1);
+    }
+    buf_push(ctx->emit_stack, slot);
+}
+
+// Drops the n values below the top of the virtual stack
+void emit_slide(Context *ctx, int n)
+{
+    EmitSlot top = buf_end(ctx->emit_stack)[-1];
+    buf__len(ctx->emit_stack) -= n;
+    buf_end(ctx->emit_stack)[-1] = top;
+    for (; n > 0 && ctx->backend == BACKEND_STACK; n -= UINT8_MAX) {
+        push_instr_imm(&ctx->code, SLIDE, MIN(n, UINT8_MAX), 1);
+    }
+}
+
+// Value of the literal instruction at p, if it is one
+bool decode_lit(const byte *p, int64_t *val)
+{
+    switch (*p) {
+        case LIT0:
+            *val = 0;
+            return true;
+        case LIT1:
+            *val = 1;
+            return true;
+        case LIT8:
+        case LIT16:
+        case LIT32:
+        case LIT64:
+            *val = read_imm(p + 1, instr_info[*p].size - 1);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Rewrites the straight-line stack code in code into fewer instructions with
+// the same result, wrapping included:
+//   LIT x; NEGI -> LIT -x         NEGI; NEGI -> (nothing)
+//   LIT x; ADDI -> ADDK x         LIT x; SUBI -> ADDK -x
+//   LIT x; MULI -> MULK x         LIT x; DIVI -> DIVK x   (x not 0 or -1)
+//   ADDK x; ADDK y -> ADDK x+y    MULK x; MULK y -> MULK x*y
+//   ADDK 0, MULK 1, DIVK 1 -> (nothing)
+// where the K immediates must fit in 8 bits and LIT is an int literal. Literals
+// are re-encoded in the shortest form, and float and generic instructions are
+// copied as they are. Each instruction is matched against the already
+// rewritten ones before it, so rewrites chain.
+void peephole_code(Context *ctx)
+{
+    size_t len = buf_len(ctx->code);
+    byte *out = NULL;
+    uint32_t *starts = NULL; // offset of each instruction in out
+    buf_fit_arena(out, &ctx->code_arena, len);
+    buf_fit_arena(starts, &ctx->code_arena, len);
+#define last_instr() (buf_len(starts) ? out + starts[buf_len(starts) - 1] : NULL)
+#define drop_last_instr() (buf__len(out) = starts[--buf__len(starts)])
+    for (size_t offset = 0; offset < len; offset += instr_info[ctx->code[offset]].size) {
+        const byte *pc = ctx->code + offset;
+        byte op = *pc;
+        int64_t imm = 0;
+        if (decode_lit(pc, &imm)) {
+            op = LIT64; // any literal
+        } else if (op == ADDK || op == MULK || op == DIVK) {
+            imm = read_imm(pc + 1, 1);
+        }
+        const byte *last = last_instr();
+        int64_t val;
+        if (last && decode_lit(last, &val)) {
+            int64_t neg = (int64_t)(0 - (uint64_t)val);
+            bool fuse = true;
+            switch (op) {
+                case NEGI:
+                    op = LIT64;
+                    imm = neg;
+                    break;
+                case ADDI:
+                case MULI:
+                    fuse = fits_int8(val);
+                    op = !fuse ? op : op == ADDI ? ADDK : MULK;
+                    imm = val;
+                    break;
+                case SUBI:
+                    fuse = fits_int8(neg);
+                    op = fuse ? ADDK : SUBI;
+                    imm = neg;
+                    break;
+                case DIVI:
+                    fuse = fits_int8(val) && val != 0 && val != -1;
+                    op = fuse ? DIVK : DIVI;
+                    imm = val;
+                    break;
+                default:
+                    fuse = false;
+                    break;
+            }
+            if (fuse) {
+                drop_last_instr();
+                last = last_instr();
+            }
+        }
+        if (last && *last == op && (op == ADDK || op == MULK)) {
+            int64_t prev = read_imm(last + 1, 1);
+            int64_t merged = op == ADDK ? prev + imm : prev * imm;
+            if (fits_int8(merged)) {
+                imm = merged;
+                drop_last_instr();
+            }
+        } else if (last && *last == NEGI && op == NEGI) {
+            drop_last_instr();
+            continue;
+        }
+        if ((op == ADDK && imm == 0) || ((op == MULK || op == DIVK) && imm == 1)) {
+            continue;
+        }
+        buf_push(starts, buf_len(out));
+        if (op == LIT64) {
+            push_lit(&out, imm);
+        } else if (op == ADDK || op == MULK || op == DIVK) {
+            push_instr_imm(&out, op, imm, 1);
+        } else {
+            push_bytes(&out, pc, instr_info[op].size);
+        }
+    }
+#undef last_instr
+#undef drop_last_instr
+    ctx->code = out;
+}
+
+// Ends the expression being compiled with a HALT, then optimizes it
+void finish_code(Context *ctx)
+{
+    ctx->result_type = buf_end(ctx->emit_stack)[-1].type;
+    emit_op(ctx, HALT);
+    if (ctx->backend == BACKEND_STACK && ctx->peephole_enabled) {
+        peephole_code(ctx);
+    }
+}
+
+typedef struct NodeEntry {
+    uint32_t gen;
+    NodeId id;
+} NodeEntry;
+
+bool is_leaf(const Node *node)
+{
+    return node->op == LIT64 || node->op == LITF || node->op == LOAD;
+}
+
+// What an operand adds to the hash of an op on it. Leaves are never shared,
+// since a copy costs as much as recomputing them, so they count by value.
+u64 arg_key(const Context *ctx, NodeId id)
+{
+    const Node *arg = &ctx->nodes[id];
+    if (!is_leaf(arg)) {
+        return id;
+    }
+    return (arg->op == LOAD ? (u64)arg->slot : (u64)arg->val) * 0x100000001b3ull + arg->op;
+}
+
+u64 node_hash(const Context *ctx, const Node *node)
+{
+    u64 key = arg_key(ctx, node->args[0]);
+    if (instr_info[node->op].pops == 2) {
+        key = key * 0x100000001b3ull + arg_key(ctx, node->args[1]);
+    }
+    u64 hash = (key + node->op * 0x100000001b3ull) * 0x9e3779b97f4a7c15ull;
+    return hash ^ hash >> 29;
+}
+
+bool arg_equal(const Context *ctx, NodeId a, NodeId b)
+{
+    const Node *x = &ctx->nodes[a], *y = &ctx->nodes[b];
+    return a == b || (is_leaf(x) && x->op == y->op &&
+                      (x->op == LOAD ? x->slot == y->slot : x->val == y->val));
+}
+
+// Whether two ops compute the same value
+bool node_equal(const Context *ctx, const Node *a, const Node *b)
+{
+    return a->op == b->op && arg_equal(ctx, a->args[0], b->args[0]) &&
+           (instr_info[a->op].pops < 2 || arg_equal(ctx, a->args[1], b->args[1]));
+}
+
+// Finds the slot of node in the table, which is either the entry for an equal
+// node or the empty one to insert it at
+NodeEntry *find_node_entry(Context *ctx, const Node *node)
+{
+    uint32_t mask = ctx->node_table_cap - 1;
+    for (uint32_t i = node_hash(ctx, node) & mask;; i = (i + 1) & mask) {
+        NodeEntry *entry = &ctx->node_table[i];
+        if (entry->gen != ctx->node_gen || node_equal(ctx, &ctx->nodes[entry->id], node)) {
+            return entry;
+        }
+    }
+}
+
+void grow_node_table(Context *ctx)
+{
+    NodeEntry *old = ctx->node_table;
+    uint32_t old_cap = ctx->node_table_cap;
+    ctx->node_table_cap = old_cap ? 2 * old_cap : 256;
+    ctx->node_table = xcalloc(ctx->node_table_cap, sizeof(NodeEntry));
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (old[i].gen == ctx->node_gen) {
+            *find_node_entry(ctx, &ctx->nodes[old[i].id]) = old[i];
+        }
+    }
+    free(old);
+}
+
+// Starts a new expression for add_node to find repeats in
+void begin_tree(Context *ctx)
+{
+    ctx->tree_in_order = true;
+    ctx->node_table_len = 0;
+    if (++ctx->node_gen == 0) {
+        // Entries from 2^32 expressions ago would look current
+        memset(ctx->node_table, 0, ctx->node_table_cap * sizeof(NodeEntry));
+        ctx->node_gen = 1;
+    }
+}
+
+// Adds an op to the tree unless an equal one is already in the expression, in
+// which case that one is marked shared and returned
+NodeId add_shared_node(Context *ctx, Node node)
+{
+    if (2 * (ctx->node_table_len + 1) > ctx->node_table_cap) {
+        grow_node_table(ctx);
+    }
+    NodeEntry *entry = find_node_entry(ctx, &node);
+    if (entry->gen == ctx->node_gen) {
+        ctx->nodes[entry->id].shared = true;
+        ctx->tree_in_order = false;
+        return entry->id;
+    }
+    NodeId id = buf_len(ctx->nodes);
+    buf_push(ctx->nodes, node);
+    *entry = (NodeEntry){ ctx->node_gen, id };
+    ctx->node_table_len++;
+    return id;
+}
+
+// Adds node to the tree, or with cse_active returns the equal op already in
+// the expression. Inlined, since the parser calls it for every node.
+static inline NodeId add_node(Context *ctx, Node node)
+{
+    NodeId id = buf_len(ctx->nodes);
+    if (node.op == I2F && node.args[0] != id - 1) {
+        ctx->tree_in_order = false;
+    }
+    if (ctx->cse_active && !is_leaf(&node)) {
+        return add_shared_node(ctx, node);
+    }
+    buf_push(ctx->nodes, node);
+    return id;
+}
+
+NodeId parse_primary(Context *ctx)
+{
+    NodeId id;
+    if (is_token(ctx, TOKEN_INT)) {
+        id = add_node(ctx, (Node){ .op = LIT64, .val = ctx->token.int_val });
+    } else if (is_token(ctx, TOKEN_FLOAT)) {
+        f64 val = ctx->token.float_val;
+        Node node = { .op = LITF, .type = TYPE_FLOAT, .val = word_from_f64(val) };
+        id = add_node(ctx, node);
+    } else if (is_token(ctx, TOKEN_NAME)) {
+        id = add_node(ctx, (Node){ .op = LOAD, .slot = input_slot(ctx, ctx->token.name) });
+    } else {
+        fatal("expected number, name or (, got \"%s\"", token_kind_name(ctx->token.kind));
+    }
+    advance_token(ctx);
+    return id;
+}
+
+// Adds the node for the int op on args, or for the float op if an argument is
+// a float, converting the int ones
+NodeId add_op_node(Context *ctx, byte op, NodeId left, NodeId right)
+{
+    static const byte float_ops[] = {
+        [ADDI] = ADDF, [SUBI] = SUBF, [MULI] = MULF, [DIVI] = DIVF, [NEGI] = NEGF,
+    };
+    NodeId args[2] = { left, right };
+    int num_args = instr_info[op].pops;
+    Type type = TYPE_INT;
+    for (int i = 0; i < num_args; i++) {
+        type = MAX(type, ctx->nodes[args[i]].type);
+    }
+    if (type == TYPE_FLOAT) {
+        op = float_ops[op];
+        for (int i = 0; i < num_args; i++) {
+            if (ctx->nodes[args[i]].type == TYPE_INT) {
+                Node convert = { .op = I2F, .type = TYPE_FLOAT, .args = { args[i] } };
+                args[i] = add_node(ctx, convert);
+            }
+        }
+    }
+    return add_node(ctx, (Node){ .op = op, .type = type, .args = { args[0], args[1] } });
+}
+
+void push_parse_frame(Context *ctx, ParseFrame frame)
+{
+    buf_push(ctx->parse_stack, frame);
+}
+
+// Parses an expression into a tree and returns its root. It climbs precedence
+// with an explicit stack of pending operators and parentheses, so a literal
+// costs no nested calls and machine-generated nesting can't overflow the C
+// stack. Each turn of the outer loop parses one operand: it pushes the prefix
+// operators and '(' in front of it, then applies the pending operators that
+// bind tighter than the infix operator after it.
+NodeId parse_tree(Context *ctx)
+{
+    begin_tree(ctx);
+    size_t base = buf_len(ctx->parse_stack);
+    for (;;) {
+        for (;;) {
+            ParseOp prefix = token_op(ctx, prefix_ops);
+            if (prefix.bp) {
+                push_parse_frame(ctx, (ParseFrame){ .kind = FRAME_PREFIX, .op = prefix });
+            } else if (is_token(ctx, '(')) {
+                push_parse_frame(ctx, (ParseFrame){ .kind = FRAME_PAREN });
+            } else {
+                break;
+            }
+            advance_token(ctx);
+        }
+        NodeId id = parse_primary(ctx);
+        for (;;) {
+            ParseOp infix = token_op(ctx, infix_ops);
+            ParseFrame *top =
+                buf_len(ctx->parse_stack) > base ? buf_end(ctx->parse_stack) - 1 : NULL;
+            if (infix.bp > (top ? top->op.bp : BP_NONE)) {
+                advance_token(ctx);
+                push_parse_frame(
+                    ctx, (ParseFrame){ .kind = FRAME_INFIX, .op = infix, .left = id });
+                break;
+            }
+            if (!top) {
+                return id;
+            }
+            if (top->kind == FRAME_PAREN) {
+                expect_token(ctx, ')');
+            } else if (top->kind == FRAME_INFIX) {
+                id = add_op_node(ctx, top->op.op, top->left, id);
+            } else if (top->op.op != NUM_OPS) {
+                id = add_op_node(ctx, top->op.op, id, 0);
+            }
+            buf__len(ctx->parse_stack)--;
+        }
+    }
+}
+
+// Emits a literal or input node and returns true, or returns false for an op
+bool lower_leaf(Context *ctx, const Node *node)
+{
+    if (node->op == LIT64 || node->op == LITF) {
+        emit_lit(ctx, node->val, node->op == LITF ? TYPE_FLOAT : TYPE_INT);
+    } else if (node->op == LOAD) {
+        emit_load(ctx, node->slot);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Emits the code for node id and whatever it uses that isn't hoisted, walking
+// the DAG with an explicit stack. A hoisted value is copied, unless it's too
+// far down the stack for PICK to reach, in which case it's recomputed.
+void lower_node(Context *ctx, NodeId first, NodeId id)
+{
+    const NodeId operands_done = 1u << 31;
+    size_t base = buf_len(ctx->lower_stack);
+    buf_push(ctx->lower_stack, id);
+    while (buf_len(ctx->lower_stack) > base) {
+        NodeId entry = ctx->lower_stack[--buf__len(ctx->lower_stack)];
+        const Node *node = &ctx->nodes[entry & ~operands_done];
+        if (entry & operands_done) {
+            emit_op(ctx, node->op);
+            continue;
+        }
+        int32_t slot = ctx->lower_slots[entry - first];
+        size_t distance = buf_len(ctx->emit_stack) - 1 - slot;
+        if (slot >= 0 && (ctx->backend != BACKEND_STACK || distance <= UINT8_MAX)) {
+            emit_pick(ctx, slot);
+        } else if (!lower_leaf(ctx, node)) {
+            buf_push(ctx->lower_stack, entry | operands_done);
+            for (int i = instr_info[node->op].pops - 1; i >= 0; i--) {
+                buf_push(ctx->lower_stack, node->args[i]);
+            }
+        }
+    }
+}
+
+// Compiles the tree of root, nodes[first..root], just parsed by parse_tree,
+// through the emitter. A tree is in post order, so visiting its range in order
+// visits operands before the ops that use them, the order stack code needs.
+// That breaks where the left operand of a float op is converted, since its I2F
+// is only added after the right operand, so such a tree is walked like a DAG.
+// A DAG first computes each op with more than one use once, operands first,
+// leaving the values at the bottom of the stack for the uses to copy, and
+// drops them once the root is computed.
+void lower_tree(Context *ctx, NodeId first, NodeId root)
+{
+    if (ctx->tree_in_order) {
+        for (NodeId id = first; id <= root; id++) {
+            if (!lower_leaf(ctx, &ctx->nodes[id])) {
+                emit_op(ctx, ctx->nodes[id].op);
+            }
+        }
+        return;
+    }
+
+    // Count each node's uses. The slots are filled in as nodes are hoisted.
+    if (ctx->lower_slots) {
+        buf__len(ctx->lower_slots) = 0;
+    }
+    for (NodeId id = first; id <= root; id++) {
+        buf_push(ctx->lower_slots, 0);
+        const Node *node = &ctx->nodes[id];
+        for (int i = 0; i < instr_info[node->op].pops; i++) {
+            ctx->lower_slots[node->args[i] - first]++;
+        }
+    }
+    size_t base = buf_len(ctx->emit_stack);
+    for (NodeId id = first; id <= root; id++) {
+        Node *node = &ctx->nodes[id];
+        int32_t uses = ctx->lower_slots[id - first];
+        ctx->lower_slots[id - first] = -1;
+        if (uses < 2 || instr_info[node->op].pops == 0) {
+            continue;
+        }
+        lower_node(ctx, first, id);
+        EmitSlot *top = buf_end(ctx->emit_stack) - 1;
+        if (top->is_const) {
+            // It folded, so its uses can take the literal instead
+            if (ctx->backend == BACKEND_STACK) {
+                buf__len(ctx->code) = top->start;
+            }
+            byte op = top->type == TYPE_FLOAT ? LITF : LIT64;
+            *node = (Node){ .op = op, .shared = true, .type = top->type, .val = top->val };
+            buf__len(ctx->emit_stack)--;
+        } else {
+            ctx->lower_slots[id - first] = buf_len(ctx->emit_stack) - 1;
+        }
+    }
+    lower_node(ctx, first, root);
+    emit_slide(ctx, buf_len(ctx->emit_stack) - 1 - base);
+}
+
+// The value of the tree of root, computed like vm_run would, as a word. Integer
+// division by zero yields 0 here and fails at run time, and inputs count as 0.
+int64_t eval_tree(Context *ctx, NodeId first, NodeId root)
+{
+    int64_t *vals = xmalloc((root - first + 1) * sizeof(int64_t));
+    for (NodeId id = first; id <= root; id++) {
+        const Node *node = &ctx->nodes[id];
+        int64_t val = 0;
+        if (node->op == LIT64 || node->op == LITF) {
+            val = node->val;
+        } else if (node->op != LOAD) {
+            int64_t args[2];
+            Type types[2];
+            for (int i = 0; i < instr_info[node->op].pops; i++) {
+                args[i] = vals[node->args[i] - first];
+                types[i] = ctx->nodes[node->args[i]].type;
+            }
+            eval_op(node->op, args, types, &val);
+        }
+        vals[id - first] = val;
+    }
+    int64_t val = vals[root - first];
+    free(vals);
+    return val;
+}
+
+// Parses an expression and emits its code
+void parse_expr(Context *ctx)
+{
+    NodeId first = buf_len(ctx->nodes);
+    lower_tree(ctx, first, parse_tree(ctx));
+}
+
+// Parses and emits str, and returns its value as eval_tree computes it
+int64_t parse_expr_str(Context *ctx, const char *str)
+{
+    init_stream(ctx, str);
+    NodeId first = buf_len(ctx->nodes);
+    NodeId root = parse_tree(ctx);
+    lower_tree(ctx, first, root);
+    return eval_tree(ctx, first, root);
+}
+
+// The word and type of the value of a C expression, which computes like the
+// same expression does here, for comparing with it
+#define c_word(x) _Generic((x), double: word_from_f64(x), default: (int64_t)(x))
+#define c_type(x) _Generic((x), double: TYPE_FLOAT, default: TYPE_INT)
+
+#define assert_expr(x) assert(parse_expr_str(ctx, #x) == c_word(x))
+
+void parse_test(void)
+{
+    Context *ctx = context_new();
+    // clang-format off
+    assert_expr(1);
+    assert_expr(-1);
+    assert_expr(1);
+    assert_expr(-1);
+    assert_expr(1-(-1));
+    assert_expr((1));
+    assert_expr(1-2-3);
+    assert_expr(2*3+4*5);
+    assert_expr(2+-3);
+    assert_expr(2*(3+4)*5);
+    assert_expr(8/2/2);
+    assert_expr(1-2*3-4/2*5);
+    assert_expr(-2*3+-4*-5);
+    assert_expr(+-+1);
+    assert_expr(1.5);
+    assert_expr(1.5*2-1);
+    assert_expr(7/2+0.5);
+    assert_expr(-(1/4.0)*-2);
+    assert_expr(1/3.0-1/3);
+    // clang-format on
+
+    // Trees are in post order, and operands are indexes of earlier nodes
+    reset_code(ctx);
+    init_stream(ctx, "a - -2 * (b + 1)");
+    static const Node tree[] = {
+        { LOAD, .slot = 0 },        { LIT64, .val = 2 },         { NEGI, .args = { 1 } },
+        { LOAD, .slot = 1 },        { LIT64, .val = 1 },         { ADDI, .args = { 3, 4 } },
+        { MULI, .args = { 2, 5 } }, { SUBI, .args = { 0, 6 } },
+    };
+    enum { TREE_SIZE = sizeof(tree) / sizeof(*tree) };
+    assert(parse_tree(ctx) == TREE_SIZE - 1 && buf_len(ctx->nodes) == TREE_SIZE);
+    for (int i = 0; i < TREE_SIZE; i++) {
+        const Node *node = &ctx->nodes[i];
+        assert(node->op == tree[i].op);
+        if (node->op == LIT64) {
+            assert(node->val == tree[i].val);
+        } else if (node->op == LOAD) {
+            assert(node->slot == tree[i].slot);
+        } else {
+            for (int j = 0; j < instr_info[node->op].pops; j++) {
+                assert(node->args[j] == tree[i].args[j]);
+            }
+        }
+    }
+    assert(eval_tree(ctx, 0, TREE_SIZE - 1) == 0 - -2 * (0 + 1));
+
+    // Nesting is bounded by memory rather than the C stack
+    enum { DEPTH = 1000000 };
+    char *deep = xmalloc(3 * DEPTH + 2);
+    memset(deep, '(', DEPTH);
+    deep[DEPTH] = '7';
+    memset(deep + DEPTH + 1, ')', DEPTH);
+    deep[2 * DEPTH + 1] = 0;
+    assert(parse_expr_str(ctx, deep) == 7);
+    for (int i = 0; i < DEPTH; i++) {
+        memcpy(deep + 2 * i, "-(", 2);
+    }
+    deep[2 * DEPTH] = '7';
+    memset(deep + 2 * DEPTH + 1, ')', DEPTH);
+    deep[3 * DEPTH + 1] = 0;
+    assert(parse_expr_str(ctx, deep) == 7);
+    free(deep);
+    context_free(ctx);
+}
+
+#undef assert_expr
+
+char *gen_expr(char *ptr, int depth)
+{
+    static const char ops[] = "+-*/";
+    if (depth == 0 || rng_next() % 4 == 0) {
+        return ptr + sprintf(ptr, "%d", (int)(rng_next() % 100));
+    }
+    if (rng_next() % 8 == 0) {
+        *ptr++ = '-';
+        return gen_expr(ptr, depth - 1);
+    }
+    *ptr++ = '(';
+    ptr = gen_expr(ptr, depth - 1);
+    char op = ops[rng_next() % 4];
+    ptr += sprintf(ptr, " %c ", op);
+    if (op == '/') {
+        // keep divisors nonzero
+        ptr += sprintf(ptr, "%d", 1 + (int)(rng_next() % 9));
+    } else {
+        ptr = gen_expr(ptr, depth - 1);
+    }
+    *ptr++ = ')';
+    return ptr;
+}
+
+// Builds ';'-separated random expressions of nesting depth up to max_depth
+char *gen_expr_corpus(size_t size, int max_depth)
+{
+    char *buf = xmalloc(size + (64 << max_depth));
+    char *ptr = buf;
+    while (ptr < buf + size) {
+        ptr = gen_expr(ptr, max_depth);
+        ptr += sprintf(ptr, ";\n");
+    }
+    *ptr = 0;
+    return buf;
+}
+
+// Parses every expression in the source, discarding the code after each one.
+// With trees_only it stops at the trees and emits no code.
+void parse_all(Context *ctx, bool trees_only)
+{
+    while (!is_token(ctx, TOKEN_EOF)) {
+        reset_code(ctx);
+        if (trees_only) {
+            parse_tree(ctx);
+        } else {
+            parse_expr(ctx);
+        }
+        if (!match_token(ctx, ';')) {
+            expect_token(ctx, TOKEN_EOF);
+        }
+    }
+}
+
+void parse_bench()
+{
+    enum { SIZE = 16 * 1024 * 1024, RUNS = 5 };
+    Context *ctx = context_new();
+    char *src = gen_expr_corpus(SIZE, 6);
+    const char *end = src + strlen(src);
+    f64 stream_best = INFINITY, lex_best = INFINITY, parse_best = INFINITY;
+    f64 tree_best = INFINITY;
+    size_t num_tokens = 0;
+    for (int run = 0; run < RUNS; run++) {
+        f64 t0 = now_seconds();
+        init_stream_range(ctx, src, end);
+        parse_all(ctx, false);
+        f64 t1 = now_seconds();
+        TokenStream ts;
+        lex_tokens(ctx, &ts, src, end);
+        f64 t2 = now_seconds();
+        init_tokens(ctx, &ts);
+        parse_all(ctx, false);
+        f64 t3 = now_seconds();
+        init_tokens(ctx, &ts);
+        parse_all(ctx, true);
+        init_tokens(ctx, NULL);
+        f64 t4 = now_seconds();
+        num_tokens = buf_len(ts.kinds);
+        free_tokens(&ts);
+        stream_best = MIN(stream_best, t1 - t0);
+        lex_best = MIN(lex_best, t2 - t1);
+        parse_best = MIN(parse_best, t3 - t2);
+        tree_best = MIN(tree_best, t4 - t3);
+    }
+    f64 mtokens = num_tokens / 1e6;
+    printf("parse streaming: %.1f Mtokens/s\n", mtokens / stream_best);
+    printf(
+        "parse prelexed : lex %.1f Mtokens/s, parse %.1f Mtokens/s", mtokens / lex_best,
+        mtokens / parse_best);
+    printf(
+        " (%zu bytes/token, Token is %zu)\n",
+        sizeof(byte) + 2 * sizeof(uint32_t) + sizeof(TokenVal), sizeof(Token));
+    printf("parse trees    : %.1f Mtokens/s, without lowering them\n", mtokens / tree_best);
+    free(src);
+    context_free(ctx);
+}
+
+// Checks once that code[0..len) can run without per-instruction checks: all
+// opcodes are valid, no operand is cut off, no instruction pops more than is
+// on the stack, every LOAD names one of num_inputs inputs, every PICK copies a
+// value that's on the stack, no DIVK divides by 0 or -1, and it ends in a HALT
+// that pops the only value left. Returns NULL and the maximum stack depth on
+// success, or an error message.
+const char *vm_verify(const byte *code, size_t len, int num_inputs, int *max_depth)
+{
+    int depth = 0;
+    *max_depth = 0;
+    for (size_t offset = 0; offset < len;) {
+        byte op = code[offset];
+        if (op >= NUM_OPS) {
+            return "illegal opcode";
+        }
+        if (instr_info[op].size > len - offset) {
+            return "truncated operand";
+        }
+        if (op == LOAD && code[offset + 1] >= num_inputs) {
+            return "input out of range";
+        }
+        if (op == PICK && code[offset + 1] >= depth) {
+            return "pick out of range";
+        }
+        if (op == DIVK) {
+            int64_t divisor = read_imm(code + offset + 1, 1);
+            if (divisor == 0 || divisor == -1) {
+                return "DIVK by 0 or -1";
+            }
+        }
+        depth -= instr_info[op].pops + (op == SLIDE ? code[offset + 1] : 0);
+        if (depth < 0) {
+            return "stack underflow";
+        }
+        depth += instr_info[op].pushes;
+        *max_depth = MAX(*max_depth, depth);
+        offset += instr_info[op].size;
+        if (op == HALT) {
+            if (depth != 0) {
+                return "values left on the stack at HALT";
+            }
+            if (offset != len) {
+                return "code after HALT";
+            }
+            return NULL;
+        }
+    }
+    return "missing HALT";
+}
+
+#define PUSH(x) (*top++ = (x))
+#define POP() (*--top)
+
+// The interpreter loop is written once against VM_CASE/VM_NEXT. With GCC or
+// Clang each handler ends in its own indirect jump through a 256-entry label
+// table (direct threading), which predicts better than one shared switch jump
+// and needs no opcode range check. Build with -DVM_SWITCH for the portable
+// switch loop.
+#if defined(__GNUC__) && !defined(VM_SWITCH)
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+
+const char *vm_dispatch_name = VM_THREADED ? "threaded" : "switch";
+
+// GCC merges identical handler tails, indirect jump and all, which makes those
+// handlers share one jump and its prediction again
+#if VM_THREADED && !defined(__clang__)
+#define VM_OWN_TAILS __attribute__((optimize("no-crossjumping")))
+#else
+#define VM_OWN_TAILS
+#endif
+
+#if VM_THREADED
+#define VM_CASE(op) op_##op:
+#define VM_DEFAULT op_ILLEGAL:
+#define VM_NEXT() goto *dispatch[*code++]
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+#else
+#define VM_CASE(op) case op:
+#define VM_DEFAULT default:
+#define VM_NEXT() break
+#endif
+
+// Runs code that passed vm_verify on a stack of at least max_depth slots
+VM_OWN_TAILS int64_t vm_run(const byte *code, int64_t *stack, const int64_t *inputs)
+{
+    int64_t *top = stack;
+#if VM_THREADED
+    static const void *dispatch[256] = {
+        [0 ... 255] = &&op_ILLEGAL,
+        [ADDI] = &&op_ADDI,
+        [SUBI] = &&op_SUBI,
+        [MULI] = &&op_MULI,
+        [DIVI] = &&op_DIVI,
+        [NEGI] = &&op_NEGI,
+        [ADDF] = &&op_ADDF,
+        [SUBF] = &&op_SUBF,
+        [MULF] = &&op_MULF,
+        [DIVF] = &&op_DIVF,
+        [NEGF] = &&op_NEGF,
+        [I2F] = &&op_I2F,
+        [ADD] = &&op_ADD,
+        [SUB] = &&op_SUB,
+        [MUL] = &&op_MUL,
+        [DIV] = &&op_DIV,
+        [NEG] = &&op_NEG,
+        [LOAD] = &&op_LOAD,
+        [PICK] = &&op_PICK,
+        [SLIDE] = &&op_SLIDE,
+        [LIT0] = &&op_LIT0,
+        [LIT1] = &&op_LIT1,
+        [LIT8] = &&op_LIT8,
+        [LIT16] = &&op_LIT16,
+        [LIT32] = &&op_LIT32,
+        [LIT64] = &&op_LIT64,
+        [LITF] = &&op_LITF,
+        [ADDK] = &&op_ADDK,
+        [MULK] = &&op_MULK,
+        [DIVK] = &&op_DIVK,
+        [HALT] = &&op_HALT,
+    };
+    VM_NEXT();
+#else
+    for (;;)
+        switch (*code++)
+#endif
+    {
+        VM_CASE(ADDI)
+        {
+            uint64_t right = POP();
+            uint64_t left = POP();
+            PUSH((int64_t)(left + right));
+            VM_NEXT();
+        }
+        VM_CASE(SUBI)
+        {
+            uint64_t right = POP();
+            uint64_t left = POP();
+            PUSH((int64_t)(left - right));
+            VM_NEXT();
+        }
+        VM_CASE(MULI)
+        {
+            uint64_t right = POP();
+            uint64_t left = POP();
+            PUSH((int64_t)(left * right));
+            VM_NEXT();
+        }
+        VM_CASE(DIVI)
+        {
+            int64_t right = POP();
+            int64_t left = POP();
+            if (right == 0) {
+                fatal("vm_exec: division by zero");
+            }
+            // INT64_MIN / -1 overflows; wrap like the other operators
+            PUSH(right == -1 ? (int64_t)(0 - (uint64_t)left) : left / right);
+            VM_NEXT();
+        }
+        VM_CASE(NEGI)
+        {
+            uint64_t right = POP();
+            PUSH((int64_t)(0 - right));
+            VM_NEXT();
+        }
+        VM_CASE(ADDF)
+        {
+            f64 right = f64_from_word(POP());
+            f64 left = f64_from_word(POP());
+            PUSH(word_from_f64(left + right));
+            VM_NEXT();
+        }
+        VM_CASE(SUBF)
+        {
+            f64 right = f64_from_word(POP());
+            f64 left = f64_from_word(POP());
+            PUSH(word_from_f64(left - right));
+            VM_NEXT();
+        }
+        VM_CASE(MULF)
+        {
+            f64 right = f64_from_word(POP());
+            f64 left = f64_from_word(POP());
+            PUSH(word_from_f64(left * right));
+            VM_NEXT();
+        }
+        VM_CASE(DIVF)
+        {
+            f64 right = f64_from_word(POP());
+            f64 left = f64_from_word(POP());
+            PUSH(word_from_f64(left / right));
+            VM_NEXT();
+        }
+        VM_CASE(NEGF)
+        {
+            top[-1] ^= INT64_MIN; // flip the sign bit
+            VM_NEXT();
+        }
+        VM_CASE(I2F)
+        {
+            top[-1] = word_from_f64((f64)top[-1]);
+            VM_NEXT();
+        }
+        // The generic ops choose between the int and float op, and whether to
+        // convert each operand, every time they run
+        VM_CASE(ADD)
+        {
+            uint64_t right = POP();
+            uint64_t left = POP();
+            byte floats = *code++;
+            if (floats) {
+                f64 fleft = word_to_f64(left, !(floats & 1));
+                f64 fright = word_to_f64(right, !(floats & 2));
+                PUSH(word_from_f64(fleft + fright));
+            } else {
+                PUSH((int64_t)(left + right));
+            }
+            VM_NEXT();
+        }
+        VM_CASE(SUB)
+        {
+            uint64_t right = POP();
+            uint64_t left = POP();
+            byte floats = *code++;
+            if (floats) {
+                f64 fleft = word_to_f64(left, !(floats & 1));
+                f64 fright = word_to_f64(right, !(floats & 2));
+                PUSH(word_from_f64(fleft - fright));
+            } else {
+                PUSH((int64_t)(left - right));
+            }
+            VM_NEXT();
+        }
+        VM_CASE(MUL)
+        {
+            uint64_t right = POP();
+            uint64_t left = POP();
+            byte floats = *code++;
+            if (floats) {
+                f64 fleft = word_to_f64(left, !(floats & 1));
+                f64 fright = word_to_f64(right, !(floats & 2));
+                PUSH(word_from_f64(fleft * fright));
+            } else {
+                PUSH((int64_t)(left * right));
+            }
+            VM_NEXT();
+        }
+        VM_CASE(DIV)
+        {
+            int64_t right = POP();
+            int64_t left = POP();
+            byte floats = *code++;
+            if (floats) {
+                f64 fleft = word_to_f64(left, !(floats & 1));
+                f64 fright = word_to_f64(right, !(floats & 2));
+                PUSH(word_from_f64(fleft / fright));
+            } else if (right == 0) {
+                fatal("vm_exec: division by zero");
+            } else {
+                PUSH(right == -1 ? (int64_t)(0 - (uint64_t)left) : left / right);
+            }
+            VM_NEXT();
+        }
+        VM_CASE(NEG)
+        {
+            uint64_t right = POP();
+            PUSH(*code++ ? (int64_t)(right ^ INT64_MIN) : (int64_t)(0 - right));
+            VM_NEXT();
+        }
+        VM_CASE(LOAD)
+        {
+            PUSH(inputs[*code++]);
+            VM_NEXT();
+        }
+        VM_CASE(PICK)
+        {
+            int64_t val = top[-1 - *code++];
+            PUSH(val);
+            VM_NEXT();
+        }
+        VM_CASE(SLIDE)
+        {
+            int64_t val = POP();
+            top -= *code++;
+            PUSH(val);
+            VM_NEXT();
+        }
+        VM_CASE(LIT8)
+        {
+            PUSH(read_imm(code, 1));
+            code += 1;
+            VM_NEXT();
+        }
+        VM_CASE(LIT16)
+        {
+            PUSH(read_imm(code, 2));
+            code += 2;
+            VM_NEXT();
+        }
+        VM_CASE(LIT32)
+        {
+            PUSH(read_imm(code, 4));
+            code += 4;
+            VM_NEXT();
+        }
+        VM_CASE(LIT64)
+        VM_CASE(LITF)
+        {
+            PUSH(read_imm(code, 8));
+            code += 8;
+            VM_NEXT();
+        }
+        VM_CASE(LIT0)
+        {
+            PUSH(0);
+            VM_NEXT();
+        }
+        VM_CASE(LIT1)
+        {
+            PUSH(1);
+            VM_NEXT();
+        }
+        VM_CASE(ADDK)
+        {
+            top[-1] = (int64_t)((uint64_t)top[-1] + (uint64_t)read_imm(code, 1));
+            code += 1;
+            VM_NEXT();
+        }
+        VM_CASE(MULK)
+        {
+            top[-1] = (int64_t)((uint64_t)top[-1] * (uint64_t)read_imm(code, 1));
+            code += 1;
+            VM_NEXT();
+        }
+        VM_CASE(DIVK)
+        {
+            top[-1] /= read_imm(code, 1);
+            code += 1;
+            VM_NEXT();
+        }
+        VM_CASE(HALT)
+        {
+            return POP();
+        }
+        VM_DEFAULT
+        {
+            // unreachable for verified code
+            fatal("vm_exec: illegal opcode");
+            return 0;
+        }
+    }
+}
+
+// Checks register code the way vm_verify checks stack code: every opcode is
+// valid, every operand is in the frame or names an input, only registers are
+// written, and it ends with its only RET.
+const char *reg_verify(
+    const byte *code, size_t len, int num_consts, int num_regs, int num_inputs)
+{
+    for (size_t offset = 0; offset < len;) {
+        byte op = code[offset];
+        if (op >= NUM_REG_OPS) {
+            return "illegal opcode";
+        }
+        if (reg_info[op].size > len - offset) {
+            return "truncated operand";
+        }
+        for (int i = 0; i < reg_info[op].num_operands; i++) {
+            const byte *pc = code + offset + 1 + 2 * i;
+            int operand = (int16_t)(pc[0] | pc[1] << 8);
+            bool is_dest = i == 0 && op != REG_RET;
+            bool is_input = i == 1 && op == REG_LOAD;
+            if (is_input ? operand < 0 || operand >= num_inputs
+                         : operand >= num_regs || operand < (is_dest ? 0 : -num_consts)) {
+                return "operand out of range";
+            }
+        }
+        offset += reg_info[op].size;
+        if (op == REG_RET) {
+            return offset == len ? NULL : "code after RET";
+        }
+    }
+    return "missing RET";
+}
+
+// Runs register code that passed reg_verify. frame points at the registers,
+// with the constants stored below it.
+int64_t reg_run(const byte *code, int64_t *frame, const int64_t *inputs)
+{
+#define R(i) frame[(int16_t)(code[2 * (i)] | code[2 * (i) + 1] << 8)]
+#define F(i) f64_from_word(R(i))
+#if VM_THREADED
+    static const void *dispatch[256] = {
+        [0 ... 255] = &&op_ILLEGAL,
+        [REG_ADDI] = &&op_REG_ADDI,
+        [REG_SUBI] = &&op_REG_SUBI,
+        [REG_MULI] = &&op_REG_MULI,
+        [REG_DIVI] = &&op_REG_DIVI,
+        [REG_NEGI] = &&op_REG_NEGI,
+        [REG_ADDF] = &&op_REG_ADDF,
+        [REG_SUBF] = &&op_REG_SUBF,
+        [REG_MULF] = &&op_REG_MULF,
+        [REG_DIVF] = &&op_REG_DIVF,
+        [REG_NEGF] = &&op_REG_NEGF,
+        [REG_I2F] = &&op_REG_I2F,
+        [REG_LOAD] = &&op_REG_LOAD,
+        [REG_RET] = &&op_REG_RET,
+    };
+    VM_NEXT();
+#else
+    for (;;)
+        switch (*code++)
+#endif
+    {
+        VM_CASE(REG_ADDI)
+        {
+            R(0) = (int64_t)((uint64_t)R(1) + (uint64_t)R(2));
+            code += 6;
+            VM_NEXT();
+        }
+        VM_CASE(REG_SUBI)
+        {
+            R(0) = (int64_t)((uint64_t)R(1) - (uint64_t)R(2));
+            code += 6;
+            VM_NEXT();
+        }
+        VM_CASE(REG_MULI)
+        {
+            R(0) = (int64_t)((uint64_t)R(1) * (uint64_t)R(2));
+            code += 6;
+            VM_NEXT();
+        }
+        VM_CASE(REG_DIVI)
+        {
+            int64_t left = R(1);
+            int64_t right = R(2);
+            if (right == 0) {
+                fatal("vm_exec: division by zero");
+            }
+            R(0) = right == -1 ? (int64_t)(0 - (uint64_t)left) : left / right;
+            code += 6;
+            VM_NEXT();
+        }
+        VM_CASE(REG_NEGI)
+        {
+            R(0) = (int64_t)(0 - (uint64_t)R(1));
+            code += 4;
+            VM_NEXT();
+        }
+        VM_CASE(REG_ADDF)
+        {
+            R(0) = word_from_f64(F(1) + F(2));
+            code += 6;
+            VM_NEXT();
+        }
+        VM_CASE(REG_SUBF)
+        {
+            R(0) = word_from_f64(F(1) - F(2));
+            code += 6;
+            VM_NEXT();
+        }
+        VM_CASE(REG_MULF)
+        {
+            R(0) = word_from_f64(F(1) * F(2));
+            code += 6;
+            VM_NEXT();
+        }
+        VM_CASE(REG_DIVF)
+        {
+            R(0) = word_from_f64(F(1) / F(2));
+            code += 6;
+            VM_NEXT();
+        }
+        VM_CASE(REG_NEGF)
+        {
+            R(0) = word_from_f64(-F(1));
+            code += 4;
+            VM_NEXT();
+        }
+        VM_CASE(REG_I2F)
+        {
+            R(0) = word_from_f64((f64)R(1));
+            code += 4;
+            VM_NEXT();
+        }
+        VM_CASE(REG_LOAD)
+        {
+            R(0) = inputs[(int16_t)(code[2] | code[3] << 8)];
+            code += 4;
+            VM_NEXT();
+        }
+        VM_CASE(REG_RET)
+        {
+            return R(0);
+        }
+        VM_DEFAULT
+        {
+            // unreachable for verified code
+            fatal("reg_exec: illegal opcode");
+            return 0;
+        }
+    }
+#undef F
+#undef R
+}
+
+#if VM_THREADED
+#pragma GCC diagnostic pop
+#endif
+#undef VM_CASE
+#undef VM_DEFAULT
+#undef VM_NEXT
+#undef VM_OWN_TAILS
+#undef PUSH
+#undef POP
+
+// Runs verified code on a stack of exactly max_depth slots
+int64_t vm_run_sized(const byte *code, int max_depth, const int64_t *inputs)
+{
+    int64_t small_stack[256];
+    int64_t *stack = max_depth <= 256 ? small_stack : xmalloc(max_depth * sizeof(int64_t));
+    int64_t result = vm_run(code, stack, inputs);
+    if (stack != small_stack) {
+        free(stack);
+    }
+    return result;
+}
+
+// Verifies and runs code[0..len), which may not use inputs
+int64_t vm_exec(const byte *code, size_t len)
+{
+    int max_depth;
+    const char *error = vm_verify(code, len, 0, &max_depth);
+    if (error) {
+        fatal("vm_exec: %s", error);
+    }
+    return vm_run_sized(code, max_depth, NULL);
+}
+
+// A compiled expression. It owns its verified stack code, so it can be
+// evaluated any number of times with different inputs while the code buffer
+// of the context that compiled it is reused for other things.
+typedef struct Program {
+    const byte *code;
+    size_t len;
+    int max_depth;
+    Type type;           // of the result
+    const char **inputs; // interned name of each input slot
+    int num_inputs;
+} Program;
+
+// Copies the stack code just finished by finish_code into a new program
+Program *finish_program(Context *ctx)
+{
+    Program *program = xmalloc(sizeof(Program));
+    program->len = buf_len(ctx->code);
+    byte *code = xmalloc(program->len);
+    memcpy(code, ctx->code, program->len);
+    program->code = code;
+    program->type = ctx->result_type;
+    program->num_inputs = buf_len(ctx->input_names);
+    program->inputs = xmalloc(MAX(program->num_inputs, 1) * sizeof(const char *));
+    memcpy(program->inputs, ctx->input_names, program->num_inputs * sizeof(const char *));
+    const char *error =
+        vm_verify(program->code, program->len, program->num_inputs, &program->max_depth);
+    if (error) {
+        fatal("compile: %s", error);
+    }
+    return program;
+}
+
+// Compiles src, a single expression whose names are inputs numbered in order
+// of first use
+Program *compile(Context *ctx, const char *src)
+{
+    Backend saved_backend = ctx->backend;
+    ctx->backend = BACKEND_STACK;
+    reset_code(ctx);
+    ctx->cse_active = ctx->cse_enabled;
+    parse_expr_str(ctx, src);
+    expect_token(ctx, TOKEN_EOF);
+    finish_code(ctx);
+    ctx->backend = saved_backend;
+    return finish_program(ctx);
+}
+
+// Slot of the named input in the array passed to program_eval, or -1 if the
+// program doesn't use it
+int program_input_slot(const Program *program, const char *name)
+{
+    name = str_intern(name);
+    for (int i = 0; i < program->num_inputs; i++) {
+        if (program->inputs[i] == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Evaluates program with inputs[slot] as the value of each input, which is an
+// int. Returns the word of the result, of type program->type.
+int64_t program_eval(const Program *program, const int64_t *inputs)
+{
+    return vm_run_sized(program->code, program->max_depth, inputs);
+}
+
+void program_free(Program *program)
+{
+    free((byte *)program->code);
+    free(program->inputs);
+    free(program);
+}
+
+// An image holds compiled programs laid out so that a mapped file can be run
+// in place. After the header come, in order:
+//
+//   ImageProgram programs[num_programs]
+//   uint32_t inputs[num_inputs]   name index of each input slot, by program
+//   uint32_t names[num_names]     offset of each distinct name in strings
+//   char strings[strings_size]    NUL-terminated names
+//   byte code[code_size]          stack code of every program
+//
+// Literals are immediates in the stack code, so there's no separate constant
+// pool. Fields are in the byte order of the machine that wrote the image; in
+// the other order the version doesn't match and the image is rejected.
+enum { IMAGE_VERSION = 4 };
+
+static const char image_magic[8] = "tyrion\0i";
+
+typedef struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_programs;
+    uint32_t num_inputs;
+    uint32_t num_names;
+    uint32_t strings_size;
+    uint32_t code_size;
+    u64 checksum; // of everything after the header
+} ImageHeader;
+
+typedef struct ImageProgram {
+    uint32_t code_offset;
+    uint32_t code_len;
+    uint32_t first_input;
+    uint32_t num_inputs;
+    uint32_t type; // of the result
+} ImageProgram;
+
+// The programs of an opened image. Their code points into the image, so they
+// must not be passed to program_free.
+typedef struct Image {
+    Program *programs;
+    int num_programs;
+    const char **inputs; // the inputs of every program, interned
+} Image;
+
+u64 image_checksum(const char *start, const char *end)
+{
+    return str_hash_range(start + sizeof(ImageHeader), end);
+}
+
+bool is_image(const char *start, const char *end)
+{
+    return (size_t)(end - start) >= sizeof(image_magic) &&
+           memcmp(start, image_magic, sizeof(image_magic)) == 0;
+}
+
+// Lays out programs as an image in a new buffer of *size bytes. Input names
+// shared between programs are stored once.
+char *image_build(Program *const *programs, int num_programs, size_t *size)
+{
+    size_t num_inputs = 0, code_size = 0;
+    for (int i = 0; i < num_programs; i++) {
+        num_inputs += programs[i]->num_inputs;
+        code_size += programs[i]->len;
+    }
+
+    // Number the distinct names with a table keyed by their interned pointer
+    size_t cap = 16;
+    while (cap < 2 * num_inputs) {
+        cap *= 2;
+    }
+    uint32_t *slots = xcalloc(cap, sizeof(uint32_t)); // name index + 1, or 0
+    const char **names = xmalloc(MAX(num_inputs, 1) * sizeof(const char *));
+    uint32_t *inputs = xmalloc(MAX(num_inputs, 1) * sizeof(uint32_t));
+    size_t num_names = 0, strings_size = 0, input = 0;
+    for (int i = 0; i < num_programs; i++) {
+        for (int j = 0; j < programs[i]->num_inputs; j++) {
+            const char *name = programs[i]->inputs[j];
+            size_t k = ((uintptr_t)name * 0x9e3779b97f4a7c15ull >> 16) & (cap - 1);
+            while (slots[k] && names[slots[k] - 1] != name) {
+                k = (k + 1) & (cap - 1);
+            }
+            if (!slots[k]) {
+                names[num_names++] = name;
+                slots[k] = num_names;
+                strings_size += strlen(name) + 1;
+            }
+            inputs[input++] = slots[k] - 1;
+        }
+    }
+    if (code_size > UINT32_MAX || strings_size > UINT32_MAX) {
+        fatal("image_build: too much code for one image");
+    }
+
+    size_t programs_offset = sizeof(ImageHeader);
+    size_t inputs_offset = programs_offset + num_programs * sizeof(ImageProgram);
+    size_t names_offset = inputs_offset + num_inputs * sizeof(uint32_t);
+    size_t strings_offset = names_offset + num_names * sizeof(uint32_t);
+    size_t code_offset = strings_offset + strings_size;
+    *size = code_offset + code_size;
+    char *image = xcalloc(1, *size);
+    ImageHeader *hdr = (ImageHeader *)image;
+    memcpy(hdr->magic, image_magic, sizeof(image_magic));
+    hdr->version = IMAGE_VERSION;
+    hdr->num_programs = num_programs;
+    hdr->num_inputs = num_inputs;
+    hdr->num_names = num_names;
+    hdr->strings_size = strings_size;
+    hdr->code_size = code_size;
+
+    ImageProgram *image_programs = (ImageProgram *)(image + programs_offset);
+    size_t code_len = 0;
+    input = 0;
+    for (int i = 0; i < num_programs; i++) {
+        image_programs[i] = (ImageProgram){
+            .code_offset = code_len,
+            .code_len = programs[i]->len,
+            .first_input = input,
+            .num_inputs = programs[i]->num_inputs,
+            .type = programs[i]->type,
+        };
+        memcpy(image + code_offset + code_len, programs[i]->code, programs[i]->len);
+        code_len += programs[i]->len;
+        input += programs[i]->num_inputs;
+    }
+    memcpy(image + inputs_offset, inputs, num_inputs * sizeof(uint32_t));
+    uint32_t *name_offsets = (uint32_t *)(image + names_offset);
+    size_t string = 0;
+    for (size_t i = 0; i < num_names; i++) {
+        name_offsets[i] = string;
+        strcpy(image + strings_offset + string, names[i]);
+        string += strlen(names[i]) + 1;
+    }
+    hdr->checksum = image_checksum(image, image + *size);
+    free(slots);
+    free(names);
+    free(inputs);
+    return image;
+}
+
+void image_close(Image *image)
+{
+    free(image->programs);
+    free(image->inputs);
+    *image = (Image){ 0 };
+}
+
+// Checks that [start, end) is an intact image whose code all verifies, and
+// fills in image with programs that run the code in place. The range must
+// stay mapped until image_close. Returns NULL on success or an error message.
+const char *image_open(Image *image, const char *start, const char *end)
+{
+    *image = (Image){ 0 };
+    size_t size = end - start;
+    if (!is_image(start, end)) {
+        return "not an image";
+    }
+    if (size < sizeof(ImageHeader)) {
+        return "truncated header";
+    }
+    if ((uintptr_t)start % _Alignof(ImageHeader) != 0) {
+        return "misaligned image";
+    }
+    const ImageHeader *hdr = (const ImageHeader *)start;
+    if (hdr->version != IMAGE_VERSION) {
+        return "unsupported version";
+    }
+    u64 programs_offset = sizeof(ImageHeader);
+    u64 inputs_offset = programs_offset + (u64)hdr->num_programs * sizeof(ImageProgram);
+    u64 names_offset = inputs_offset + (u64)hdr->num_inputs * sizeof(uint32_t);
+    u64 strings_offset = names_offset + (u64)hdr->num_names * sizeof(uint32_t);
+    u64 code_offset = strings_offset + hdr->strings_size;
+    if (code_offset + hdr->code_size != size) {
+        return "size doesn't match the header";
+    }
+    if (hdr->checksum != image_checksum(start, end)) {
+        return "checksum mismatch";
+    }
+
+    const ImageProgram *programs = (const ImageProgram *)(start + programs_offset);
+    const uint32_t *inputs = (const uint32_t *)(start + inputs_offset);
+    const uint32_t *names = (const uint32_t *)(start + names_offset);
+    const char *strings = start + strings_offset;
+    if (hdr->strings_size && strings[hdr->strings_size - 1] != 0) {
+        return "unterminated name";
+    }
+    image->inputs = xmalloc(MAX(hdr->num_inputs, 1) * sizeof(const char *));
+    for (uint32_t i = 0; i < hdr->num_inputs; i++) {
+        if (inputs[i] >= hdr->num_names || names[inputs[i]] >= hdr->strings_size) {
+            free(image->inputs);
+            return "name out of range";
+        }
+        image->inputs[i] = str_intern(strings + names[inputs[i]]);
+    }
+    image->programs = xmalloc(MAX(hdr->num_programs, 1) * sizeof(Program));
+    image->num_programs = hdr->num_programs;
+    for (uint32_t i = 0; i < hdr->num_programs; i++) {
+        const ImageProgram *it = &programs[i];
+        const char *error = NULL;
+        if ((u64)it->code_offset + it->code_len > hdr->code_size) {
+            error = "code out of range";
+        } else if ((u64)it->first_input + it->num_inputs > hdr->num_inputs) {
+            error = "inputs out of range";
+        } else if (it->num_inputs > 256) {
+            error = "too many inputs";
+        } else if (it->type > TYPE_FLOAT) {
+            error = "unknown result type";
+        }
+        Program *program = &image->programs[i];
+        program->code = (const byte *)start + code_offset + it->code_offset;
+        program->len = it->code_len;
+        program->type = it->type;
+        program->inputs = image->inputs + it->first_input;
+        program->num_inputs = it->num_inputs;
+        if (!error) {
+            error =
+                vm_verify(program->code, program->len, it->num_inputs, &program->max_depth);
+        }
+        if (error) {
+            image_close(image);
+            return error;
+        }
+    }
+    return NULL;
+}
+
+// Batch evaluation runs a program over a block of rows at once. Each
+// instruction is a loop across the block, so dispatch is paid once per block
+// instead of once per row and the loops vectorize. Lanes are unsigned so they
+// wrap like vm_run.
+enum { BATCH_LANES = 64 };
+
+typedef uint64_t Lanes[BATCH_LANES];
+
+// Divides left by right lane by lane. Returns the first lane with a zero
+// divisor, leaving left alone, or -1.
+static inline int div_lanes(uint64_t *left, const uint64_t *right)
+{
+    bool any_zero = false;
+    for (int i = 0; i < BATCH_LANES; i++) {
+        any_zero |= right[i] == 0;
+    }
+    if (any_zero) {
+        for (int i = 0;; i++) {
+            if (right[i] == 0) {
+                return i;
+            }
+        }
+    }
+    // There's no SIMD integer division, so this part stays scalar
+    for (int i = 0; i < BATCH_LANES; i++) {
+        int64_t l = left[i], r = right[i];
+        left[i] = r == -1 ? 0 - left[i] : (uint64_t)(l / r);
+    }
+    return -1;
+}
+
+static inline void int_lanes_to_f64(uint64_t *lanes)
+{
+    for (int i = 0; i < BATCH_LANES; i++) {
+        lanes[i] = word_from_f64((f64)(int64_t)lanes[i]);
+    }
+}
+
+// Runs verified code on one block. inputs[slot] points at the block's values
+// of each input. Returns the first lane that divides by zero, or -1 after
+// storing the results.
+static inline __attribute__((always_inline)) int batch_block(
+    const byte *code, Lanes *stack, const uint64_t *const *inputs, uint64_t *results)
+{
+    Lanes *top = stack; // one past the top of the stack
+    for (;; code += instr_info[*code].size) {
+        int64_t imm;
+        if (decode_lit(code, &imm)) {
+            for (int i = 0; i < BATCH_LANES; i++) {
+                top[0][i] = imm;
+            }
+            top++;
+            continue;
+        }
+        // HALT is the last byte of the code, so only read immediates that exist
+        uint64_t k = instr_info[*code].size > 1 ? read_imm(code + 1, 1) : 0;
+        byte op = *code;
+        if (is_generic_op(op)) {
+            // Types are tested once per block rather than once per lane. The
+            // int operands of a float op are converted, then it runs as the
+            // typed op.
+            int pops = instr_info[op].pops;
+            for (int j = 0; k && j < pops; j++) {
+                if (!(k >> j & 1)) {
+                    int_lanes_to_f64(top[j - pops]);
+                }
+            }
+            op = typed_op(op, k);
+        }
+        switch (op) {
+            case ADDI:
+                top--;
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    top[-1][i] += top[0][i];
+                }
+                break;
+            case SUBI:
+                top--;
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    top[-1][i] -= top[0][i];
+                }
+                break;
+            case MULI:
+                top--;
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    top[-1][i] *= top[0][i];
+                }
+                break;
+            case DIVI: {
+                top--;
+                int lane = div_lanes(top[-1], top[0]);
+                if (lane >= 0) {
+                    return lane;
+                }
+                break;
+            }
+            case NEGI:
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    top[-1][i] = 0 - top[-1][i];
+                }
+                break;
+            case ADDF:
+                top--;
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    f64 left = f64_from_word(top[-1][i]), right = f64_from_word(top[0][i]);
+                    top[-1][i] = word_from_f64(left + right);
+                }
+                break;
+            case SUBF:
+                top--;
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    f64 left = f64_from_word(top[-1][i]), right = f64_from_word(top[0][i]);
+                    top[-1][i] = word_from_f64(left - right);
+                }
+                break;
+            case MULF:
+                top--;
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    f64 left = f64_from_word(top[-1][i]), right = f64_from_word(top[0][i]);
+                    top[-1][i] = word_from_f64(left * right);
+                }
+                break;
+            case DIVF:
+                top--;
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    f64 left = f64_from_word(top[-1][i]), right = f64_from_word(top[0][i]);
+                    top[-1][i] = word_from_f64(left / right);
+                }
+                break;
+            case NEGF:
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    top[-1][i] ^= 1ull << 63;
+                }
+                break;
+            case I2F:
+                int_lanes_to_f64(top[-1]);
+                break;
+            case LITF:
+                imm = read_imm(code + 1, 8);
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    top[0][i] = imm;
+                }
+                top++;
+                break;
+            case LOAD:
+                memcpy(top++, inputs[code[1]], sizeof(Lanes));
+                break;
+            case PICK:
+                memcpy(top, top[-1 - code[1]], sizeof(Lanes));
+                top++;
+                break;
+            case SLIDE:
+                memcpy(top[-1 - code[1]], top[-1], sizeof(Lanes));
+                top -= code[1];
+                break;
+            case ADDK:
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    top[-1][i] += k;
+                }
+                break;
+            case MULK:
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    top[-1][i] *= k;
+                }
+                break;
+            case DIVK:
+                for (int i = 0; i < BATCH_LANES; i++) {
+                    top[-1][i] = (int64_t)top[-1][i] / (int64_t)k;
+                }
+                break;
+            case HALT:
+                memcpy(results, top[-1], sizeof(Lanes));
+                return -1;
+            default:
+                // unreachable for verified code
+                fatal("program_eval_batch: illegal opcode");
+        }
+    }
+}
+
+typedef int (*batch_fn)(const byte *, Lanes *, const uint64_t *const *, uint64_t *);
+
+// x86-64 always has SSE2, so the portable loops already vectorize for it
+int batch_block_portable(
+    const byte *code, Lanes *stack, const uint64_t *const *inputs, uint64_t *results)
+{
+    return batch_block(code, stack, inputs, results);
+}
+
+#if HAS_X86_SIMD
+__attribute__((target("avx2"))) int batch_block_avx2(
+    const byte *code, Lanes *stack, const uint64_t *const *inputs, uint64_t *results)
+{
+    return batch_block(code, stack, inputs, results);
+}
+#endif
+
+// Evaluates program on num_rows rows: results[row] is the value with input
+// slot s set to columns[s][row]. Division by zero is fatal, and names the
+// first row that divides by zero, where evaluating row by row would fail.
+void program_eval_batch(
+    const Program *program, const int64_t *const *columns, size_t num_rows,
+    int64_t *results)
+{
+    batch_fn run = batch_block_portable;
+#if HAS_X86_SIMD
+    if (simd_level == SIMD_AVX2) {
+        run = batch_block_avx2;
+    }
+#endif
+    int num_inputs = program->num_inputs;
+    Lanes *stack = xmalloc(MAX(program->max_depth, 1) * sizeof(Lanes));
+    const uint64_t **inputs = xmalloc(MAX(num_inputs, 1) * sizeof(uint64_t *));
+    Lanes *tail = xmalloc(MAX(num_inputs, 1) * sizeof(Lanes));
+    Lanes tail_results;
+    for (size_t row = 0; row < num_rows; row += BATCH_LANES) {
+        size_t num_lanes = MIN(num_rows - row, BATCH_LANES);
+        uint64_t *out = (uint64_t *)results + row;
+        if (num_lanes == BATCH_LANES) {
+            for (int s = 0; s < num_inputs; s++) {
+                inputs[s] = (const uint64_t *)columns[s] + row;
+            }
+        } else {
+            // Pad the last block by repeating its last row, which can't fail
+            // unless that row does
+            for (int s = 0; s < num_inputs; s++) {
+                memcpy(tail[s], columns[s] + row, num_lanes * sizeof(uint64_t));
+                for (size_t i = num_lanes; i < BATCH_LANES; i++) {
+                    tail[s][i] = tail[s][num_lanes - 1];
+                }
+                inputs[s] = tail[s];
+            }
+            out = tail_results;
+        }
+        int lane = run(program->code, stack, inputs, out);
+        if (lane >= 0) {
+            // lane is where the first DIV to fail met a zero, which needn't be
+            // the first row to fail, so run the rows one at a time to find it
+            size_t bad_row = row + lane;
+            for (size_t i = 0; i < num_lanes; i++) {
+                for (int s = 0; s < num_inputs; s++) {
+                    for (int j = 0; j < BATCH_LANES; j++) {
+                        tail[s][j] = columns[s][row + i];
+                    }
+                    inputs[s] = tail[s];
+                }
+                if (run(program->code, stack, inputs, tail_results) >= 0) {
+                    bad_row = row + i;
+                    break;
+                }
+            }
+            free(stack);
+            free(inputs);
+            free(tail);
+            fatal("program_eval_batch: division by zero in row %zu", bad_row);
+        }
+        if (out == tail_results) {
+            memcpy(results + row, tail_results, num_lanes * sizeof(uint64_t));
+        }
+    }
+    free(stack);
+    free(inputs);
+    free(tail);
+}
+
+// Lays out a frame for reg_run with the constants below the registers.
+// Returns the register base; the allocation starts num_consts slots earlier.
+int64_t *reg_make_frame(const int64_t *consts, int num_consts, int num_regs)
+{
+    int64_t *frame = xmalloc((num_consts + MAX(num_regs, 1)) * sizeof(int64_t));
+    frame += num_consts;
+    for (int k = 0; k < num_consts; k++) {
+        frame[-1 - k] = consts[k];
+    }
+    return frame;
+}
+
+// Verifies and runs the register code and constants emitted since reset_code
+int64_t reg_exec(Context *ctx)
+{
+    int num_consts = buf_len(ctx->reg_consts);
+    const char *error =
+        reg_verify(ctx->reg_code, buf_len(ctx->reg_code), num_consts, ctx->reg_num_regs, 0);
+    if (error) {
+        fatal("reg_exec: %s", error);
+    }
+    int64_t *frame = reg_make_frame(ctx->reg_consts, num_consts, ctx->reg_num_regs);
+    int64_t result = reg_run(ctx->reg_code, frame, NULL);
+    free(frame - num_consts);
+    return result;
+}
+
+// x86-64 JIT for verified stack code. The top of the stack lives in rax and
+// the rest on the machine stack, so LIT is push rax; mov rax, imm and ADDI is
+// pop rcx; add rax, rcx. Float ops do the same through xmm0 and xmm1. The
+// inputs pointer arrives in rdi and stays there. Only rax, rcx, rdx, rdi, xmm0
+// and xmm1 are used, all caller-saved, and nothing is called except the
+// division by zero trap, which aligns the stack itself since it never returns.
+// Code is written to a read-write mapping that is then flipped to read-execute,
+// never both.
+#if defined(__x86_64__)
+#define JIT_ENABLED 1
+#else
+#define JIT_ENABLED 0
+#endif
+
+typedef struct JitCode {
+    int64_t (*fn)(const int64_t *inputs);
+    void *mem;
+    size_t size;
+} JitCode;
+
+void vm_div_zero(void)
+{
+    fatal("vm_exec: division by zero");
+}
+
+#define X86(...) push_bytes(&out, (byte[]){ __VA_ARGS__ }, sizeof((byte[]){ __VA_ARGS__ }))
+
+// Compiles code that passed vm_verify. Returns false if there's no JIT for
+// this machine or no executable memory, in which case use vm_run.
+bool jit_compile(const byte *code, size_t len, JitCode *jit)
+{
+    if (!JIT_ENABLED) {
+        return false;
+    }
+    byte *out = NULL;
+    uint32_t *div_zero_jumps = NULL; // offsets of rel32s to patch
+    int depth = 0;
+    for (size_t offset = 0; offset < len; offset += instr_info[code[offset]].size) {
+        const byte *pc = code + offset;
+        byte op = *pc;
+        byte ints = 0; // operands of a float op to convert
+        if (is_generic_op(op)) {
+            // Compiled as the typed op its immediate picks, so the native code
+            // doesn't test types either
+            ints = pc[1] && instr_info[op].pops == 2 ? ~pc[1] & 3 : 0;
+            op = typed_op(op, pc[1]);
+        }
+        int64_t val;
+        if (decode_lit(pc, &val)) {
+            if (depth > 0) {
+                X86(0x50); // push rax
+            }
+            if (val == 0) {
+                X86(0x31, 0xC0); // xor eax, eax
+            } else if (val >= INT32_MIN && val <= INT32_MAX) {
+                X86(0x48, 0xC7, 0xC0); // mov rax, imm32
+                push_imm(&out, val, 4);
+            } else {
+                X86(0x48, 0xB8); // mov rax, imm64
+                push_imm(&out, val, 8);
+            }
+        } else {
+            switch (op) {
+                case ADDI:
+                    X86(0x59, 0x48, 0x01, 0xC8); // pop rcx; add rax, rcx
+                    break;
+                case SUBI:
+                    // pop rcx; sub rcx, rax; mov rax, rcx
+                    X86(0x59, 0x48, 0x29, 0xC1, 0x48, 0x89, 0xC8);
+                    break;
+                case MULI:
+                    X86(0x59, 0x48, 0x0F, 0xAF, 0xC1); // pop rcx; imul rax, rcx
+                    break;
+                case DIVI:
+                    X86(0x48, 0x89, 0xC1, 0x58);             // mov rcx, rax; pop rax
+                    X86(0x48, 0x85, 0xC9, 0x0F, 0x84);       // test rcx, rcx; jz div_zero
+                    buf_push(div_zero_jumps, buf_len(out));
+                    push_imm(&out, 0, 4);
+                    X86(0x48, 0x83, 0xF9, 0xFF, 0x75, 0x05); // cmp rcx, -1; jne 1f
+                    X86(0x48, 0xF7, 0xD8, 0xEB, 0x05);       // neg rax; jmp 2f
+                    X86(0x48, 0x99, 0x48, 0xF7, 0xF9);       // 1: cqo; idiv rcx; 2:
+                    break;
+                case NEGI:
+                    X86(0x48, 0xF7, 0xD8); // neg rax
+                    break;
+                case ADDF:
+                case SUBF:
+                case MULF:
+                case DIVF: {
+                    // pop rcx; then the left operand into xmm0 and the right
+                    // into xmm1, converting ints
+                    X86(0x59);
+                    if (ints & 1) {
+                        X86(0xF2, 0x48, 0x0F, 0x2A, 0xC1); // cvtsi2sd xmm0, rcx
+                    } else {
+                        X86(0x66, 0x48, 0x0F, 0x6E, 0xC1); // movq xmm0, rcx
+                    }
+                    if (ints & 2) {
+                        X86(0xF2, 0x48, 0x0F, 0x2A, 0xC8); // cvtsi2sd xmm1, rax
+                    } else {
+                        X86(0x66, 0x48, 0x0F, 0x6E, 0xC8); // movq xmm1, rax
+                    }
+                    static const byte sse_ops[] = {
+                        [ADDF] = 0x58, [SUBF] = 0x5C, [MULF] = 0x59, [DIVF] = 0x5E,
+                    };
+                    X86(0xF2, 0x0F, sse_ops[op], 0xC1); // addsd etc. xmm0, xmm1
+                    X86(0x66, 0x48, 0x0F, 0x7E, 0xC0);  // movq rax, xmm0
+                    break;
+                }
+                case NEGF:
+                    X86(0x48, 0x0F, 0xBA, 0xF8, 0x3F); // btc rax, 63
+                    break;
+                case I2F:
+                    X86(0xF2, 0x48, 0x0F, 0x2A, 0xC0); // cvtsi2sd xmm0, rax
+                    X86(0x66, 0x48, 0x0F, 0x7E, 0xC0); // movq rax, xmm0
+                    break;
+                case LITF:
+                    if (depth > 0) {
+                        X86(0x50); // push rax
+                    }
+                    X86(0x48, 0xB8); // mov rax, imm64
+                    push_bytes(&out, pc + 1, 8);
+                    break;
+                case LOAD:
+                    if (depth > 0) {
+                        X86(0x50); // push rax
+                    }
+                    X86(0x48, 0x8B, 0x87); // mov rax, [rdi + disp32]
+                    push_imm(&out, pc[1] * sizeof(int64_t), 4);
+                    break;
+                case PICK:
+                    // The top is in rax and the rest on the machine stack
+                    X86(0x50, 0x48, 0x8B, 0x84, 0x24); // push rax; mov rax, [rsp + disp32]
+                    push_imm(&out, pc[1] * sizeof(int64_t), 4);
+                    break;
+                case SLIDE:
+                    X86(0x48, 0x81, 0xC4); // add rsp, imm32
+                    push_imm(&out, pc[1] * sizeof(int64_t), 4);
+                    break;
+                case ADDK:
+                    X86(0x48, 0x83, 0xC0, pc[1]); // add rax, imm8
+                    break;
+                case MULK:
+                    X86(0x48, 0x6B, 0xC0, pc[1]); // imul rax, rax, imm8
+                    break;
+                case DIVK:
+                    X86(0x48, 0xC7, 0xC1); // mov rcx, imm32; cqo; idiv rcx
+                    push_imm(&out, read_imm(pc + 1, 1), 4);
+                    X86(0x48, 0x99, 0x48, 0xF7, 0xF9);
+                    break;
+                case HALT:
+                    X86(0xC3); // ret
+                    break;
+                default:
+                    fatal("jit_compile: unexpected opcode %d", op);
+            }
+        }
+        depth += instr_info[op].pushes - instr_info[op].pops - (op == SLIDE ? pc[1] : 0);
+    }
+    if (buf_len(div_zero_jumps)) {
+        uint32_t target = buf_len(out);
+        for (size_t i = 0; i < buf_len(div_zero_jumps); i++) {
+            uint32_t at = div_zero_jumps[i];
+            uint32_t rel = target - (at + 4);
+            memcpy(out + at, (byte[]){ rel, rel >> 8, rel >> 16, rel >> 24 }, 4);
+        }
+        X86(0x48, 0xB8); // mov rax, vm_div_zero; and rsp, -16; call rax
+        push_imm(&out, (uintptr_t)vm_div_zero, 8);
+        X86(0x48, 0x83, 0xE4, 0xF0, 0xFF, 0xD0);
+    }
+    jit->size = buf_len(out);
+    jit->mem = mmap(
+        NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool ok = jit->mem != MAP_FAILED;
+    if (ok) {
+        memcpy(jit->mem, out, jit->size);
+        ok = mprotect(jit->mem, jit->size, PROT_READ | PROT_EXEC) == 0;
+        if (!ok) {
+            munmap(jit->mem, jit->size);
+        }
+    }
+    // ISO C has no object to function pointer conversion; POSIX guarantees it works
+    memcpy(&jit->fn, &jit->mem, sizeof(jit->fn));
+    buf_free(out);
+    buf_free(div_zero_jumps);
+    return ok;
+}
+
+#undef X86
+
+void jit_free(JitCode *jit)
+{
+    munmap(jit->mem, jit->size);
+}
+
+// Verifies code and runs it natively, or on vm_run if it can't be compiled
+int64_t jit_exec(const byte *code, size_t len)
+{
+    int max_depth;
+    const char *error = vm_verify(code, len, 0, &max_depth);
+    if (error) {
+        fatal("jit_exec: %s", error);
+    }
+    JitCode jit;
+    if (!jit_compile(code, len, &jit)) {
+        return vm_exec(code, len);
+    }
+    int64_t result = jit.fn(NULL);
+    jit_free(&jit);
+    return result;
+}
+
+// A C translation unit built into a shared object and loaded
+typedef struct CModule {
+    void *handle;
+    int64_t (**fns)(const int64_t *in); // ion_expr_<n> for each expression
+} CModule;
+
+// Number of times c_build ran the compiler instead of reusing a cached build
+static atomic_int c_num_builds;
+
+void c_unload(CModule *module)
+{
+    dlclose(module->handle);
+    buf_free(module->fns);
+}
+
+// Whether the source at src_path is exactly c_unit, so the build next to it
+// can be reused. Comparing the whole source rules out hash collisions.
+bool c_cached(Context *ctx, const char *src_path, const char *so_path)
+{
+    mapped_file_t src;
+    if (access(so_path, R_OK) != 0 || !map_file(src_path, &src)) {
+        return false;
+    }
+    size_t len = buf_len(ctx->c_unit);
+    bool same =
+        (size_t)(src.end - src.start) == len && memcmp(src.start, ctx->c_unit, len) == 0;
+    unmap_file(&src);
+    return same;
+}
+
+// Compiles c_unit to so_path and saves its source at src_path. Both go through
+// temporary files and are published atomically, the build first, so
+// concurrent runs never load a partial file or trust a source without its build.
+bool c_compile(Context *ctx, const char *src_path, const char *so_path)
+{
+    char *tmp_src = write_temp_file(ctx->c_unit, buf_len(ctx->c_unit));
+    char tmp_so[PATH_MAX + 32];
+    snprintf(tmp_so, sizeof(tmp_so), "%s.so", tmp_src);
+    char *argv[] = {
+        "cc", "-O2", "-shared", "-fPIC", "-x", "c", "-o", tmp_so, tmp_src, NULL,
+    };
+    bool ok = run_command(argv) && rename(tmp_so, so_path) == 0 &&
+              rename(tmp_src, src_path) == 0;
+    if (!ok) {
+        fprintf(stderr, "c_build: compiling %s failed\n", tmp_src);
+        unlink(tmp_so);
+        unlink(tmp_src);
+    }
+    free(tmp_src);
+    return ok;
+}
+
+// Looks up a symbol the generated code must define, saying so if it doesn't
+void *c_symbol(CModule *module, const char *so_path, const char *name)
+{
+    void *sym = dlsym(module->handle, name);
+    if (!sym) {
+        fprintf(stderr, "c_build: %s has no %s\n", so_path, name);
+    }
+    return sym;
+}
+
+// Builds c_unit with the system compiler and loads it. Builds are cached in
+// cache_dir by the hash of the generated source (which names the compiler
+// flags), next to a copy of the source that must match before a build is
+// reused, so a program is only compiled once. Returns false, after saying
+// why, if the compiler or loader fails.
+bool c_build(Context *ctx, CModule *module)
+{
+    char dir[PATH_MAX];
+    if (!cache_dir(dir, sizeof(dir))) {
+        fprintf(stderr, "c_build: no private cache directory: %s\n", strerror(errno));
+        return false;
+    }
+    unsigned long long hash = str_hash_range(ctx->c_unit, buf_end(ctx->c_unit));
+    char so_path[PATH_MAX + 32], src_path[PATH_MAX + 32];
+    snprintf(so_path, sizeof(so_path), "%s/c-%016llx.so", dir, hash);
+    snprintf(src_path, sizeof(src_path), "%s/c-%016llx.c", dir, hash);
+    if (!c_cached(ctx, src_path, so_path)) {
+        if (!c_compile(ctx, src_path, so_path)) {
+            return false;
+        }
+        c_num_builds++;
+    }
+    module->handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+    if (!module->handle) {
+        fprintf(stderr, "c_build: %s\n", dlerror());
+        return false;
+    }
+    module->fns = NULL;
+    // ISO C has no object to function pointer conversion; POSIX guarantees it works
+    void (*div_zero)(void) = vm_div_zero;
+    void *sym = c_symbol(module, so_path, "ion_div_zero");
+    if (!sym) {
+        c_unload(module);
+        return false;
+    }
+    memcpy(sym, &div_zero, sizeof(div_zero));
+    for (int i = 0; i < ctx->c_num_fns; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "ion_expr_%d", i);
+        sym = c_symbol(module, so_path, name);
+        if (!sym) {
+            c_unload(module);
+            return false;
+        }
+        int64_t (*fn)(const int64_t *in);
+        memcpy(&fn, &sym, sizeof(fn));
+        buf_push(module->fns, fn);
+    }
+    return true;
+}
+
+// Runs whatever the current backend emitted since reset_code
+int64_t exec_code(Context *ctx)
+{
+    if (ctx->backend == BACKEND_REGISTER) {
+        return reg_exec(ctx);
+    }
+    size_t len = buf_len(ctx->code);
+    return ctx->jit_enabled ? jit_exec(ctx->code, len) : vm_exec(ctx->code, len);
+}
+
+#define assert_vm(x, ...) \
+    do { \
+        byte code[] = { __VA_ARGS__ }; \
+        assert(vm_exec(code, sizeof(code)) == (x)); \
+        assert(jit_exec(code, sizeof(code)) == (x)); \
+    } while (0)
+#define assert_vm_error(error, ...) \
+    do { \
+        byte code[] = { __VA_ARGS__ }; \
+        int max_depth; \
+        const char *actual = vm_verify(code, sizeof(code), 0, &max_depth); \
+        assert(actual && strcmp(actual, (error)) == 0); \
+    } while (0)
+
+void vm_test()
+{
+    assert_vm(1, LIT1, HALT);
+    assert_vm(5, LIT8, 2, LIT8, 3, ADDI, HALT);
+    assert_vm(6, LIT1, LIT8, 2, LIT8, 3, ADDI, ADDI, HALT);
+    assert_vm(-1, LIT1, NEGI, HALT);
+    assert_vm(6, LIT8, 2, LIT8, 3, MULI, HALT);
+    assert_vm(2, LIT8, 4, LIT8, 2, DIVI, HALT);
+    assert_vm(-2, LIT8, 0xfe, HALT);
+    assert_vm(-300, LIT16, 0xd4, 0xfe, HALT);
+    assert_vm(0x12345678, LIT32, 0x78, 0x56, 0x34, 0x12, HALT);
+    assert_vm(-0x100000000, LIT64, 0, 0, 0, 0, 0xff, 0xff, 0xff, 0xff, HALT);
+    assert_vm(INT64_MIN, LIT64, 0, 0, 0, 0, 0, 0, 0, 0x80, LIT8, 0xff, DIVI, HALT);
+    assert_vm(INT64_MIN, LIT64, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f, LIT1, ADDI,
+        HALT);
+    assert_vm(-6, LIT8, 6, ADDK, 0xfd, MULK, 2, NEGI, LIT0, ADDI, HALT);
+
+    // The verifier records the exact stack depth
+    int max_depth;
+    byte code[] = { LIT1, LIT8, 2, LIT16, 3, 0, ADDI, ADDI, HALT };
+    assert(vm_verify(code, sizeof(code), 0, &max_depth) == NULL);
+    assert(max_depth == 3);
+    int64_t stack[3];
+    assert(vm_run(code, stack, NULL) == 6);
+
+    // and rejects anything vm_run can't run unchecked
+    assert_vm_error("illegal opcode", LIT1, NUM_OPS, HALT);
+    assert_vm_error("illegal opcode", 0xff);
+    assert_vm_error("truncated operand", LIT32, 1, 0, 0);
+    assert_vm_error("truncated operand", LIT64, 1, 0, 0, 0, 0, 0, 0);
+    assert_vm_error("stack underflow", LIT1, ADDI, HALT);
+    assert_vm_error("stack underflow", ADDK, 1, HALT);
+    assert_vm_error("truncated operand", LIT1, DIVK);
+    assert_vm_error("stack underflow", HALT);
+    assert_vm_error("DIVK by 0 or -1", LIT8, 7, DIVK, 0, HALT);
+    assert_vm_error("DIVK by 0 or -1", LIT1, DIVK, 0xff, HALT);
+    assert_vm_error("values left on the stack at HALT", LIT1, LIT0, HALT);
+    assert_vm_error("code after HALT", LIT1, HALT, NEGI);
+    assert_vm_error("missing HALT", LIT8, 1);
+    assert_vm_error("input out of range", LOAD, 0, HALT);
+    assert(!strcmp(vm_verify(code, 0, 0, &max_depth), "missing HALT"));
+
+    byte load[] = { LOAD, 1, LOAD, 0, SUBI, HALT };
+    assert(!strcmp(vm_verify(load, sizeof(load), 1, &max_depth), "input out of range"));
+    assert(!vm_verify(load, sizeof(load), 2, &max_depth));
+    assert(vm_run(load, stack, (int64_t[]){ 5, 7 }) == 2);
+}
+
+#undef assert_vm
+#undef assert_vm_error
+
+// Number of instructions in a register code buffer
+size_t count_reg_instrs(const byte *code, size_t len)
+{
+    size_t count = 0;
+    for (size_t offset = 0; offset < len; offset += reg_info[code[offset]].size) {
+        count++;
+    }
+    return count;
+}
+
+void reg_test()
+{
+    Context *ctx = context_new();
+    // Constants are operands, so 1 + 2 * 3 is MULI r1, k1, k2; ADDI r0, k0, r1; RET r0
+    ctx->fold_constants = false;
+    ctx->backend = BACKEND_REGISTER;
+    reset_code(ctx);
+    parse_expr_str(ctx, "1 + 2 * 3");
+    finish_code(ctx);
+    assert(count_reg_instrs(ctx->reg_code, buf_len(ctx->reg_code)) == 3);
+    assert(buf_len(ctx->reg_consts) == 3 && ctx->reg_num_regs == 2);
+    assert(reg_exec(ctx) == 7);
+
+    // Registers are reused once their value is consumed
+    reset_code(ctx);
+    parse_expr_str(ctx, "(1 + 2) * (3 + 4) - (5 + 6) * (7 + 8)");
+    finish_code(ctx);
+    assert(ctx->reg_num_regs == 3);
+    assert(reg_exec(ctx) == 21 - 165);
+
+    // A lone constant needs no registers
+    reset_code(ctx);
+    parse_expr_str(ctx, "42");
+    finish_code(ctx);
+    assert(count_reg_instrs(ctx->reg_code, buf_len(ctx->reg_code)) == 1);
+    assert(ctx->reg_num_regs == 0);
+    assert(reg_exec(ctx) == 42);
+    ctx->backend = BACKEND_STACK;
+    ctx->fold_constants = true;
+
+    byte add[] = { REG_ADDI, 0, 0, 0xff, 0xff, 0xfe, 0xff, REG_RET, 0, 0 };
+    assert(!reg_verify(add, sizeof(add), 2, 1, 0));
+    assert(!strcmp(reg_verify(add, sizeof(add), 1, 1, 0), "operand out of range"));
+    assert(!strcmp(reg_verify(add, sizeof(add), 2, 0, 0), "operand out of range"));
+    assert(!strcmp(reg_verify(add, sizeof(add) - 1, 2, 1, 0), "truncated operand"));
+    assert(!strcmp(reg_verify(add, sizeof(add) - 3, 2, 1, 0), "missing RET"));
+    byte ret_const[] = { REG_RET, 0xff, 0xff };
+    assert(!reg_verify(ret_const, sizeof(ret_const), 1, 0, 0));
+    byte write_const[] = { REG_NEGI, 0xff, 0xff, 0, 0, REG_RET, 0, 0 };
+    const char *error = reg_verify(write_const, sizeof(write_const), 1, 1, 0);
+    assert(!strcmp(error, "operand out of range"));
+    byte illegal[] = { NUM_REG_OPS };
+    assert(!strcmp(reg_verify(illegal, sizeof(illegal), 0, 0, 0), "illegal opcode"));
+    byte load[] = { REG_LOAD, 0, 0, 1, 0, REG_RET, 0, 0 };
+    assert(!reg_verify(load, sizeof(load), 0, 1, 2));
+    assert(!strcmp(reg_verify(load, sizeof(load), 0, 1, 1), "operand out of range"));
+    int64_t frame[1];
+    assert(reg_run(load, frame, (int64_t[]){ 5, 7 }) == 7);
+    context_free(ctx);
+}
+
+// Number of instructions in a straight-line code buffer
+size_t count_instrs(const byte *code, size_t len)
+{
+    size_t count = 0;
+    for (size_t offset = 0; offset < len; offset += instr_info[code[offset]].size) {
+        count++;
+    }
+    return count;
+}
+
+// Seconds per call of run(code, frame, NULL), timed over at least half a second
+f64 time_vm_run(
+    int64_t (*run)(const byte *, int64_t *, const int64_t *), const byte *code,
+    int64_t *frame)
+{
+    static volatile int64_t sink;
+    int runs = 0;
+    f64 start = now_seconds(), elapsed;
+    do {
+        for (int i = 0; i < 100; i++) {
+            sink += run(code, frame, NULL);
+        }
+        runs += 100;
+        elapsed = now_seconds() - start;
+    } while (elapsed < 0.5);
+    return elapsed / runs;
+}
+
+static JitCode bench_jit;
+
+int64_t run_bench_jit(const byte *code, int64_t *frame, const int64_t *inputs)
+{
+    return bench_jit.fn(inputs);
+}
+
+// Runs the same program on the stack and register machines and the JIT
+void vm_bench()
+{
+    enum { TERMS = 2000 };
+    Context *ctx = context_new();
+    // same program whichever benchmarks ran before
+    rng_state = 1;
+    char *src = xmalloc(TERMS * (64 << 5));
+    char *ptr = src;
+    for (int i = 0; i < TERMS; i++) {
+        ptr = gen_expr(ptr, 5);
+        ptr += sprintf(ptr, " + ");
+    }
+    sprintf(ptr, "0");
+    // The program is all constants and would fold to one literal
+    ctx->fold_constants = false;
+
+    size_t num_instrs;
+    f64 elapsed;
+    for (int peephole = 0; peephole <= 1; peephole++) {
+        ctx->peephole_enabled = peephole;
+        reset_code(ctx);
+        parse_expr_str(ctx, src);
+        finish_code(ctx);
+        num_instrs = count_instrs(ctx->code, buf_len(ctx->code));
+        int max_depth;
+        assert(!vm_verify(ctx->code, buf_len(ctx->code), 0, &max_depth));
+        int64_t *stack = xmalloc(max_depth * sizeof(int64_t));
+        elapsed = time_vm_run(vm_run, ctx->code, stack);
+        printf(
+            "vm %-8s: %.2f ns/op, %.1f us/expr (%zu instructions, %zu bytes%s)\n",
+            vm_dispatch_name, elapsed / num_instrs * 1e9, elapsed * 1e6, num_instrs,
+            buf_len(ctx->code), peephole ? ", peephole" : "");
+        free(stack);
+    }
+    if (jit_compile(ctx->code, buf_len(ctx->code), &bench_jit)) {
+        elapsed = time_vm_run(run_bench_jit, ctx->code, NULL);
+        printf(
+            "jit         : %.2f ns/op, %.1f us/expr (%zu bytes of x86-64)\n",
+            elapsed / num_instrs * 1e9, elapsed * 1e6, bench_jit.size);
+        jit_free(&bench_jit);
+    }
+
+    ctx->backend = BACKEND_REGISTER;
+    reset_code(ctx);
+    parse_expr_str(ctx, src);
+    finish_code(ctx);
+    ctx->backend = BACKEND_STACK;
+    num_instrs = count_reg_instrs(ctx->reg_code, buf_len(ctx->reg_code));
+    int num_consts = buf_len(ctx->reg_consts);
+    assert(!reg_verify(
+        ctx->reg_code, buf_len(ctx->reg_code), num_consts, ctx->reg_num_regs, 0));
+    int64_t *frame = reg_make_frame(ctx->reg_consts, num_consts, ctx->reg_num_regs);
+    elapsed = time_vm_run(reg_run, ctx->reg_code, frame);
+    printf(
+        "reg %-7s: %.2f ns/op, %.1f us/expr (%zu instructions)\n", vm_dispatch_name,
+        elapsed / num_instrs * 1e9, elapsed * 1e6, num_instrs);
+    free(frame - num_consts);
+    free(src);
+    context_free(ctx);
+}
+
+// One formula against many parameter sets, compiled once or every time
+void eval_bench()
+{
+    enum { NUM_SETS = 1024 * 1024 };
+    Context *ctx = context_new();
+    const char *src = "(price * qty - discount) * (100 + tax) / 100 - fee * qty";
+    Program *program = compile(ctx, src);
+    assert(program->num_inputs == 5);
+    int64_t *sets = xmalloc(NUM_SETS * 5 * sizeof(int64_t));
+    for (int i = 0; i < NUM_SETS * 5; i++) {
+        sets[i] = rng_next() % 10000;
+    }
+    static volatile int64_t sink;
+    f64 t0 = now_seconds();
+    for (int i = 0; i < NUM_SETS; i++) {
+        sink += program_eval(program, sets + 5 * i);
+    }
+    f64 eval_time = (now_seconds() - t0) / NUM_SETS;
+    t0 = now_seconds();
+    enum { NUM_COMPILES = NUM_SETS / 64 };
+    for (int i = 0; i < NUM_COMPILES; i++) {
+        Program *p = compile(ctx, src);
+        sink += program_eval(p, sets + 5 * i);
+        program_free(p);
+    }
+    f64 compile_time = (now_seconds() - t0) / NUM_COMPILES;
+    printf(
+        "eval: %.1f ns/eval reusing the program, %.1f ns/eval compiling each time\n",
+        eval_time * 1e9, compile_time * 1e9);
+
+    // The same formula in floats, converting the int inputs where they meet one
+    Program *float_program =
+        compile(ctx, "(price * qty - discount) * (1 + tax / 100.0) - fee * qty");
+    assert(float_program->type == TYPE_FLOAT);
+    t0 = now_seconds();
+    for (int i = 0; i < NUM_SETS; i++) {
+        sink += program_eval(float_program, sets + 5 * i);
+    }
+    f64 float_time = (now_seconds() - t0) / NUM_SETS;
+    printf("eval: %.1f ns/eval in floats\n", float_time * 1e9);
+    program_free(float_program);
+    free(sets);
+    program_free(program);
+    context_free(ctx);
+}
+
+// The same formulas over columns of inputs, a row at a time on vm_run and
+// a block at a time at each SIMD level
+void batch_bench()
+{
+    enum { NUM_ROWS = 1024 * 1024, NUM_INPUTS = 5 };
+    Context *ctx = context_new();
+    static const char *srcs[] = {
+        "(price * qty - discount) * (100 + tax) - fee * qty",
+        "(price * qty - discount) * (100 + tax) / 100 - fee * qty",
+    };
+    int64_t *columns[NUM_INPUTS];
+    for (int s = 0; s < NUM_INPUTS; s++) {
+        columns[s] = xmalloc(NUM_ROWS * sizeof(int64_t));
+        for (int row = 0; row < NUM_ROWS; row++) {
+            columns[s][row] = rng_next() % 10000;
+        }
+    }
+    int64_t *results = xmalloc(NUM_ROWS * sizeof(int64_t));
+    for (int i = 0; i < 2; i++) {
+        Program *program = compile(ctx, srcs[i]);
+        assert(program->num_inputs == NUM_INPUTS);
+        printf("batch %s:\n", i ? "with division" : "without division");
+        f64 t0 = now_seconds();
+        for (int row = 0; row < NUM_ROWS; row++) {
+            int64_t in[NUM_INPUTS];
+            for (int s = 0; s < NUM_INPUTS; s++) {
+                in[s] = columns[s][row];
+            }
+            results[row] = program_eval(program, in);
+        }
+        f64 scalar = now_seconds() - t0;
+        printf("  %-6s: %6.1f Mrows/s\n", "by row", NUM_ROWS / scalar / 1e6);
+        for (SimdLevel level = 0; level <= simd_max_level(); level++) {
+            set_simd_level(level);
+            t0 = now_seconds();
+            program_eval_batch(program, (const int64_t *const *)columns, NUM_ROWS, results);
+            f64 elapsed = now_seconds() - t0;
+            printf(
+                "  %-6s: %6.1f Mrows/s (%.1fx)\n", simd_level_names[level],
+                NUM_ROWS / elapsed / 1e6, scalar / elapsed);
+        }
+        program_free(program);
+    }
+    for (int s = 0; s < NUM_INPUTS; s++) {
+        free(columns[s]);
+    }
+    free(results);
+    context_free(ctx);
+}
+
+// Startup cost of thousands of formulas: compiling their source, against
+// mapping and opening an image of them that's in the page cache
+void image_bench()
+{
+    enum { NUM_FORMULAS = 10000, DEPTH = 4, RUNS = 5 };
+    Context *ctx = context_new();
+    // Unfolded, the code is as long as it would be if the formulas used inputs
+    ctx->fold_constants = false;
+    char *src = xmalloc(NUM_FORMULAS * (64 << DEPTH));
+    char *ptr = src;
+    for (int i = 0; i < NUM_FORMULAS; i++) {
+        ptr = gen_expr(ptr, DEPTH);
+        ptr += sprintf(ptr, ";\n");
+    }
+    Program **programs = xmalloc(NUM_FORMULAS * sizeof(Program *));
+    f64 compile_best = INFINITY;
+    for (int run = 0; run < RUNS; run++) {
+        f64 t0 = now_seconds();
+        init_stream_range(ctx, src, ptr);
+        for (int i = 0; i < NUM_FORMULAS; i++) {
+            reset_code(ctx);
+            ctx->cse_active = ctx->cse_enabled;
+            parse_expr(ctx);
+            finish_code(ctx);
+            programs[i] = finish_program(ctx);
+            match_token(ctx, ';');
+        }
+        compile_best = MIN(compile_best, now_seconds() - t0);
+        if (run < RUNS - 1) {
+            for (int i = 0; i < NUM_FORMULAS; i++) {
+                program_free(programs[i]);
+            }
+        }
+    }
+
+    size_t size;
+    char *data = image_build(programs, NUM_FORMULAS, &size);
+    char *path = write_temp_file(data, size);
+    f64 open_best = INFINITY;
+    for (int run = 0; run < RUNS; run++) {
+        f64 t0 = now_seconds();
+        mapped_file_t file;
+        Image image;
+        if (!map_file(path, &file) || image_open(&image, file.start, file.end)) {
+            fatal("image_bench: could not open the image");
+        }
+        open_best = MIN(open_best, now_seconds() - t0);
+        image_close(&image);
+        unmap_file(&file);
+    }
+    printf(
+        "image: %d formulas, compiling %.2f ms, opening their image %.2f ms (%zu KB)\n",
+        NUM_FORMULAS, compile_best * 1e3, open_best * 1e3, size / 1024);
+    unlink(path);
+    free(path);
+    free(data);
+    for (int i = 0; i < NUM_FORMULAS; i++) {
+        program_free(programs[i]);
+    }
+    free(programs);
+    free(src);
+    context_free(ctx);
+}
+
+// Formulas that repeat their subexpressions, compiled with and without
+// common subexpression elimination: the size of their code and its speed
+void cse_bench()
+{
+    enum { NUM_FORMULAS = 1000, NUM_SETS = 1000 };
+    static const char *terms[] = {
+        "(a * b + c)", "(a - c)", "(b * b - 4 * a * c)", "(a * b + c) * (a - c)",
+    };
+    enum { NUM_TERMS = sizeof(terms) / sizeof(*terms) };
+    char *srcs[NUM_FORMULAS];
+    for (int i = 0; i < NUM_FORMULAS; i++) {
+        char *ptr = srcs[i] = xmalloc(1024);
+        ptr += sprintf(ptr, "%s", terms[rng_next() % NUM_TERMS]);
+        for (int j = 0; j < 7; j++) {
+            const char *op = j % 2 ? " * " : " + ";
+            ptr += sprintf(ptr, "%s%s", op, terms[rng_next() % NUM_TERMS]);
+        }
+    }
+    int64_t *sets = xmalloc(NUM_SETS * 3 * sizeof(int64_t));
+    for (int i = 0; i < NUM_SETS * 3; i++) {
+        sets[i] = rng_next() % 100;
+    }
+    Context *ctx = context_new();
+    static volatile int64_t sink;
+    for (int cse = 0; cse < 2; cse++) {
+        ctx->cse_enabled = cse;
+        size_t code_size = 0;
+        f64 elapsed = 0;
+        for (int i = 0; i < NUM_FORMULAS; i++) {
+            Program *program = compile(ctx, srcs[i]);
+            code_size += program->len;
+            f64 t0 = now_seconds();
+            for (int j = 0; j < NUM_SETS; j++) {
+                sink += program_eval(program, sets + 3 * j);
+            }
+            elapsed += now_seconds() - t0;
+            program_free(program);
+        }
+        printf(
+            "cse %-3s: %.1f bytes of code/formula, %.1f ns/eval\n", cse ? "on" : "off",
+            (f64)code_size / NUM_FORMULAS, elapsed / NUM_FORMULAS / NUM_SETS * 1e9);
+    }
+    context_free(ctx);
+    free(sets);
+    for (int i = 0; i < NUM_FORMULAS; i++) {
+        free(srcs[i]);
+    }
+}
+
+// Mixed int and float formulas on typed stack code, which converts ints with
+// I2F, against the generic ops, which test their operand types every run
+void typed_bench()
+{
+    enum { NUM_FORMULAS = 1000, NUM_SETS = 1000 };
+    static const char *terms[] = {
+        "a", "b", "(a - c)", "(b * c)", "0.5", "(a * 1.25)", "(c / 4.0)", "7",
+    };
+    enum { NUM_TERMS = sizeof(terms) / sizeof(*terms) };
+    char *srcs[NUM_FORMULAS];
+    for (int i = 0; i < NUM_FORMULAS; i++) {
+        char *ptr = srcs[i] = xmalloc(1024);
+        ptr += sprintf(ptr, "%s", terms[rng_next() % NUM_TERMS]);
+        for (int j = 0; j < 7; j++) {
+            const char *op = (const char *[]){ " + ", " - ", " * " }[rng_next() % 3];
+            ptr += sprintf(ptr, "%s%s", op, terms[rng_next() % NUM_TERMS]);
+        }
+    }
+    int64_t *sets = xmalloc(NUM_SETS * 3 * sizeof(int64_t));
+    for (int i = 0; i < NUM_SETS * 3; i++) {
+        sets[i] = rng_next() % 100;
+    }
+    Context *ctx = context_new();
+    static volatile int64_t sink;
+    for (int typed = 0; typed < 2; typed++) {
+        ctx->typed_ops = typed;
+        size_t num_instrs = 0;
+        f64 elapsed = 0;
+        for (int i = 0; i < NUM_FORMULAS; i++) {
+            Program *program = compile(ctx, srcs[i]);
+            num_instrs += count_instrs(program->code, program->len);
+            f64 t0 = now_seconds();
+            for (int j = 0; j < NUM_SETS; j++) {
+                sink += program_eval(program, sets + 3 * j);
+            }
+            elapsed += now_seconds() - t0;
+            program_free(program);
+        }
+        printf(
+            "%-7s ops: %.1f instructions/formula, %.1f ns/eval\n",
+            typed ? "typed" : "generic", (f64)num_instrs / NUM_FORMULAS,
+            elapsed / NUM_FORMULAS / NUM_SETS * 1e9);
+    }
+    context_free(ctx);
+    free(sets);
+    for (int i = 0; i < NUM_FORMULAS; i++) {
+        free(srcs[i]);
+    }
+}
+
+void print_imm_instr(Context *ctx, int offset)
+{
+    byte instr = ctx->code[offset];
+    int size = instr_info[instr].size - 1;
+    int64_t imm = read_imm(&ctx->code[offset + 1], size);
+    printf("%-16s %4lld\n", instr_info[instr].name, (long long)imm);
+}
+
+void print_simple_instr(Context *ctx, int offset)
+{
+    byte instr = ctx->code[offset];
+    printf("%-16s\n", instr_info[instr].name);
+}
+
+#define HEX "%02hhX"
+
+int print_instr(Context *ctx, int offset)
+{
+    byte instr = ctx->code[offset];
+    int size = instr < NUM_OPS ? instr_info[instr].size : 1;
+    // printf("instr:%d size:%d\n", instr, size);
+
+    // Instruction bytes
+    printf("%06d ", offset);
+    for (int i = 0; i < size; ++i) {
+        printf(HEX " ", (byte)ctx->code[offset + i]);
+    }
+    for (int i = size; i < 9; ++i) {
+        printf("   ");
+    }
+
+    switch (instr) {
+        case LIT8:
+        case LIT16:
+        case LIT32:
+        case LIT64:
+        case ADDK:
+        case MULK:
+        case DIVK:
+            print_imm_instr(ctx, offset);
+            break;
+        case LOAD:
+        case PICK:
+        case SLIDE:
+            printf("%-16s %4d\n", instr_info[instr].name, ctx->code[offset + 1]);
+            break;
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case NEG: {
+            // The operand types from the immediate
+            byte floats = ctx->code[offset + 1];
+            printf("%-16s ", instr_info[instr].name);
+            for (int i = 0; i < instr_info[instr].pops; i++) {
+                printf("%s%s", i ? ", " : "", floats >> i & 1 ? "float" : "int");
+            }
+            printf("\n");
+            break;
+        }
+        case LITF:
+            printf(
+                "%-16s %4g\n", instr_info[instr].name,
+                f64_from_word(read_imm(&ctx->code[offset + 1], 8)));
+            break;
+        default:
+            print_simple_instr(ctx, offset);
+            break;
+    }
+    return size;
+}
+
+void print_disassembly(Context *ctx)
+{
+    printf("OFFSET B0 B1 B2 B3 B4 B5 B6 B7 B8 OPCODE\n");
+    printf("------ -- -- -- -- -- -- -- -- -- ----------------\n");
+    for (int offset = 0, max = buf_len(ctx->code); offset < max;) {
+        offset += print_instr(ctx, offset);
+    }
+    puts("");
+}
+
+#define assert_peephole(str, ...) \
+    do { \
+        byte expected[] = { __VA_ARGS__ }; \
+        reset_code(ctx); \
+        parse_expr_str(ctx, str); \
+        finish_code(ctx); \
+        assert(buf_len(ctx->code) == sizeof(expected)); \
+        assert(memcmp(ctx->code, expected, sizeof(expected)) == 0); \
+    } while (0)
+
+void peephole_test()
+{
+    Context *ctx = context_new();
+    ctx->fold_constants = false;
+    assert_peephole("0", LIT0, HALT);
+    assert_peephole("+1", LIT1, HALT);
+    assert_peephole("---7", LIT8, 0xf9, HALT);
+    assert_peephole("-128", LIT8, 0x80, HALT);
+    assert_peephole("-(2*3)", LIT8, 2, MULK, 3, NEGI, HALT);
+    assert_peephole("--(2*3)", LIT8, 2, MULK, 3, HALT);
+    assert_peephole("(1+2)*3", LIT1, ADDK, 2, MULK, 3, HALT);
+    assert_peephole("5-1-2", LIT8, 5, ADDK, 0xfd, HALT);
+    assert_peephole("5*2*3", LIT8, 5, MULK, 6, HALT);
+    assert_peephole("(5+1-1)*1/1", LIT8, 5, HALT);
+    assert_peephole("4/2", LIT8, 4, DIVK, 2, HALT);
+    // Division by -1 keeps its overflow check
+    assert_peephole("4/-1", LIT8, 4, LIT8, 0xff, DIVI, HALT);
+    assert_peephole("2-(3*4)", LIT8, 2, LIT8, 3, MULK, 4, SUBI, HALT);
+    // K immediates are 8 bits, so wider operands stay literals
+    assert_peephole("1+128", LIT1, LIT16, 128, 0, ADDI, HALT);
+    assert_peephole("1 - -128", LIT1, LIT8, 0x80, SUBI, HALT);
+    assert_peephole("1 - -127", LIT1, ADDK, 127, HALT);
+    assert_peephole("2*16*16", LIT8, 2, MULK, 16, MULK, 16, HALT);
+    assert_peephole("2*10*10", LIT8, 2, MULK, 100, HALT);
+    assert_peephole("x+1", LOAD, 0, ADDK, 1, HALT);
+    assert_peephole("-(y*2)-x", LOAD, 0, MULK, 2, NEGI, LOAD, 1, SUBI, HALT);
+    context_free(ctx);
+}
+
+#undef assert_peephole
+
+// Compiles and runs str with the current backend
+int64_t eval_str(Context *ctx, const char *str)
+{
+    reset_code(ctx);
+    parse_expr_str(ctx, str);
+    finish_code(ctx);
+    return exec_code(ctx);
+}
+
+// Folding must shrink the code without changing the result, overflow included
+#define assert_folds(str, folded_len) \
+    do { \
+        ctx->fold_constants = false; \
+        int64_t expected = eval_str(ctx, str); \
+        size_t unfolded_len = buf_len(ctx->code); \
+        ctx->fold_constants = true; \
+        assert(eval_str(ctx, str) == expected); \
+        assert(buf_len(ctx->code) == (folded_len) && buf_len(ctx->code) < unfolded_len); \
+    } while (0)
+
+void fold_test()
+{
+    Context *ctx = context_new();
+    assert_folds("1 + 2 * 3", 3);
+    assert_folds("-(4 - 5) * (6 / 2)", 3);
+    assert_folds("65536 * 65536", 10);
+    assert_folds("4294967296 * 4294967296", 2);
+    assert_folds("(1 + 2) * 0.5 - -1.25", 10);
+    assert_folds("-9223372036854775807 - 1 - 1", 10);
+    assert_folds("(-9223372036854775807 - 1) / -1", 10);
+    assert_folds("7 / -2", 3);
+    assert_folds("1.5 / (3 - 3)", 10); // an infinity, not an error
+
+    // Division by zero stays in the code so it still fails at run time
+    reset_code(ctx);
+    parse_expr_str(ctx, "1 + 6 / (3 - 3)");
+    finish_code(ctx);
+    byte expected[] = { LIT1, LIT8, 6, LIT0, DIVI, ADDI, HALT };
+    assert(buf_len(ctx->code) == sizeof(expected));
+    assert(memcmp(ctx->code, expected, sizeof(expected)) == 0);
+
+    // Folded constants don't take up constant slots in register code
+    ctx->backend = BACKEND_REGISTER;
+    reset_code(ctx);
+    parse_expr_str(ctx, "(1 + 2) * (3 + 4) - 5");
+    finish_code(ctx);
+    assert(buf_len(ctx->reg_consts) == 1 && ctx->reg_consts[0] == 16);
+    assert(reg_exec(ctx) == 16);
+    ctx->backend = BACKEND_STACK;
+
+    // Inputs stop folding but constant subexpressions around them still fold
+    Program *program = compile(ctx, "x * (2 + 3) + (4 - 5)");
+    byte expected_inputs[] = { LOAD, 0, MULK, 5, ADDK, 0xff, HALT };
+    assert(program->len == sizeof(expected_inputs));
+    assert(memcmp(program->code, expected_inputs, sizeof(expected_inputs)) == 0);
+    assert(program_eval(program, (int64_t[]){ 3 }) == 14);
+    program_free(program);
+    context_free(ctx);
+}
+
+#undef assert_folds
+
+// Runs str through the JIT in a child process and returns its exit status
+int jit_exit_status(Context *ctx, const char *str)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        ctx->jit_enabled = true;
+        eval_str(ctx, str);
+        exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void jit_test()
+{
+    Context *ctx = context_new();
+    JitCode jit;
+    byte add[] = { LIT8, 2, LIT8, 3, ADDI, HALT };
+    assert(jit_compile(add, sizeof(add), &jit) == JIT_ENABLED);
+    if (JIT_ENABLED) {
+        assert(jit.fn(NULL) == 5);
+        jit_free(&jit);
+    }
+
+    // Random programs agree with the interpreter, optimized or not
+    rng_state = 1;
+    ctx->fold_constants = false;
+    char src[4096];
+    for (int i = 0; i < 500; i++) {
+        *gen_expr(src, 6) = 0;
+        ctx->peephole_enabled = i % 2;
+        reset_code(ctx);
+        parse_expr_str(ctx, src);
+        finish_code(ctx);
+        size_t len = buf_len(ctx->code);
+        assert(jit_exec(ctx->code, len) == vm_exec(ctx->code, len));
+    }
+    ctx->peephole_enabled = true;
+
+    // Division by zero is fatal at any stack depth, so the trap must realign
+    // the stack before calling out
+    assert(jit_exit_status(ctx, "1 / 0") == 1);
+    assert(jit_exit_status(ctx, "1 + 2 * (3 - 4 / (5 - 5))") == 1);
+    assert(jit_exit_status(ctx, "1 + (2 - 4 / (5 - 5))") == 1);
+    context_free(ctx);
+}
+
+void c_test()
+{
+    Context *ctx = context_new();
+    static const char *exprs[] = {
+        "42",
+        "1 + 2 * 3",
+        "-(4 - 10) / 2",
+        "9223372036854775807 + 1",
+        "-9223372036854775807 - 1",
+        "(-9223372036854775807 - 1) / -1",
+        "4294967296 * 4294967296 - 1",
+        "7 / -2 - -7 / 2",
+        "1.5 * 4 - 7 / 2.0",
+        "-(1 / 3.0) + 2 * -0.0",
+        "1 / 0.0 - 1",
+    };
+    enum { NUM_EXPRS = sizeof(exprs) / sizeof(*exprs) };
+    int64_t expected[NUM_EXPRS];
+    for (int i = 0; i < NUM_EXPRS; i++) {
+        expected[i] = eval_str(ctx, exprs[i]);
+    }
+
+    // Unfolded, the arithmetic happens in the generated code
+    for (int fold = 0; fold <= 1; fold++) {
+        ctx->fold_constants = fold;
+        ctx->backend = BACKEND_C;
+        c_begin_unit(ctx);
+        for (int i = 0; i < NUM_EXPRS; i++) {
+            reset_code(ctx);
+            parse_expr_str(ctx, exprs[i]);
+            finish_code(ctx);
+        }
+        ctx->backend = BACKEND_STACK;
+        CModule module;
+        assert(c_build(ctx, &module));
+        assert(buf_len(module.fns) == NUM_EXPRS);
+        for (int i = 0; i < NUM_EXPRS; i++) {
+            assert(module.fns[i](NULL) == expected[i]);
+        }
+        c_unload(&module);
+
+        // The same source reuses the cached build
+        int num_builds = c_num_builds;
+        assert(c_build(ctx, &module));
+        assert(c_num_builds == num_builds);
+        assert(module.fns[1](NULL) == 7);
+        c_unload(&module);
+    }
+
+    // A build is only reused if the source saved next to it matches exactly
+    char dir[PATH_MAX], src_path[PATH_MAX + 32];
+    assert(cache_dir(dir, sizeof(dir)));
+    unsigned long long hash = str_hash_range(ctx->c_unit, buf_end(ctx->c_unit));
+    snprintf(src_path, sizeof(src_path), "%s/c-%016llx.c", dir, hash);
+    FILE *file = fopen(src_path, "w");
+    assert(file && fputs("int colliding_source;\n", file) >= 0 && fclose(file) == 0);
+    int num_builds = c_num_builds;
+    CModule module;
+    assert(c_build(ctx, &module));
+    assert(c_num_builds == num_builds + 1);
+    assert(module.fns[1](NULL) == 7);
+    c_unload(&module);
+    context_free(ctx);
+
+    // The cache directory is refused unless only this user can write to it
+    char *saved = getenv("XDG_CACHE_HOME") ? strdup(getenv("XDG_CACHE_HOME")) : NULL;
+    char base[PATH_MAX + 32];
+    snprintf(base, sizeof(base), "%s/test-XXXXXX", dir);
+    assert(mkdtemp(base));
+    setenv("XDG_CACHE_HOME", base, 1);
+    struct stat st;
+    assert(cache_dir(dir, sizeof(dir)));
+    assert(lstat(dir, &st) == 0 && (st.st_mode & 0777) == 0700);
+    assert(chmod(dir, 0770) == 0);
+    assert(!cache_dir(dir, sizeof(dir)) && errno == EACCES);
+    assert(rmdir(dir) == 0 && symlink(base, dir) == 0);
+    assert(!cache_dir(dir, sizeof(dir)) && errno == EACCES);
+    assert(unlink(dir) == 0 && rmdir(base) == 0);
+    if (saved) {
+        setenv("XDG_CACHE_HOME", saved, 1);
+        free(saved);
+    } else {
+        unsetenv("XDG_CACHE_HOME");
+    }
+}
+
+// Every case runs on both backends with and without constant folding, and
+// on the stack backend with and without the peephole pass and the JIT
+#define assert_compile_expr(x) \
+    do { \
+        for (int fold = 0; fold <= 1; fold++) { \
+            ctx->fold_constants = fold; \
+            ctx->peephole_enabled = false; \
+            assert(eval_str(ctx, #x) == c_word(x)); \
+            assert(ctx->result_type == c_type(x)); \
+            ctx->peephole_enabled = true; \
+            assert(eval_str(ctx, #x) == c_word(x)); \
+            ctx->jit_enabled = true; \
+            assert(eval_str(ctx, #x) == c_word(x)); \
+            ctx->jit_enabled = false; \
+            ctx->backend = BACKEND_REGISTER; \
+            assert(eval_str(ctx, #x) == c_word(x)); \
+            assert(ctx->result_type == c_type(x)); \
+            ctx->backend = BACKEND_STACK; \
+        } \
+    } while (0)
+
+void compile_test()
+{
+    Context *ctx = context_new();
+    // clang-format off
+    assert_compile_expr(1);
+    assert_compile_expr(-1);
+    assert_compile_expr(1+2);
+    assert_compile_expr(2*3);
+    assert_compile_expr((2*3)+(4*5));
+    assert_compile_expr(10/2);
+    assert_compile_expr(-(1+2)*-3);
+    assert_compile_expr(1-2-3-4);
+    assert_compile_expr(((1+2)*(3-4))/(5+-6));
+    assert_compile_expr(2*(3+4*(5+6*(7+8*(9+1)))));
+    assert_compile_expr(+1);
+    assert_compile_expr(-+-+2);
+    assert_compile_expr(1000*1000+300-70000);
+    assert_compile_expr((7-1-6)*5+1);
+    assert_compile_expr(9/-1-1);
+    assert_compile_expr(5000000000*3-70000000000);
+    assert_compile_expr(-9223372036854775807/1000);
+    // Floats, and ints converted where they meet one
+    assert_compile_expr(2.5);
+    assert_compile_expr(1.5*2);
+    assert_compile_expr(7/2.0-7/2);
+    assert_compile_expr(0.1+0.2);
+    assert_compile_expr(-(2.5-4)*3);
+    assert_compile_expr(1/(2-3*0.5));
+    assert_compile_expr(10/4*1.0);
+    assert_compile_expr(-0.0*1);
+    assert_compile_expr(1/0.0-1);
+    assert_compile_expr(1e300*1e10);
+    assert_compile_expr(9007199254740993+0.0);
+    assert_compile_expr(2*(1.5+(3-4.25*(2+0.5))));
+    // clang-format on
+
+    // The parser and every backend agree on 64-bit wraparound
+    for (int fold = 0; fold <= 1; fold++) {
+        ctx->fold_constants = fold;
+        assert(parse_expr_str(ctx, "9223372036854775807 + 1") == INT64_MIN);
+        assert(eval_str(ctx, "9223372036854775807 + 1") == INT64_MIN);
+        assert(eval_str(ctx, "-9223372036854775807 - 1 - 1") == INT64_MAX);
+        assert(eval_str(ctx, "4294967296 * 4294967296 + 18446744073709551615") == -1);
+        ctx->backend = BACKEND_REGISTER;
+        assert(eval_str(ctx, "9223372036854775807 + 1") == INT64_MIN);
+        assert(eval_str(ctx, "4294967296 * 4294967296 + 18446744073709551615") == -1);
+        ctx->backend = BACKEND_STACK;
+    }
+    context_free(ctx);
+}
+
+#undef assert_compile_expr
+
+enum {
+    RUN_PRELEX = 1 << 0, // lex the whole input before parsing
+    RUN_TIMES = 1 << 1,  // report lex, parse and run times with the errors
+    RUN_REGISTERS = 1 << 2, // compile for the register machine
+    RUN_JIT = 1 << 3,       // compile stack code to native code
+    RUN_C = 1 << 4,         // compile everything to one C shared object
 };
 
-u64 parse_expr();
-
-u64 parse_expr3()
-{
-    u64 val;
-    if (is_token(TOKEN_INT)) {
-        val = token.int_val;
-        next_token();
-        buf_push(code, LIT);
-        buf_push(code, val << 0);
-        buf_push(code, val << 8);
-        buf_push(code, val << 16);
-        buf_push(code, val << 24);
-        return val;
-    } else if (match_token('(')) {
-        val = parse_expr();
-        expect_token(')');
-        return val;
-    }
-    fatal("expected integer of (, got \"%s\"", token_kind_name(token.kind));
-    return 0;
+// Prints a value on a line of its own. A float prints in the fewest digits that
+// read back as it, as a literal the lexer reads as a float.
+void print_value(FILE *out, int64_t word, Type type)
+{
+    f64 val = f64_from_word(word);
+    char buf[32];
+    if (type == TYPE_INT) {
+        fprintf(out, "%lld\n", (long long)word);
+        return;
+    } else if (isnan(val)) {
+        strcpy(buf, "nan");
+    } else if (isinf(val)) {
+        strcpy(buf, val < 0 ? "-inf" : "inf");
+    } else {
+        for (int prec = 1; prec <= 17; prec++) {
+            format_float_literal(buf, prec, val);
+            if (strtod(buf, NULL) == val) {
+                break;
+            }
+        }
+    }
+    fprintf(out, "%s\n", buf);
 }
 
-u64 parse_expr2()
+// Compiles and runs each ';'-separated expression in [start, end), printing
+// one result per line. With RUN_C all of them are compiled before any runs.
+// With RUN_TIMES the times go to err after the path.
+void run_source(
+    Context *ctx, const char *path, const char *start, const char *end, FILE *out,
+    FILE *err, int flags)
 {
-    u64 val;
-    if (match_token('-')) {
-        val = parse_expr2();
-        buf_push(code, NEG);
-        return -val;
-    } else if (match_token('+')) {
-        val = parse_expr2();
-        buf_push(code, ADD);
-        return val;
+    f64 lex_time = 0, parse_time = 0, run_time = 0;
+    f64 t0 = now_seconds();
+    TokenStream ts;
+    if (flags & RUN_PRELEX) {
+        lex_tokens(ctx, &ts, start, end);
+        init_tokens(ctx, &ts);
+        lex_time = now_seconds() - t0;
+    } else {
+        init_stream_range(ctx, start, end);
+    }
+    ctx->backend = flags & RUN_REGISTERS ? BACKEND_REGISTER : BACKEND_STACK;
+    ctx->jit_enabled = flags & RUN_JIT;
+    if (flags & RUN_C) {
+        ctx->backend = BACKEND_C;
+        c_begin_unit(ctx);
+    }
+    while (!is_token(ctx, TOKEN_EOF)) {
+        f64 t1 = flags & RUN_TIMES ? now_seconds() : 0;
+        reset_code(ctx);
+        parse_expr(ctx);
+        finish_code(ctx);
+        if (buf_len(ctx->input_names)) {
+            fatal("\"%s\" has no value", ctx->input_names[0]);
+        }
+        f64 t2 = flags & RUN_TIMES ? now_seconds() : 0;
+        if (!(flags & RUN_C)) {
+            print_value(out, exec_code(ctx), ctx->result_type);
+        }
+        if (flags & RUN_TIMES) {
+            f64 t3 = now_seconds();
+            parse_time += t2 - t1;
+            run_time += t3 - t2;
+        }
+        if (!match_token(ctx, ';')) {
+            expect_token(ctx, TOKEN_EOF);
+        }
+    }
+    if (flags & RUN_C) {
+        f64 t1 = now_seconds();
+        CModule module;
+        if (!c_build(ctx, &module)) {
+            fatal("could not build C code");
+        }
+        for (size_t i = 0; i < buf_len(module.fns); i++) {
+            print_value(out, module.fns[i](NULL), ctx->c_fn_types[i]);
+        }
+        c_unload(&module);
+        run_time += now_seconds() - t1;
+    }
+    ctx->backend = BACKEND_STACK;
+    ctx->jit_enabled = false;
+    if (flags & RUN_PRELEX) {
+        init_tokens(ctx, NULL);
+        free_tokens(&ts);
+    }
+    if (flags & RUN_TIMES) {
+        fprintf(
+            err, "%s: lex: %.3f ms, parse: %.3f ms%s, run: %.3f ms%s\n", path,
+            lex_time * 1e3, parse_time * 1e3, flags & RUN_PRELEX ? "" : " (including lex)",
+            run_time * 1e3, flags & RUN_C ? " (including cc)" : "");
     }
-    return parse_expr3();
 }
 
-u64 parse_expr1()
+// Runs each program of the image in [start, end), printing one result per
+// line. Images always run on the stack machine.
+int run_image(
+    const char *path, const char *start, const char *end, FILE *out, FILE *err, int flags)
 {
-    int val = parse_expr2();
-    while (is_token('*') || is_token('/')) {
-        char op = token.kind;
-        next_token();
-        int rhs = parse_expr2();
-        if (op == '*') {
-            buf_push(code, MUL);
-            val *= rhs;
-        } else {
-            assert(op == '/');
-            assert(rhs != 0);
-            buf_push(code, DIV);
-            val /= rhs;
+    f64 t0 = now_seconds();
+    Image image;
+    const char *error = image_open(&image, start, end);
+    if (error) {
+        fprintf(err, "%s: %s\n", path, error);
+        return 1;
+    }
+    f64 t1 = now_seconds();
+    for (int i = 0; i < image.num_programs; i++) {
+        const Program *program = &image.programs[i];
+        if (program->num_inputs) {
+            fprintf(err, "%s: \"%s\" has no value\n", path, program->inputs[0]);
+            image_close(&image);
+            return 1;
         }
+        print_value(out, program_eval(program, NULL), program->type);
     }
-    return val;
+    if (flags & RUN_TIMES) {
+        fprintf(
+            err, "%s: load: %.3f ms, run: %.3f ms\n", path, (t1 - t0) * 1e3,
+            (now_seconds() - t1) * 1e3);
+    }
+    image_close(&image);
+    return 0;
 }
 
-u64 parse_expr0()
+// Runs a source file, or an image written by write_image. Errors, including
+// ones that would be fatal, are printed to err after the path and make it
+// return 1; ctx may then be left mid-expression and should be replaced.
+int run_file(Context *ctx, const char *path, FILE *out, FILE *err, int flags)
 {
-    int val = parse_expr1();
-    while (is_token('+') || is_token('-')) {
-        char op = token.kind;
-        next_token();
-        int rhs = parse_expr1();
-        if (op == '+') {
-            buf_push(code, ADD);
-            val += rhs;
+    mapped_file_t file;
+    if (!map_file(path, &file)) {
+        fprintf(err, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    FatalHandler handler;
+    FatalHandler *outer = fatal_handler;
+    int status;
+    if (setjmp(handler.jmp)) {
+        fprintf(err, "%s: %s\n", path, handler.message);
+        status = 1;
+    } else {
+        fatal_handler = &handler;
+        if (is_image(file.start, file.end)) {
+            status = run_image(path, file.start, file.end, out, err, flags);
         } else {
-            buf_push(code, SUB);
-            assert(op == '-');
-            val -= rhs;
+            run_source(ctx, path, file.start, file.end, out, err, flags);
+            status = 0;
         }
     }
-    return val;
+    fatal_handler = outer;
+    unmap_file(&file);
+    return status;
 }
 
-u64 parse_expr()
+// Compiles each ';'-separated expression of the files, in order, into one
+// image at image_path. Unlike run_source, the expressions may use inputs.
+int write_image(const char *image_path, char **paths, int num_paths)
 {
-    return parse_expr0();
+    Context *ctx = context_new();
+    Program **programs = NULL;
+    int status = 0;
+    for (int i = 0; i < num_paths && !status; i++) {
+        mapped_file_t file;
+        if (!map_file(paths[i], &file)) {
+            fprintf(stderr, "%s: %s\n", paths[i], strerror(errno));
+            status = 1;
+            break;
+        }
+        init_stream_range(ctx, file.start, file.end);
+        while (!is_token(ctx, TOKEN_EOF)) {
+            reset_code(ctx);
+            ctx->cse_active = ctx->cse_enabled;
+            parse_expr(ctx);
+            finish_code(ctx);
+            buf_push(programs, finish_program(ctx));
+            if (!match_token(ctx, ';')) {
+                expect_token(ctx, TOKEN_EOF);
+            }
+        }
+        unmap_file(&file);
+    }
+    if (!status) {
+        size_t size;
+        char *image = image_build(programs, buf_len(programs), &size);
+        FILE *f = fopen(image_path, "wb");
+        if (!f || fwrite(image, 1, size, f) != size || fclose(f) != 0) {
+            fprintf(stderr, "%s: %s\n", image_path, strerror(errno));
+            status = 1;
+        }
+        free(image);
+    }
+    for (size_t i = 0; i < buf_len(programs); i++) {
+        program_free(programs[i]);
+    }
+    buf_free(programs);
+    context_free(ctx);
+    return status;
 }
 
-int parse_expr_str(const char *str)
+typedef struct FileJob {
+    const char *path;
+    char *output;
+    size_t output_len;
+    char *error; // What went wrong, after the path, if status is nonzero
+    size_t error_len;
+    int status;
+} FileJob;
+
+typedef struct FilePool {
+    FileJob *jobs;
+    int num_jobs;
+    int flags;
+    atomic_int next_job;
+} FilePool;
+
+void *file_worker(void *arg)
 {
-    init_stream(str);
-    return parse_expr();
+    FilePool *pool = arg;
+    Context *ctx = context_new();
+    int i;
+    while ((i = atomic_fetch_add(&pool->next_job, 1)) < pool->num_jobs) {
+        FileJob *job = &pool->jobs[i];
+        FILE *out = open_memstream(&job->output, &job->output_len);
+        FILE *err = open_memstream(&job->error, &job->error_len);
+        job->status = run_file(ctx, job->path, out, err, pool->flags);
+        fclose(out);
+        fclose(err);
+        if (job->status) {
+            context_free(ctx);
+            ctx = context_new();
+        }
+    }
+    context_free(ctx);
+    return NULL;
 }
 
-#define assert_expr(x) assert(parse_expr_str(#x) == (x))
-
-void parse_test(void)
+// Runs the files concurrently, each on its own context, with a thread per CPU.
+// Their results and errors are printed in order once they're all done, so one
+// bad file doesn't hide the others. Returns nonzero if any file failed.
+int run_files(char **paths, int num_paths, FILE *out, FILE *err, int flags)
 {
-    // clang-format off
-    assert_expr(1);
-    assert_expr(-1);
-    assert_expr(1);
-    assert_expr(-1);
-    assert_expr(1-(-1));
-    assert_expr((1));
-    assert_expr(1-2-3);
-    assert_expr(2*3+4*5);
-    assert_expr(2+-3);
-    assert_expr(2*(3+4)*5);
-    // clang-format on
+    if (num_paths == 1) {
+        Context *ctx = context_new();
+        int status = run_file(ctx, paths[0], out, err, flags);
+        context_free(ctx);
+        return status;
+    }
+    FilePool pool = {
+        .jobs = xcalloc(num_paths, sizeof(FileJob)),
+        .num_jobs = num_paths,
+        .flags = flags,
+    };
+    atomic_init(&pool.next_job, 0);
+    for (int i = 0; i < num_paths; i++) {
+        pool.jobs[i].path = paths[i];
+    }
+    int num_threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), num_paths);
+    pthread_t *threads = xmalloc(num_threads * sizeof(pthread_t));
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, file_worker, &pool) != 0) {
+            fatal("could not start a thread");
+        }
+    }
+    int status = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < num_paths; i++) {
+        FileJob *job = &pool.jobs[i];
+        fwrite(job->output, 1, job->output_len, out);
+        fflush(out);
+        fwrite(job->error, 1, job->error_len, err);
+        free(job->output);
+        free(job->error);
+        status |= job->status;
+    }
+    free(threads);
+    free(pool.jobs);
+    return status;
 }
 
-#undef assert_expr
+void file_test()
+{
+    Context *ctx = context_new();
+    // Results are printed one per line and the last ';' is optional. Floats
+    // print as short as they read back exactly.
+    const char src[] = "1 + 2;\n2 * (3 + 4);\n-8 / 2;\n1 / 3.0;\n2 * 1.5;\n-1 / 0.0";
+    static const int variants[] = {
+        0, RUN_PRELEX, RUN_REGISTERS, RUN_PRELEX | RUN_JIT, RUN_C,
+    };
+    for (size_t i = 0; i < sizeof(variants) / sizeof(*variants); i++) {
+        int flags = variants[i];
+        char out[64] = { 0 };
+        FILE *f = tmpfile();
+        run_source(ctx, "<test>", src, src + strlen(src), f, stderr, flags);
+        rewind(f);
+        assert(fread(out, 1, sizeof(out) - 1, f) > 0);
+        fclose(f);
+        assert(strcmp(out, "3\n14\n-4\n0.3333333333333333\n3.\n-inf\n") == 0);
+    }
 
-#define PUSH(x) (*top++ = (x))
-#define POP() (*--top)
-#define assert_pops(n) assert(top - stack >= (n))
-#define assert_pushes(n) assert(top + (n) <= stack + MAX_STACK)
+    // Mapped input isn't NUL-terminated. A page-sized file that ends inside a
+    // name must lex without touching the next page.
+    enum { PAGE = 4096 };
+    char *page = xmalloc(PAGE);
+    memset(page, 'a', PAGE);
+    char *path = write_temp_file(page, PAGE);
+    mapped_file_t file;
+    assert(map_file(path, &file));
+    assert(file.end - file.start == PAGE);
+    init_stream_range(ctx, file.start, file.end);
+    assert(is_token(ctx, TOKEN_NAME) && ctx->token.end == file.end);
+    next_token(ctx);
+    assert(is_token(ctx, TOKEN_EOF));
+    unmap_file(&file);
+    unlink(path);
+    free(path);
+
+    // Same for numbers and whitespace
+    memset(page, ' ', PAGE);
+    memcpy(page + PAGE - 4, "1234", 4);
+    path = write_temp_file(page, PAGE);
+    assert(map_file(path, &file));
+    init_stream_range(ctx, file.start, file.end);
+    assert(is_token(ctx, TOKEN_INT) && ctx->token.int_val == 1234);
+    next_token(ctx);
+    assert(is_token(ctx, TOKEN_EOF));
+    unmap_file(&file);
+    unlink(path);
+    free(path);
+    free(page);
+
+    // Empty files map to an empty range
+    path = write_temp_file("", 0);
+    assert(map_file(path, &file));
+    init_stream_range(ctx, file.start, file.end);
+    assert(is_token(ctx, TOKEN_EOF));
+    unmap_file(&file);
+    unlink(path);
+    free(path);
 
-int32_t vm_exec(const uint8_t *code)
+    assert(!map_file("/nonexistent/tyrion", &file) && errno == ENOENT);
+
+    // A bad file is reported after its path, in order, and the files around it
+    // still run, whether or not it's alone
+    char *paths[] = {
+        write_temp_file("1 + 2", 5),
+        write_temp_file("2 *", 3),
+        write_temp_file("7", 1),
+    };
+    for (int alone = 0; alone <= 1; alone++) {
+        FILE *out = tmpfile(), *err = tmpfile();
+        assert(run_files(alone ? paths + 1 : paths, alone ? 1 : 3, out, err, 0) == 1);
+        char out_buf[64] = { 0 }, err_buf[PATH_MAX + 64] = { 0 };
+        char expected_err[PATH_MAX + 64];
+        snprintf(
+            expected_err, sizeof(expected_err),
+            "%s: expected number, name or (, got \"EOF\"\n", paths[1]);
+        rewind(out);
+        rewind(err);
+        fread(out_buf, 1, sizeof(out_buf) - 1, out);
+        fread(err_buf, 1, sizeof(err_buf) - 1, err);
+        assert(strcmp(out_buf, alone ? "" : "3\n7\n") == 0);
+        assert(strcmp(err_buf, expected_err) == 0);
+        fclose(out);
+        fclose(err);
+    }
+
+    // So are the times, each after its path
+    char *timed[] = { paths[2], paths[0] };
+    char *times = NULL;
+    size_t times_len;
+    FILE *out = tmpfile(), *err = open_memstream(&times, &times_len);
+    assert(run_files(timed, 2, out, err, RUN_TIMES) == 0);
+    fclose(out);
+    fclose(err);
+    char *second_line = strchr(times, '\n') + 1;
+    assert(strncmp(times, timed[0], strlen(timed[0])) == 0);
+    assert(strncmp(times + strlen(timed[0]), ": lex: ", 7) == 0);
+    assert(strncmp(second_line, timed[1], strlen(timed[1])) == 0);
+    free(times);
+    for (int i = 0; i < 3; i++) {
+        unlink(paths[i]);
+        free(paths[i]);
+    }
+    context_free(ctx);
+}
+
+// Compiles each of exprs for every backend and checks they agree on random
+// inputs a, b and c, with b never zero
+void assert_inputs_agree(Context *ctx, const char **exprs, int num_exprs)
 {
-    enum { MAX_STACK = 1024 };
-    int32_t stack[MAX_STACK];
-    int32_t *top = stack;
-    for (;;) {
-        uint8_t op = *code++;
-        switch (op) {
-            case ADD: {
-                assert_pops(2);
-                int32_t right = POP();
-                int32_t left = POP();
-                assert_pushes(1);
-                PUSH(left + right);
-                break;
-            }
-            case SUB: {
-                assert_pops(2);
-                int32_t right = POP();
-                int32_t left = POP();
-                assert_pushes(1);
-                PUSH(left - right);
-                break;
-            }
-            case MUL: {
-                assert_pops(2);
-                int32_t right = POP();
-                int32_t left = POP();
-                assert_pushes(1);
-                PUSH(left * right);
-                break;
-            }
-            case DIV: {
-                assert_pops(2);
-                int32_t right = POP();
-                int32_t left = POP();
-                assert_pushes(1);
-                assert(right != 0);
-                PUSH(left / right);
-                break;
-            }
-            case NEG: {
-                assert_pops(1);
-                int32_t right = POP();
-                assert_pushes(1);
-                PUSH(-right);
-                break;
+    enum { NUM_RUNS = 20 };
+    int64_t inputs[NUM_RUNS][3];
+    for (int run = 0; run < NUM_RUNS; run++) {
+        // Small values too, so that quotients aren't all zero
+        int shift = run % 2 ? 0 : 48;
+        inputs[run][0] = (int64_t)rng_next() >> shift;
+        inputs[run][1] = ((int64_t)rng_next() >> (shift + 8)) | 1;
+        inputs[run][2] = (int64_t)rng_next() >> shift;
+    }
+    ctx->backend = BACKEND_C;
+    c_begin_unit(ctx);
+    for (int i = 0; i < num_exprs; i++) {
+        reset_code(ctx);
+        parse_expr_str(ctx, exprs[i]);
+        finish_code(ctx);
+    }
+    CModule module;
+    assert(c_build(ctx, &module));
+    for (int i = 0; i < num_exprs; i++) {
+        Program *program = compile(ctx, exprs[i]);
+        int slots[3];
+        for (int k = 0; k < 3; k++) {
+            slots[k] = program_input_slot(program, (const char *[]){ "a", "b", "c" }[k]);
+        }
+
+        ctx->backend = BACKEND_REGISTER;
+        reset_code(ctx);
+        parse_expr_str(ctx, exprs[i]);
+        finish_code(ctx);
+        ctx->backend = BACKEND_STACK;
+        int num_consts = buf_len(ctx->reg_consts);
+        const char *error = reg_verify(
+            ctx->reg_code, buf_len(ctx->reg_code), num_consts, ctx->reg_num_regs,
+            program->num_inputs);
+        assert(!error);
+        int64_t *frame = reg_make_frame(ctx->reg_consts, num_consts, ctx->reg_num_regs);
+
+        JitCode jit;
+        bool jitted = jit_compile(program->code, program->len, &jit);
+        for (int run = 0; run < NUM_RUNS; run++) {
+            // Inputs are numbered in order of first use
+            int64_t in[3];
+            for (int k = 0; k < 3; k++) {
+                if (slots[k] >= 0) {
+                    in[slots[k]] = inputs[run][k];
+                }
             }
-            case LIT:
-                assert_pushes(1);
-                PUSH((code[0] << 0) | (code[1] << 8) | (code[2] << 16) | (code[3] << 24));
-                code += sizeof(uint32_t);
-                break;
-            case HALT:
-                assert_pops(1);
-                return POP();
-            default:
-                fatal("vm_exec: illegal opcode");
-                return 0;
+            int64_t expected = program_eval(program, in);
+            assert(reg_run(ctx->reg_code, frame, in) == expected);
+            assert(!jitted || jit.fn(in) == expected);
+            assert(module.fns[i](in) == expected);
         }
+        if (jitted) {
+            jit_free(&jit);
+        }
+        free(frame - num_consts);
+        program_free(program);
     }
+    c_unload(&module);
 }
 
-void vm_test()
+void program_test()
 {
-    assert(vm_exec((byte[]){ LIT, 1, 0, 0, 0, HALT }) == 1);
-    assert(vm_exec((byte[]){ LIT, 2, 0, 0, 0, LIT, 3, 0, 0, 0, ADD, HALT }) == 5);
-    assert(
-        vm_exec((byte[]){ LIT, 1, 0, 0, 0, LIT, 2, 0, 0, 0, LIT, 3, 0, 0, 0, ADD, ADD,
-                          HALT }) == 6);
-    assert(vm_exec((byte[]){ LIT, 2, 0, 0, 0, LIT, 3, 0, 0, 0, ADD, HALT }) == 5);
-    assert(vm_exec((byte[]){ LIT, 1, 0, 0, 0, NEG, HALT }) == -1);
-    assert(vm_exec((byte[]){ LIT, 2, 0, 0, 0, LIT, 3, 0, 0, 0, MUL, HALT }) == 6);
-    assert(vm_exec((byte[]){ LIT, 4, 0, 0, 0, LIT, 2, 0, 0, 0, DIV, HALT }) == 2);
+    Context *ctx = context_new();
+    Program *program = compile(ctx, "x * x - 2 * y / (x - y)");
+    assert(program->num_inputs == 2);
+    assert(program_input_slot(program, "x") == 0 && program_input_slot(program, "y") == 1);
+    assert(program_input_slot(program, "z") == -1);
+    assert(program_eval(program, (int64_t[]){ 3, 1 }) == 8);
+
+    // The program owns its code, so compiling other things doesn't disturb it
+    assert(eval_str(ctx, "1 + 2") == 3);
+    Program *other = compile(ctx, "x + 1");
+    assert(program_eval(program, (int64_t[]){ -4, 4 }) == 17);
+    assert(program_eval(other, (int64_t[]){ 41 }) == 42);
+    program_free(other);
+    program_free(program);
+
+    // A repeated name is one input
+    program = compile(ctx, "n * n - n");
+    assert(program->num_inputs == 1);
+    assert(program_eval(program, (int64_t[]){ 10 }) == 90);
+    program_free(program);
+
+    static const char *exprs[] = {
+        "a",
+        "-c",
+        "b - a",
+        "a + b * c",
+        "(a - 1) * (a + 1) / b",
+        "c - (b - (a - 100000))",
+        "a * 0 + b / b + 7 * c * 3",
+        "c / b / b * -(a - 2 * 3)",
+        "-9223372036854775807 - 1 + a * (b - c)",
+        "a * 0.5 + b",
+        "(a - 1.5) / b * c",
+        "-(a / 4.0) + c / b - -c",
+        "0.25 * a * (0.25 * a) - b / 3",
+    };
+    for (int fold = 0; fold <= 1; fold++) {
+        ctx->fold_constants = fold;
+        assert_inputs_agree(ctx, exprs, sizeof(exprs) / sizeof(*exprs));
+    }
+    context_free(ctx);
 }
 
-void print_lit_instr(int offset)
+// Evaluates expr on the stack machine with and without sharing repeated
+// subexpressions, and checks they agree
+void assert_cse_agrees(Context *ctx, const char *expr, const int64_t *inputs)
 {
-    byte *pc = &code[offset + 1];
-    int val = (pc[0] << 0) | (pc[1] << 8) | (pc[2] << 16) | (pc[3] << 24);
-    printf("%-16s %4d\n", "LIT", val);
+    ctx->cse_enabled = false;
+    Program *unshared = compile(ctx, expr);
+    ctx->cse_enabled = true;
+    Program *shared = compile(ctx, expr);
+    assert(program_eval(shared, inputs) == program_eval(unshared, inputs));
+    program_free(shared);
+    program_free(unshared);
 }
 
-void print_simple_instr(int offset)
+void cse_test()
 {
-    byte instr = code[offset];
-    printf("%-16s\n", instr_info[instr].name);
+    Context *ctx = context_new();
+    // A repeated subexpression is computed once at the bottom of the stack and
+    // copied for each use
+    Program *program = compile(ctx, "(a * b + c) * (a * b + c)");
+    static const byte shared_code[] = {
+        LOAD, 0, LOAD, 1, MULI, LOAD, 2, ADDI, PICK, 0, PICK, 1, MULI, SLIDE, 1, HALT,
+    };
+    assert(program->len == sizeof(shared_code));
+    assert(memcmp(program->code, shared_code, sizeof(shared_code)) == 0);
+    assert(program_eval(program, (int64_t[]){ 2, 3, 4 }) == 100);
+    program_free(program);
+
+    // Code parsed to run once isn't shared, since only programs are worth it
+    reset_code(ctx);
+    init_stream(ctx, "a * 2 * (a * 2)");
+    assert(parse_tree(ctx) == 6 && !ctx->nodes[2].shared);
+
+    // Only ops are shared. Repeated leaves are separate nodes that ops on them
+    // compare by value, so a tree without repeated ops keeps its post order.
+    reset_code(ctx);
+    ctx->cse_active = true;
+    init_stream(ctx, "(a + 1) * (a - 1) + a * 2 * (a * 2)");
+    assert(parse_tree(ctx) == 13 && buf_len(ctx->nodes) == 14);
+    for (int i = 0; i < 14; i++) {
+        assert(ctx->nodes[i].shared == (i == 9));
+    }
+
+    // One that folds is a literal at each use
+    program = compile(ctx, "(2 * 3 + 1) * a + (2 * 3 + 1)");
+    static const byte folded_code[] = { LIT8, 7, LOAD, 0, MULI, ADDK, 7, HALT };
+    assert(program->len == sizeof(folded_code));
+    assert(memcmp(program->code, folded_code, sizeof(folded_code)) == 0);
+    program_free(program);
+
+    static const char *exprs[] = {
+        "(a * b + c) * (a * b + c)",
+        "(a - c) / b + -(a - c) * (b - (a - c))",
+        "((a + 1) * (a + 1) + b) * ((a + 1) * (a + 1) + b) - (a + 1)",
+        "(2 * 3 + a) * (2 * 3) + (2 * 3 + a)",
+        "c * c / b + c * c / b - -c * -c",
+        "-(a / b) - -(a / b) * (a / b)",
+        "(a * 0.5 + b) * (a * 0.5 + b) - (1.5 * 2) * (1.5 * 2 + c)",
+    };
+    enum { NUM_EXPRS = sizeof(exprs) / sizeof(*exprs) };
+    for (int fold = 0; fold <= 1; fold++) {
+        ctx->fold_constants = fold;
+        assert_inputs_agree(ctx, exprs, NUM_EXPRS);
+        for (int i = 0; i < NUM_EXPRS; i++) {
+            assert_cse_agrees(ctx, exprs[i], (int64_t[]){ 1000003, -7, 99 });
+        }
+    }
+
+    // Shared values further down the stack than PICK reaches are recomputed
+    char *src = NULL;
+    for (int i = 1; i <= 300; i++) {
+        buf_printf(src, "%s(a * %d + b) * (a * %d + b)", i > 1 ? " + " : "", i, i);
+    }
+    assert_cse_agrees(ctx, src, (int64_t[]){ 12345, 678 });
+    const char *big[] = { src };
+    assert_inputs_agree(ctx, big, 1);
+    buf_free(src);
+    context_free(ctx);
 }
 
-#define HEX "%02hhX"
+// Evaluates expr with typed and with generic stack code, the generic code on
+// vm_run, the JIT and the batch evaluator, and checks they all agree
+void assert_typed_agrees(Context *ctx, const char *expr, const int64_t *inputs)
+{
+    Program *typed = compile(ctx, expr);
+    ctx->typed_ops = false;
+    Program *generic = compile(ctx, expr);
+    ctx->typed_ops = true;
+    int64_t expected = program_eval(typed, inputs);
+    assert(program_eval(generic, inputs) == expected);
+    JitCode jit;
+    if (jit_compile(generic->code, generic->len, &jit)) {
+        assert(jit.fn(inputs) == expected);
+        jit_free(&jit);
+    }
+    const int64_t *columns[] = { &inputs[0], &inputs[1], &inputs[2] };
+    int64_t result;
+    program_eval_batch(generic, columns, 1, &result);
+    assert(result == expected);
+    program_free(generic);
+    program_free(typed);
+}
 
-int print_instr(int offset)
+// Number of op instructions in code
+int count_op(const byte *code, size_t len, byte op)
 {
-    byte instr = code[offset];
-    int size = instr_info[instr].size; // TODO handle invalid instr (size=1)
-    // printf("instr:%d size:%d\n", instr, size);
+    int count = 0;
+    for (size_t offset = 0; offset < len; offset += instr_info[code[offset]].size) {
+        count += code[offset] == op;
+    }
+    return count;
+}
 
-    // Instruction bytes
-    printf("%06d ", offset);
-    for (int i = 0; i < size; ++i) {
-        printf(HEX " ", (byte)code[offset + i]);
+void typed_test()
+{
+    Context *ctx = context_new();
+    // Int operands of float ops are converted explicitly, and the float ops
+    // take no immediate
+    Program *program = compile(ctx, "a * 0.5 + b");
+    static const byte typed_code[] = {
+        LOAD, 0, I2F, LITF, 0, 0, 0, 0, 0, 0, 0xE0, 0x3F, MULF, LOAD, 1, I2F, ADDF, HALT,
+    };
+    assert(program->len == sizeof(typed_code));
+    assert(memcmp(program->code, typed_code, sizeof(typed_code)) == 0);
+    assert(program->type == TYPE_FLOAT);
+    program_free(program);
+
+    // Generic ops convert for themselves, and their immediate says which
+    // operands are floats
+    ctx->typed_ops = false;
+    program = compile(ctx, "a * 0.5 + b");
+    static const byte generic_code[] = {
+        LOAD, 0, LITF, 0, 0, 0, 0, 0, 0, 0xE0, 0x3F, MUL, 2, LOAD, 1, ADD, 1, HALT,
+    };
+    assert(program->len == sizeof(generic_code));
+    assert(memcmp(program->code, generic_code, sizeof(generic_code)) == 0);
+    program_free(program);
+    ctx->typed_ops = true;
+
+    // A left operand converted after the right one is computed is still
+    // converted before it, and a value converted twice is converted once
+    program = compile(ctx, "(a - b) / 2.5 - (a - b) * 4.0");
+    assert(count_op(program->code, program->len, I2F) == 1);
+    assert(program_eval(program, (int64_t[]){ 7, 2 }) == c_word(5 / 2.5 - 5 * 4.0));
+    program_free(program);
+    program = compile(ctx, "a - b * 0.5");
+    assert(count_op(program->code, program->len, I2F) == 2);
+    assert(program_eval(program, (int64_t[]){ 3, 3 }) == c_word(3 - 3 * 0.5));
+    program_free(program);
+
+    static const char *exprs[] = {
+        "a + b * c",
+        "-(a / b) - c",
+        "a * 0.5 + b",
+        "1.5 - a",
+        "-(a * 1.5) / b - -a",
+        "(a - 1) * (a + 1) / (b * 2.0)",
+        "a / 4.0 + c / b - -c * 0.25",
+        "(a * 0.5 + b) * (a * 0.5 + b) - (1.5 * 2) * (1.5 * 2 + c)",
+        "2 * 1.5 + -(3 / 2) * 0.5 - -1.5",
+    };
+    for (int fold = 0; fold <= 1; fold++) {
+        ctx->fold_constants = fold;
+        for (size_t i = 0; i < sizeof(exprs) / sizeof(*exprs); i++) {
+            assert_typed_agrees(ctx, exprs[i], (int64_t[]){ 1000003, -7, 99 });
+            assert_typed_agrees(ctx, exprs[i], (int64_t[]){ INT64_MIN, 3, -1 });
+        }
     }
-    for (int i = size; i < 5; ++i) {
-        printf("   ");
+    context_free(ctx);
+}
+
+// Runs "100 / d" over divisors in a child process and returns its exit status
+int batch_exit_status(Context *ctx, const int64_t *divisors, size_t num_rows)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        Program *program = compile(ctx, "100 / d");
+        int64_t *results = xmalloc(num_rows * sizeof(int64_t));
+        program_eval_batch(program, &divisors, num_rows, results);
+        exit(0);
     }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
 
-    switch (instr) {
-        case LIT:
-            print_lit_instr(offset);
-            break;
-        default:
-            print_simple_instr(offset);
-            break;
+void batch_test()
+{
+    Context *ctx = context_new();
+    static const char *exprs[] = {
+        "7",
+        "a",
+        "a + b * c",
+        "(a - 1) * (a + 1) / b - c / 3",
+        "-(c * 5) + a / -1 - b * -100",
+        "c / b / b * -(a - 2 * 3) + 9223372036854775807",
+        "a * 0.5 - b / 3.0 + c",
+        "-(c * 1.5) / b - -a",
+    };
+    enum { NUM_ROWS = 2 * BATCH_LANES + 5 };
+    int64_t columns[3][NUM_ROWS];
+    for (int row = 0; row < NUM_ROWS; row++) {
+        int shift = row % 2 ? 0 : 48;
+        columns[0][row] = (int64_t)rng_next() >> shift;
+        columns[1][row] = ((int64_t)rng_next() >> (shift + 8)) | 1;
+        columns[2][row] = (int64_t)rng_next() >> shift;
     }
-    return size;
+    // Overflowing division wraps in its own lane
+    columns[0][3] = INT64_MIN;
+    columns[1][3] = -1;
+
+    // Every SIMD level matches program_eval row by row, with and without a
+    // partial last block
+    for (SimdLevel level = 0; level <= simd_max_level(); level++) {
+        set_simd_level(level);
+        for (size_t i = 0; i < sizeof(exprs) / sizeof(*exprs); i++) {
+            Program *program = compile(ctx, exprs[i]);
+            const int64_t *inputs[3];
+            const char *names[] = { "a", "b", "c" };
+            for (int k = 0; k < 3; k++) {
+                int slot = program_input_slot(program, names[k]);
+                if (slot >= 0) {
+                    inputs[slot] = columns[k];
+                }
+            }
+            size_t sizes[] = { 0, 1, BATCH_LANES, NUM_ROWS };
+            for (int j = 0; j < 4; j++) {
+                int64_t results[NUM_ROWS + 1];
+                results[sizes[j]] = 12345;
+                program_eval_batch(program, inputs, sizes[j], results);
+                assert(results[sizes[j]] == 12345);
+                for (size_t row = 0; row < sizes[j]; row++) {
+                    int64_t in[3];
+                    for (int s = 0; s < program->num_inputs; s++) {
+                        in[s] = inputs[s][row];
+                    }
+                    assert(results[row] == program_eval(program, in));
+                }
+            }
+            program_free(program);
+        }
+    }
+    set_simd_level(simd_max_level());
+
+    // A zero divisor in any lane is fatal, padding lanes included
+    int64_t divisors[NUM_ROWS];
+    for (int row = 0; row < NUM_ROWS; row++) {
+        divisors[row] = row + 1;
+    }
+    assert(batch_exit_status(ctx, divisors, NUM_ROWS) == 0);
+    divisors[BATCH_LANES + 1] = 0;
+    assert(batch_exit_status(ctx, divisors, NUM_ROWS) == 1);
+    divisors[BATCH_LANES + 1] = 1;
+    divisors[NUM_ROWS - 1] = 0;
+    assert(batch_exit_status(ctx, divisors, NUM_ROWS) == 1);
+    assert(batch_exit_status(ctx, divisors, NUM_ROWS - 1) == 0);
+
+    // The row named is the first to fail, even when a later row fails in an
+    // earlier DIV
+    Program *program = compile(ctx, "a / b + c / d");
+    int64_t ones[NUM_ROWS], with_zero[2][NUM_ROWS];
+    for (int row = 0; row < NUM_ROWS; row++) {
+        ones[row] = with_zero[0][row] = with_zero[1][row] = 1;
+    }
+    with_zero[0][10] = 0;
+    with_zero[1][5] = 0;
+    const int64_t *inputs[] = { ones, with_zero[0], ones, with_zero[1] };
+    int64_t results[NUM_ROWS];
+    FatalHandler handler;
+    if (setjmp(handler.jmp) == 0) {
+        fatal_handler = &handler;
+        program_eval_batch(program, inputs, NUM_ROWS, results);
+        assert(!"division by zero not caught");
+    }
+    fatal_handler = NULL;
+    assert(strcmp(handler.message, "program_eval_batch: division by zero in row 5") == 0);
+    program_free(program);
+    context_free(ctx);
+}
+
+// Runs src through run_source and returns what it printed
+char *run_source_str(Context *ctx, const char *src, int flags)
+{
+    char *output;
+    size_t len;
+    FILE *out = open_memstream(&output, &len);
+    run_source(ctx, "<test>", src, src + strlen(src), out, stderr, flags);
+    fclose(out);
+    return output;
 }
 
-void print_disassembly()
+typedef struct StressJob {
+    int id;
+    const char *src;
+    const char *expected; // what src printed on a single thread
+    int flags;
+} StressJob;
+
+void *stress_worker(void *arg)
 {
-    printf("OFFSET B0 B1 B2 B3 B4 OPCODE\n");
-    printf("------ -- -- -- -- -- ----------------\n");
-    for (int offset = 0, max = buf_len(code); offset < max;) {
-        offset += print_instr(offset);
+    StressJob *job = arg;
+    Context *ctx = context_new();
+    for (int round = 0; round < 3; round++) {
+        char *output = run_source_str(ctx, job->src, job->flags);
+        assert(strcmp(output, job->expected) == 0);
+        free(output);
     }
-    puts("");
+    // Names no other thread uses, so the intern table grows under contention
+    for (int i = 0; i < 500; i++) {
+        char src[64], name[32];
+        snprintf(name, sizeof(name), "x%d_%d", job->id, i);
+        snprintf(src, sizeof(src), "%s * 2 + y", name);
+        Program *program = compile(ctx, src);
+        assert(program_input_slot(program, name) == 0);
+        assert(program_input_slot(program, "y") == 1);
+        assert(program_eval(program, (int64_t[]){ i, 1 }) == 2 * i + 1);
+        program_free(program);
+    }
+    context_free(ctx);
+    return NULL;
 }
 
-#define assert_compile_expr(x) \
-    (buf_free(code), parse_expr_str(#x), buf_push(code, HALT), assert(vm_exec(code) == (x)))
+// Independent contexts compile and run concurrently and get the same results as
+// on one thread. make tsan runs this under ThreadSanitizer.
+void threads_test()
+{
+    enum { NUM_THREADS = 8 };
+    static const int variants[] = { 0, RUN_PRELEX, RUN_REGISTERS, RUN_JIT };
+    Context *ctx = context_new();
+    StressJob jobs[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        jobs[i].id = i;
+        jobs[i].src = gen_expr_corpus(8 * 1024, 5);
+        jobs[i].flags = variants[i % 4];
+        jobs[i].expected = run_source_str(ctx, jobs[i].src, 0);
+    }
+    context_free(ctx);
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, stress_worker, &jobs[i]) == 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        free((char *)jobs[i].src);
+        free((char *)jobs[i].expected);
+    }
+}
 
-void compile_test()
+// Rewrites the checksum of an image edited in place, so that image_open gets
+// past it to the checks behind
+void reseal_image(char *image, size_t size)
 {
-    // clang-format off
-    assert_compile_expr(1);
-    assert_compile_expr(-1);
-    assert_compile_expr(1+2);
-    assert_compile_expr(2*3);
-    assert_compile_expr((2*3)+(4*5));
-    assert_compile_expr(10/2);
-    // clang-format off
+    ((ImageHeader *)image)->checksum = image_checksum(image, image + size);
 }
 
-#undef assert_compile_expr
+void image_test()
+{
+    Context *ctx = context_new();
+    static const char *exprs[] = {
+        "x * x - 2 * y / (x - y)", "y + 1", "7 * 6", "z", "y / 2.0",
+    };
+    enum { NUM_EXPRS = sizeof(exprs) / sizeof(*exprs) };
+    Program *programs[NUM_EXPRS];
+    for (int i = 0; i < NUM_EXPRS; i++) {
+        programs[i] = compile(ctx, exprs[i]);
+    }
+    size_t size;
+    char *data = image_build(programs, NUM_EXPRS, &size);
+    assert(is_image(data, data + size));
+    ImageHeader *hdr = (ImageHeader *)data;
+    // Each program's inputs are listed, but "y" is stored once
+    assert(hdr->num_programs == NUM_EXPRS && hdr->num_inputs == 5 && hdr->num_names == 3);
+
+    // The opened programs run the image's code in place and agree with the
+    // originals
+    Image image;
+    assert(image_open(&image, data, data + size) == NULL);
+    assert(image.num_programs == NUM_EXPRS);
+    for (int i = 0; i < NUM_EXPRS; i++) {
+        const Program *program = &image.programs[i];
+        assert(program->code >= (byte *)data && program->code < (byte *)data + size);
+        assert(program->num_inputs == programs[i]->num_inputs);
+        assert(program->max_depth == programs[i]->max_depth);
+        assert(program->type == programs[i]->type);
+        for (int j = 0; j < program->num_inputs; j++) {
+            assert(program->inputs[j] == programs[i]->inputs[j]);
+        }
+        int64_t inputs[] = { 3, 1 };
+        assert(program_eval(program, inputs) == program_eval(programs[i], inputs));
+    }
+    assert(program_input_slot(&image.programs[1], "y") == 0);
+    image_close(&image);
+
+    // Damage is caught by the checksum, and anything the checksum doesn't
+    // catch by the structural checks or the verifier
+    char *bad = xmalloc(size);
+    static const struct {
+        size_t offset;
+        char val;
+        bool reseal;
+        const char *error;
+    } damage[] = {
+        { 0, 'T', false, "not an image" },
+        { offsetof(ImageHeader, version), IMAGE_VERSION + 1, false, "unsupported version" },
+        { offsetof(ImageHeader, code_size), 1, false, "size doesn't match the header" },
+        { sizeof(ImageHeader), 1, false, "checksum mismatch" },
+        { sizeof(ImageHeader), 100, true, "code out of range" },
+        { sizeof(ImageHeader) + offsetof(ImageProgram, num_inputs), 0, true,
+          "input out of range" },
+        { sizeof(ImageHeader) + offsetof(ImageProgram, type), 2, true,
+          "unknown result type" },
+        { sizeof(ImageHeader) + NUM_EXPRS * sizeof(ImageProgram), 9, true,
+          "name out of range" },
+    };
+    for (size_t i = 0; i < sizeof(damage) / sizeof(*damage); i++) {
+        memcpy(bad, data, size);
+        bad[damage[i].offset] = damage[i].val;
+        if (damage[i].reseal) {
+            reseal_image(bad, size);
+        }
+        assert(strcmp(image_open(&image, bad, bad + size), damage[i].error) == 0);
+    }
+    memcpy(bad, data, size);
+    bad[size - 1] = NEGI; // the last HALT
+    reseal_image(bad, size);
+    assert(strcmp(image_open(&image, bad, bad + size), "missing HALT") == 0);
+    const char *error = image_open(&image, data, data + size - 1);
+    assert(strcmp(error, "size doesn't match the header") == 0);
+    free(bad);
+
+    // Code with a DIVK of 0 or -1 has a valid checksum but is rejected before
+    // it can trap, even with the dividend at INT64_MIN
+    static const byte divk_zero[] = { LIT8, 7, DIVK, 0, HALT };
+    static const byte divk_minus_one[] = {
+        LIT64, 0, 0, 0, 0, 0, 0, 0, 0x80, DIVK, 0xff, HALT,
+    };
+    Program divk_programs[] = {
+        { .code = divk_zero, .len = sizeof(divk_zero), .max_depth = 1 },
+        { .code = divk_minus_one, .len = sizeof(divk_minus_one), .max_depth = 1 },
+    };
+    for (int i = 0; i < 2; i++) {
+        Program *program = &divk_programs[i];
+        bad = image_build(&program, 1, &size);
+        assert(strcmp(image_open(&image, bad, bad + size), "DIVK by 0 or -1") == 0);
+        free(bad);
+    }
+
+    // An empty image is fine
+    char *empty = image_build(NULL, 0, &size);
+    assert(image_open(&image, empty, empty + size) == NULL && image.num_programs == 0);
+    image_close(&image);
+    free(empty);
+
+    // Images written with -c run like their source, without recompiling
+    const char src[] = "1 + 2;\n2 * (3 + 4);\n-8 / 2";
+    char *src_path = write_temp_file(src, strlen(src));
+    char *image_path = write_temp_file("", 0);
+    assert(write_image(image_path, &src_path, 1) == 0);
+    char *out = run_source_str(ctx, src, 0);
+    char *image_out = NULL;
+    size_t image_out_len;
+    FILE *f = open_memstream(&image_out, &image_out_len);
+    assert(run_file(ctx, image_path, f, stderr, 0) == 0);
+    fclose(f);
+    assert(strcmp(image_out, out) == 0 && strcmp(out, "3\n14\n-4\n") == 0);
+    free(image_out);
+    free(out);
+    unlink(image_path);
+    unlink(src_path);
+    free(image_path);
+    free(src_path);
+
+    for (int i = 0; i < NUM_EXPRS; i++) {
+        program_free(programs[i]);
+    }
+    free(data);
+    context_free(ctx);
+}
 
 void run_tests()
 {
     buf_test();
+    arena_test();
     str_intern_test();
+    str_intern_threads_test();
+    str_intern_stress_test();
+    skip_test();
     lex_test();
+    float_test();
+    token_stream_test();
     parse_test();
     vm_test();
+    reg_test();
+    peephole_test();
     compile_test();
+    fold_test();
+    jit_test();
+    c_test();
+    program_test();
+    cse_test();
+    typed_test();
+    batch_test();
+    threads_test();
+    file_test();
+    image_test();
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} benchmarks[] = {
+    { "intern", intern_bench },
+    { "lex", lex_bench },
+    { "float", float_bench },
+    { "parse", parse_bench },
+    { "vm", vm_bench },
+    { "eval", eval_bench },
+    { "batch", batch_bench },
+    { "image", image_bench },
+    { "cse", cse_bench },
+    { "typed", typed_bench },
+};
+
+// Runs the named benchmarks, or all of them if none are named
+void run_benchmarks(int num_names, char **names)
+{
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+        bool selected = num_names == 0;
+        for (int j = 0; j < num_names; j++) {
+            selected |= strcmp(names[j], benchmarks[i].name) == 0;
+        }
+        if (selected) {
+            benchmarks[i].fn();
+        }
+    }
 }
 
 int main(int argc, char *argv[])
 {
-    run_tests();
+    init_lexer();
+    if (argc == 1) {
+        run_tests();
+        return 0;
+    }
+    if (strcmp(argv[1], "--bench") == 0) {
+        run_benchmarks(argc - 2, argv + 2);
+        return 0;
+    }
+    int flags = 0;
+    const char *image_path = NULL;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            image_path = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0) {
+            flags |= RUN_PRELEX;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            flags |= RUN_TIMES;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            flags |= RUN_REGISTERS;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            flags |= RUN_JIT;
+        } else if (strcmp(argv[i], "-C") == 0) {
+            flags |= RUN_C;
+        } else {
+            break;
+        }
+    }
+    if (i < argc && argv[i][0] != '-') {
+        if (image_path) {
+            return write_image(image_path, argv + i, argc - i);
+        }
+        return run_files(argv + i, argc - i, stdout, stderr, flags);
+    }
+    fprintf(
+        stderr, "usage: %s [--bench [name...] | [-p] [-r|-j|-C] [-t] <file>...]\n",
+        argv[0]);
+    fprintf(stderr, "       %s -c <image> <file>...\n", argv[0]);
+    fprintf(stderr, "  several files are run concurrently, one thread per CPU\n");
+    fprintf(stderr, "  -c  compile the files into one bytecode image, run like a file\n");
+    fprintf(stderr, "  -p  lex the whole file before parsing\n");
+    fprintf(stderr, "  -r  run on the register machine instead of the stack machine\n");
+    fprintf(stderr, "  -j  compile to native code where supported\n");
+    fprintf(stderr, "  -C  compile the whole file to C and load it with dlopen\n");
+    fprintf(stderr, "  -t  print lex, parse and run times to stderr\n");
+    return 1;
 }